@@ -9,8 +9,15 @@ internal sealed class NvencConfigView : UserControl
     private readonly ComboBox _rateControlComboBox;
     private readonly TextBox _bitrateTextBox;
     private readonly ComboBox _qualityComboBox;
+    private readonly ComboBox _bFramesComboBox;
+    private readonly CheckBox _openGopCheckBox;
+    private readonly ComboBox _sessionsComboBox;
+    private readonly ComboBox _containerComboBox;
+    private readonly ComboBox _fileBackendComboBox;
     private readonly CheckBox _hevcAsyncCheckBox;
     private readonly CheckBox _debugLogCheckBox;
+    private readonly CheckBox _resumeCheckBox;
+    private readonly TextBox _queueLimitTextBox;
     private readonly NvencSettings _settings;
 
     public NvencConfigView(NvencSettings settings)
@@ -107,6 +114,118 @@ internal sealed class NvencConfigView : UserControl
         };
         panel.Children.Add(_qualityComboBox);
 
+        panel.Children.Add(new TextBlock
+        {
+            Text = "B フレーム数",
+            Margin = new Thickness(0, 0, 0, 4),
+        });
+
+        _bFramesComboBox = new ComboBox
+        {
+            Margin = new Thickness(0, 0, 0, 12),
+            ItemsSource = new[] { "なし", "1", "2", "3", "4" },
+            SelectedIndex = Math.Clamp(_settings.BFrames, 0, 4),
+        };
+        _bFramesComboBox.SelectionChanged += (_, _) =>
+        {
+            _settings.BFrames = Math.Clamp(_bFramesComboBox.SelectedIndex, 0, 4);
+        };
+        panel.Children.Add(_bFramesComboBox);
+
+        _openGopCheckBox = new CheckBox
+        {
+            Content = "オープン GOP（圧縮効率優先）",
+            IsChecked = _settings.OpenGop,
+            Margin = new Thickness(0, 0, 0, 12),
+        };
+        _openGopCheckBox.Checked += (_, _) => _settings.OpenGop = true;
+        _openGopCheckBox.Unchecked += (_, _) => _settings.OpenGop = false;
+        panel.Children.Add(_openGopCheckBox);
+
+        panel.Children.Add(new TextBlock
+        {
+            Text = "並列エンコード（NVENC セッション数）",
+            Margin = new Thickness(0, 0, 0, 4),
+        });
+
+        _sessionsComboBox = new ComboBox
+        {
+            Margin = new Thickness(0, 0, 0, 12),
+            ItemsSource = new[] { "1（標準）", "2", "3" },
+            SelectedIndex = Math.Clamp(_settings.EncoderSessions, 1, 3) - 1,
+        };
+        _sessionsComboBox.SelectionChanged += (_, _) =>
+        {
+            _settings.EncoderSessions = Math.Clamp(_sessionsComboBox.SelectedIndex + 1, 1, 3);
+        };
+        panel.Children.Add(_sessionsComboBox);
+
+        panel.Children.Add(new TextBlock
+        {
+            Text = "MP4 形式",
+            Margin = new Thickness(0, 0, 0, 4),
+        });
+
+        _containerComboBox = new ComboBox
+        {
+            Margin = new Thickness(0, 0, 0, 12),
+            ItemsSource = new[] { "標準", "フラグメント (fMP4)", "ファストスタート (moov 先頭)" },
+            SelectedIndex = (int)_settings.Container,
+        };
+        _containerComboBox.SelectionChanged += (_, _) =>
+        {
+            _settings.Container = (NvencContainer)Math.Clamp(_containerComboBox.SelectedIndex, 0, 2);
+        };
+        panel.Children.Add(_containerComboBox);
+
+        panel.Children.Add(new TextBlock
+        {
+            Text = "書き込み方式",
+            Margin = new Thickness(0, 0, 0, 4),
+        });
+
+        _fileBackendComboBox = new ComboBox
+        {
+            Margin = new Thickness(0, 0, 0, 12),
+            ItemsSource = new[] { "標準", "非同期 (キャッシュなし)" },
+            SelectedIndex = (int)_settings.FileBackend,
+        };
+        _fileBackendComboBox.SelectionChanged += (_, _) =>
+        {
+            _settings.FileBackend = (NvencFileBackend)Math.Clamp(_fileBackendComboBox.SelectedIndex, 0, 1);
+        };
+        panel.Children.Add(_fileBackendComboBox);
+
+        _resumeCheckBox = new CheckBox
+        {
+            Content = "中断した出力の続きから再開する",
+            IsChecked = _settings.ResumeInterrupted,
+            Margin = new Thickness(0, 0, 0, 12),
+        };
+        _resumeCheckBox.Checked += (_, _) => _settings.ResumeInterrupted = true;
+        _resumeCheckBox.Unchecked += (_, _) => _settings.ResumeInterrupted = false;
+        panel.Children.Add(_resumeCheckBox);
+
+        panel.Children.Add(new TextBlock
+        {
+            Text = "書き込み待ちの上限メモリ（MB）",
+            Margin = new Thickness(0, 0, 0, 4),
+        });
+
+        _queueLimitTextBox = new TextBox
+        {
+            Text = _settings.QueueLimitMb.ToString(),
+            Margin = new Thickness(0, 0, 0, 12),
+        };
+        _queueLimitTextBox.TextChanged += (_, _) =>
+        {
+            if (int.TryParse(_queueLimitTextBox.Text, out var value))
+            {
+                _settings.QueueLimitMb = Math.Clamp(value, 64, 8192);
+            }
+        };
+        panel.Children.Add(_queueLimitTextBox);
+
         panel.Children.Add(new TextBlock
         {
             Text = "ビットレート（kbps）",
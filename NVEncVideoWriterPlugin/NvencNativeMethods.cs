@@ -19,8 +19,20 @@ internal static class NvencNativeMethods
         int bufferFormat,
         int hevcAsync,
         int enableDebugLog,
+        int containerMode,
+        int expectedFrameCount,
+        int interleaveMs,
+        int fileBackend,
+        int resume,
+        int queueLimitMb,
+        int bFrames,
+        int openGop,
+        int sessions,
         string outputPath);
 
+    [DllImport("NvencNative.dll")]
+    public static extern int NvencGetResumeFrame(IntPtr handle);
+
     [DllImport("NvencNative.dll")]
     public static extern int NvencEncode(IntPtr handle, IntPtr texture);
 
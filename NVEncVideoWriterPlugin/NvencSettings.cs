@@ -8,6 +8,13 @@ internal sealed class NvencSettings
     public NvencRateControl RateControl { get; set; } = NvencRateControl.YouTubeRecommended;
     public bool HevcAsync { get; set; } = true;
     public bool EnableDebugLog { get; set; }
+    public NvencContainer Container { get; set; } = NvencContainer.Standard;
+    public NvencFileBackend FileBackend { get; set; } = NvencFileBackend.Standard;
+    public bool ResumeInterrupted { get; set; }
+    public int QueueLimitMb { get; set; } = 512;
+    public int BFrames { get; set; }
+    public bool OpenGop { get; set; }
+    public int EncoderSessions { get; set; } = 1;
 }
 
 internal enum NvencCodec
@@ -23,6 +30,19 @@ internal enum NvencQuality
     Quality,
 }
 
+internal enum NvencContainer
+{
+    Standard,
+    Fragmented,
+    FastStart,
+}
+
+internal enum NvencFileBackend
+{
+    Standard,
+    Overlapped,
+}
+
 internal enum NvencRateControl
 {
     Fixed,
@@ -10,18 +10,26 @@ namespace NVEncVideoWriterPlugin;
 
 internal sealed class NvencVideoFileWriter : IVideoFileWriter2, IDisposable
 {
+    // 映像と音声をまとめて書き出す単位 (ms)。大きいほどチャンク数が減る。
+    private const int InterleaveWindowMs = 500;
+
     private readonly string _outputPath;
     private readonly VideoInfo _videoInfo;
     private readonly NvencSettings _settings;
+    private readonly int _expectedFrameCount;
     private IntPtr _encoderHandle = IntPtr.Zero;
+    // 再開時、既に出力済みのためエンコードせず読み飛ばす残りの映像フレーム数と音声サンプル数。
+    private long _skipFrames;
+    private long _skipAudioSamples;
     private bool _disposed;
     private readonly object _encodeLock = new();
 
-    public NvencVideoFileWriter(string outputPath, VideoInfo videoInfo, NvencSettings settings)
+    public NvencVideoFileWriter(string outputPath, VideoInfo videoInfo, NvencSettings settings, int expectedFrameCount)
     {
         _outputPath = outputPath;
         _videoInfo = videoInfo;
         _settings = settings;
+        _expectedFrameCount = expectedFrameCount;
     }
 
     public VideoFileWriterSupportedStreams SupportedStreams => VideoFileWriterSupportedStreams.Audio | VideoFileWriterSupportedStreams.Video;
@@ -76,6 +84,12 @@ internal sealed class NvencVideoFileWriter : IVideoFileWriter2, IDisposable
                 InitializeEncoder(texture);
             }
 
+            if (_skipFrames > 0)
+            {
+                _skipFrames--;
+                return;
+            }
+
             var result = NvencNativeMethods.NvencEncode(_encoderHandle, texture.NativePointer);
             if (result == 0)
             {
@@ -145,6 +159,15 @@ internal sealed class NvencVideoFileWriter : IVideoFileWriter2, IDisposable
             bufferFormat,
             _settings.HevcAsync ? 1 : 0,
             _settings.EnableDebugLog ? 1 : 0,
+            (int)_settings.Container,
+            _expectedFrameCount,
+            InterleaveWindowMs,
+            (int)_settings.FileBackend,
+            _settings.ResumeInterrupted ? 1 : 0,
+            _settings.QueueLimitMb,
+            _settings.BFrames,
+            _settings.OpenGop ? 1 : 0,
+            _settings.EncoderSessions,
             _outputPath);
 
         if (_encoderHandle == IntPtr.Zero)
@@ -160,6 +183,13 @@ internal sealed class NvencVideoFileWriter : IVideoFileWriter2, IDisposable
             throw new InvalidOperationException(error);
         }
 
+        var resumeFrame = NvencNativeMethods.NvencGetResumeFrame(_encoderHandle);
+        if (resumeFrame > 0)
+        {
+            _skipFrames = resumeFrame;
+            _skipAudioSamples = (long)resumeFrame * Math.Max(8000, _videoInfo.Hz) / fps * ResolveAudioChannels();
+        }
+
         if (_pendingAudio.Count > 0)
         {
             var buffer = _pendingAudio.ToArray();
@@ -170,6 +200,18 @@ internal sealed class NvencVideoFileWriter : IVideoFileWriter2, IDisposable
 
     private void WriteAudioInternal(float[] samples)
     {
+        if (_skipAudioSamples > 0)
+        {
+            if (samples.Length <= _skipAudioSamples)
+            {
+                _skipAudioSamples -= samples.Length;
+                return;
+            }
+
+            samples = samples[(int)_skipAudioSamples..];
+            _skipAudioSamples = 0;
+        }
+
         var sampleRate = Math.Max(8000, _videoInfo.Hz);
         var channels = ResolveAudioChannels();
         var result = NvencNativeMethods.NvencWriteAudio(_encoderHandle, samples, samples.Length, sampleRate, channels);
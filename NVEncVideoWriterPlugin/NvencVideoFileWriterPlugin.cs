@@ -9,6 +9,8 @@ namespace NVEncVideoWriterPlugin;
 public sealed class NvencVideoFileWriterPlugin : IVideoFileWriterPlugin
 {
     private readonly NvencSettings _settings = new();
+    // 出力設定画面を開いたときの長さ (フレーム数)。VideoInfo から長さを取れないときだけ使う。
+    private int _configViewLength;
     private readonly PluginDetailsAttribute _details = new()
     {
         AuthorName = "NVEncC GUI Plugin",
@@ -33,8 +35,39 @@ public sealed class NvencVideoFileWriterPlugin : IVideoFileWriterPlugin
             RateControl = _settings.RateControl,
             HevcAsync = _settings.HevcAsync,
             EnableDebugLog = _settings.EnableDebugLog,
+            Container = _settings.Container,
+            FileBackend = _settings.FileBackend,
+            ResumeInterrupted = _settings.ResumeInterrupted,
+            QueueLimitMb = _settings.QueueLimitMb,
+            BFrames = _settings.BFrames,
+            OpenGop = _settings.OpenGop,
+            EncoderSessions = _settings.EncoderSessions,
         };
-        return new NvencVideoFileWriter(path, videoInfo, snapshot);
+        var expectedFrameCount = ResolveExpectedFrameCount(videoInfo);
+        // 設定画面を経ずに続けて出力されたとき、別の出力の長さを使わないよう一度で捨てる。
+        _configViewLength = 0;
+        return new NvencVideoFileWriter(path, videoInfo, snapshot, expectedFrameCount);
+    }
+
+    // faststart の moov 予約サイズの見積もりに使う出力フレーム数。0 は不明。
+    private int ResolveExpectedFrameCount(VideoInfo videoInfo)
+    {
+        var type = videoInfo.GetType();
+        var frames = type.GetProperty("Length")
+            ?? type.GetProperty("FrameCount")
+            ?? type.GetProperty("TotalFrames");
+        switch (frames?.GetValue(videoInfo))
+        {
+            case int value when value > 0:
+                return value;
+            case long value when value > 0:
+                return (int)Math.Min(value, int.MaxValue);
+        }
+        if (type.GetProperty("Duration")?.GetValue(videoInfo) is TimeSpan duration && duration > TimeSpan.Zero)
+        {
+            return (int)Math.Min(Math.Ceiling(duration.TotalSeconds * Math.Max(1, videoInfo.FPS)), int.MaxValue);
+        }
+        return _configViewLength;
     }
 
     public string GetFileExtention()
@@ -44,6 +77,7 @@ public sealed class NvencVideoFileWriterPlugin : IVideoFileWriterPlugin
 
     public System.Windows.UIElement GetVideoConfigView(string projectName, VideoInfo videoInfo, int length)
     {
+        _configViewLength = Math.Max(0, length);
         return new NvencConfigView(_settings);
     }
 
@@ -0,0 +1,5156 @@
+#include "NvencCore.h"
+
+#include <cstring>
+#include <ctime>
+#include <cwchar>
+#include <new>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+namespace NvencCore
+{
+    // Sequential writes are gathered into aligned slots that are handed to the OS
+    // asynchronously, several at a time. Any other access first commits the staged
+    // bytes and waits for the queue, so reads and header patches see every earlier write.
+    struct StagedFileBackend : FileBackend
+    {
+        static constexpr size_t kSlotSize = 1 << 20;
+        static constexpr size_t kSlotCount = 4;
+        static constexpr size_t kBufferAlignment = 4096;
+
+        size_t alignment = 1;
+        uint8_t* slots[kSlotCount] = {};
+        bool inFlight[kSlotCount] = {};
+        size_t slotBytes[kSlotCount] = {};
+        uint64_t slotOffsets[kSlotCount] = {};
+        uint8_t* bounce = nullptr;
+        size_t current = 0;
+        bool staging = false;
+        uint64_t stageBase = 0;
+        size_t stageFill = 0;
+        uint64_t fileEnd = 0;
+
+        explicit StagedFileBackend(size_t blockAlignment)
+            : alignment(blockAlignment)
+        {
+        }
+
+        ~StagedFileBackend() override
+        {
+            for (uint8_t*& slot : slots)
+            {
+                ::operator delete(slot, std::align_val_t(kBufferAlignment));
+                slot = nullptr;
+            }
+            ::operator delete(bounce, std::align_val_t(kBufferAlignment));
+        }
+
+        virtual bool OpenFile(const std::wstring& path, bool existing, uint64_t* length) = 0;
+        virtual bool SubmitWrite(size_t slot, uint64_t offset, size_t size) = 0;
+        virtual bool WaitWrite(size_t slot) = 0;
+        // offset, size and buffer are multiples of alignment; *read may stop short at end of file.
+        virtual bool ReadBlocks(uint64_t offset, uint8_t* buffer, size_t size, size_t* read) = 0;
+        virtual bool CloseFile(uint64_t size) = 0;
+
+        bool Open(const std::wstring& path, bool existing, uint64_t* length) override
+        {
+            for (uint8_t*& slot : slots)
+            {
+                if (!slot)
+                {
+                    slot = static_cast<uint8_t*>(::operator new(kSlotSize, std::align_val_t(kBufferAlignment)));
+                }
+            }
+            if (!bounce)
+            {
+                bounce = static_cast<uint8_t*>(::operator new(kSlotSize, std::align_val_t(kBufferAlignment)));
+            }
+            current = 0;
+            staging = false;
+            *length = 0;
+            bool ok = OpenFile(path, existing, length);
+            fileEnd = *length;
+            return ok;
+        }
+
+        size_t AlignUp(size_t value) const
+        {
+            return (value + alignment - 1) & ~(alignment - 1);
+        }
+
+        bool WriteAt(uint64_t offset, const void* data, size_t size) override
+        {
+            if (!staging || offset != stageBase + stageFill)
+            {
+                if (!Commit() || !BeginStage(offset))
+                {
+                    return false;
+                }
+            }
+
+            const auto* bytes = static_cast<const uint8_t*>(data);
+            while (size > 0)
+            {
+                size_t chunk = std::min(size, kSlotSize - stageFill);
+                memcpy(slots[current] + stageFill, bytes, chunk);
+                stageFill += chunk;
+                bytes += chunk;
+                size -= chunk;
+                if (stageFill == kSlotSize && !SubmitStage())
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool ReadAt(uint64_t offset, void* data, size_t size) override
+        {
+            if (!Commit())
+            {
+                return false;
+            }
+
+            auto* out = static_cast<uint8_t*>(data);
+            while (size > 0)
+            {
+                uint64_t block = offset & ~static_cast<uint64_t>(alignment - 1);
+                size_t skip = static_cast<size_t>(offset - block);
+                size_t chunk = std::min(size, kSlotSize - skip);
+                size_t read = 0;
+                if (!ReadBlocks(block, bounce, AlignUp(skip + chunk), &read) || read < skip + chunk)
+                {
+                    return false;
+                }
+                memcpy(out, bounce + skip, chunk);
+                out += chunk;
+                offset += chunk;
+                size -= chunk;
+            }
+            return true;
+        }
+
+        bool Close(uint64_t size) override
+        {
+            bool ok = Commit();
+            return CloseFile(size) && ok;
+        }
+
+        // Loads one aligned block into bounce, zero-filled past the end of the file.
+        bool LoadBlock(uint64_t offset)
+        {
+            size_t read = 0;
+            if (offset < fileEnd && !ReadBlocks(offset, bounce, alignment, &read))
+            {
+                return false;
+            }
+            memset(bounce + read, 0, alignment - read);
+            return true;
+        }
+
+        bool BeginStage(uint64_t offset)
+        {
+            stageBase = offset & ~static_cast<uint64_t>(alignment - 1);
+            stageFill = static_cast<size_t>(offset - stageBase);
+            staging = true;
+            if (stageFill > 0)
+            {
+                // Keep the bytes that already share the first block with this write.
+                if (!LoadBlock(stageBase))
+                {
+                    staging = false;
+                    return false;
+                }
+                memcpy(slots[current], bounce, stageFill);
+            }
+            return true;
+        }
+
+        bool WaitSlot(size_t slot)
+        {
+            if (!inFlight[slot])
+            {
+                return true;
+            }
+            inFlight[slot] = false;
+            return WaitWrite(slot);
+        }
+
+        bool WaitAll()
+        {
+            bool ok = true;
+            for (size_t i = 0; i < kSlotCount; ++i)
+            {
+                ok = WaitSlot(i) && ok;
+            }
+            return ok;
+        }
+
+        bool Submit(size_t size)
+        {
+            slotBytes[current] = size;
+            slotOffsets[current] = stageBase;
+            if (!SubmitWrite(current, stageBase, size))
+            {
+                return false;
+            }
+            inFlight[current] = true;
+            return true;
+        }
+
+        bool SubmitStage()
+        {
+            if (!Submit(kSlotSize))
+            {
+                return false;
+            }
+            fileEnd = std::max<uint64_t>(fileEnd, stageBase + kSlotSize);
+            stageBase += kSlotSize;
+            stageFill = 0;
+            current = (current + 1) % kSlotCount;
+            return WaitSlot(current);
+        }
+
+        bool Commit() override
+        {
+            bool ok = true;
+            if (staging && stageFill > 0)
+            {
+                size_t padded = AlignUp(stageFill);
+                if (padded > stageFill)
+                {
+                    // The last block is only partly ours; keep whatever already follows it on disk.
+                    size_t tail = padded - alignment;
+                    ok = WaitAll() && LoadBlock(stageBase + tail);
+                    memcpy(slots[current] + stageFill, bounce + (stageFill - tail), padded - stageFill);
+                }
+                ok = ok && Submit(padded);
+                fileEnd = std::max<uint64_t>(fileEnd, stageBase + stageFill);
+            }
+            staging = false;
+            return WaitAll() && ok;
+        }
+    };
+
+#ifdef _WIN32
+    bool ReserveHandle(HANDLE handle, uint64_t size)
+    {
+        FILE_ALLOCATION_INFO info{};
+        info.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+        return SetFileInformationByHandle(handle, FileAllocationInfo, &info, sizeof(info)) != FALSE;
+    }
+
+    HANDLE OpenOutputHandle(const std::wstring& path, bool existing, DWORD flags, uint64_t* length)
+    {
+        HANDLE handle = CreateFileW(
+            path.c_str(),
+            GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ,
+            nullptr,
+            existing ? OPEN_EXISTING : CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | flags,
+            nullptr);
+        LARGE_INTEGER size{};
+        if (handle != INVALID_HANDLE_VALUE && existing && GetFileSizeEx(handle, &size))
+        {
+            *length = static_cast<uint64_t>(size.QuadPart);
+        }
+        return handle;
+    }
+
+    bool TrimHandle(HANDLE handle, uint64_t size)
+    {
+        FILE_END_OF_FILE_INFO info{};
+        info.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+        return SetFileInformationByHandle(handle, FileEndOfFileInfo, &info, sizeof(info)) != FALSE;
+    }
+
+    struct BufferedFileBackend : FileBackend
+    {
+        HANDLE handle = INVALID_HANDLE_VALUE;
+        uint64_t pointer = 0;
+
+        // Without Close the file is left as is: a crash repair may still need its contents.
+        ~BufferedFileBackend() override
+        {
+            if (handle != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(handle);
+                handle = INVALID_HANDLE_VALUE;
+            }
+        }
+
+        bool Open(const std::wstring& path, bool existing, uint64_t* length) override
+        {
+            *length = 0;
+            handle = OpenOutputHandle(path, existing, 0, length);
+            pointer = 0;
+            return handle != INVALID_HANDLE_VALUE;
+        }
+
+        bool Reserve(uint64_t size) override
+        {
+            return ReserveHandle(handle, size);
+        }
+
+        bool MoveTo(uint64_t offset)
+        {
+            if (offset == pointer)
+            {
+                return true;
+            }
+            LARGE_INTEGER li{};
+            li.QuadPart = static_cast<LONGLONG>(offset);
+            if (!SetFilePointerEx(handle, li, nullptr, FILE_BEGIN))
+            {
+                return false;
+            }
+            pointer = offset;
+            return true;
+        }
+
+        bool WriteAt(uint64_t offset, const void* data, size_t size) override
+        {
+            if (!MoveTo(offset))
+            {
+                return false;
+            }
+            DWORD written = 0;
+            if (!WriteFile(handle, data, static_cast<DWORD>(size), &written, nullptr))
+            {
+                return false;
+            }
+            if (written != size)
+            {
+                return false;
+            }
+            pointer += size;
+            return true;
+        }
+
+        bool ReadAt(uint64_t offset, void* data, size_t size) override
+        {
+            if (!MoveTo(offset))
+            {
+                return false;
+            }
+            DWORD read = 0;
+            if (!ReadFile(handle, data, static_cast<DWORD>(size), &read, nullptr))
+            {
+                return false;
+            }
+            if (read != size)
+            {
+                return false;
+            }
+            pointer += size;
+            return true;
+        }
+
+        bool Close(uint64_t size) override
+        {
+            if (handle == INVALID_HANDLE_VALUE)
+            {
+                return true;
+            }
+            // Releases any reservation and drops bytes past the logical size.
+            bool ok = TrimHandle(handle, size);
+            CloseHandle(handle);
+            handle = INVALID_HANDLE_VALUE;
+            return ok;
+        }
+    };
+
+    // FILE_FLAG_NO_BUFFERING bypasses the system cache; every transfer must be sector-aligned,
+    // which the staging slots guarantee. 4096 covers both 512e and 4Kn drives.
+    struct OverlappedFileBackend : StagedFileBackend
+    {
+        HANDLE handle = INVALID_HANDLE_VALUE;
+        OVERLAPPED overlapped[kSlotCount + 1] = {};
+
+        OverlappedFileBackend()
+            : StagedFileBackend(4096)
+        {
+        }
+
+        ~OverlappedFileBackend() override
+        {
+            CloseHandles();
+        }
+
+        void CloseHandles()
+        {
+            if (handle != INVALID_HANDLE_VALUE)
+            {
+                CancelIo(handle);
+                CloseHandle(handle);
+                handle = INVALID_HANDLE_VALUE;
+            }
+            for (OVERLAPPED& ov : overlapped)
+            {
+                if (ov.hEvent)
+                {
+                    CloseHandle(ov.hEvent);
+                    ov.hEvent = nullptr;
+                }
+            }
+        }
+
+        bool OpenFile(const std::wstring& path, bool existing, uint64_t* length) override
+        {
+            handle = OpenOutputHandle(path, existing, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, length);
+            if (handle == INVALID_HANDLE_VALUE)
+            {
+                return false;
+            }
+            for (OVERLAPPED& ov : overlapped)
+            {
+                ov.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+                if (!ov.hEvent)
+                {
+                    CloseHandles();
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static void SetOffset(OVERLAPPED& ov, uint64_t offset)
+        {
+            ov.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+            ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        }
+
+        bool SubmitWrite(size_t slot, uint64_t offset, size_t size) override
+        {
+            OVERLAPPED& ov = overlapped[slot];
+            SetOffset(ov, offset);
+            if (!WriteFile(handle, slots[slot], static_cast<DWORD>(size), nullptr, &ov) && GetLastError() != ERROR_IO_PENDING)
+            {
+                return false;
+            }
+            return true;
+        }
+
+        bool WaitWrite(size_t slot) override
+        {
+            DWORD transferred = 0;
+            if (!GetOverlappedResult(handle, &overlapped[slot], &transferred, TRUE))
+            {
+                return false;
+            }
+            return transferred == slotBytes[slot];
+        }
+
+        bool ReadBlocks(uint64_t offset, uint8_t* buffer, size_t size, size_t* read) override
+        {
+            OVERLAPPED& ov = overlapped[kSlotCount];
+            SetOffset(ov, offset);
+            *read = 0;
+            DWORD transferred = 0;
+            if (!ReadFile(handle, buffer, static_cast<DWORD>(size), nullptr, &ov))
+            {
+                DWORD error = GetLastError();
+                if (error == ERROR_HANDLE_EOF)
+                {
+                    return true;
+                }
+                if (error != ERROR_IO_PENDING)
+                {
+                    return false;
+                }
+            }
+            if (!GetOverlappedResult(handle, &ov, &transferred, TRUE))
+            {
+                return GetLastError() == ERROR_HANDLE_EOF;
+            }
+            *read = transferred;
+            return true;
+        }
+
+        bool Reserve(uint64_t size) override
+        {
+            return ReserveHandle(handle, size);
+        }
+
+        bool CloseFile(uint64_t size) override
+        {
+            if (handle == INVALID_HANDLE_VALUE)
+            {
+                return true;
+            }
+            // Whole blocks were written, so the tail may carry padding past the logical end.
+            bool ok = TrimHandle(handle, size);
+            CloseHandles();
+            return ok;
+        }
+    };
+
+    bool RemoveFile(const std::wstring& path)
+    {
+        return DeleteFileW(path.c_str()) != FALSE;
+    }
+
+    std::unique_ptr<FileBackend> CreateFileBackend(FileBackendKind kind)
+    {
+        switch (kind)
+        {
+        case FileBackendKind::Standard:
+            return std::make_unique<BufferedFileBackend>();
+        case FileBackendKind::Queued:
+            return std::make_unique<OverlappedFileBackend>();
+        default:
+            return nullptr;
+        }
+    }
+#else
+    std::string NarrowPath(const std::wstring& path)
+    {
+        std::string out;
+        for (wchar_t ch : path)
+        {
+            uint32_t c = static_cast<uint32_t>(ch);
+            if (c < 0x80)
+            {
+                out.push_back(static_cast<char>(c));
+            }
+            else if (c < 0x800)
+            {
+                out.push_back(static_cast<char>(0xC0 | (c >> 6)));
+                out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+            }
+            else if (c < 0x10000)
+            {
+                out.push_back(static_cast<char>(0xE0 | (c >> 12)));
+                out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+                out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+            }
+            else
+            {
+                out.push_back(static_cast<char>(0xF0 | (c >> 18)));
+                out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+                out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+                out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+            }
+        }
+        return out;
+    }
+
+    int OpenOutputFd(const std::wstring& path, bool existing, uint64_t* length)
+    {
+        int fd = open(NarrowPath(path).c_str(), existing ? (O_RDWR | O_CLOEXEC) : (O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC), 0644);
+        struct stat info{};
+        if (fd >= 0 && existing && fstat(fd, &info) == 0)
+        {
+            *length = static_cast<uint64_t>(info.st_size);
+        }
+        return fd;
+    }
+
+    bool ReserveFd(int fd, uint64_t size)
+    {
+#ifdef __linux__
+        return fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) == 0;
+#else
+        return false;
+#endif
+    }
+
+    bool PwriteAll(int fd, uint64_t offset, const void* data, size_t size)
+    {
+        const auto* bytes = static_cast<const uint8_t*>(data);
+        while (size > 0)
+        {
+            ssize_t written = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+            bytes += written;
+            offset += static_cast<uint64_t>(written);
+            size -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    bool PreadAll(int fd, uint64_t offset, void* data, size_t size, size_t* read)
+    {
+        auto* bytes = static_cast<uint8_t*>(data);
+        *read = 0;
+        while (*read < size)
+        {
+            ssize_t got = pread(fd, bytes + *read, size - *read, static_cast<off_t>(offset + *read));
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got < 0)
+            {
+                return false;
+            }
+            if (got == 0)
+            {
+                break;
+            }
+            *read += static_cast<size_t>(got);
+        }
+        return true;
+    }
+
+    struct PwriteFileBackend : FileBackend
+    {
+        int fd = -1;
+
+        // Without Close the file is left as is: a crash repair may still need its contents.
+        ~PwriteFileBackend() override
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+
+        bool Open(const std::wstring& path, bool existing, uint64_t* length) override
+        {
+            *length = 0;
+            fd = OpenOutputFd(path, existing, length);
+            return fd >= 0;
+        }
+
+        bool Reserve(uint64_t size) override
+        {
+            return ReserveFd(fd, size);
+        }
+
+        bool WriteAt(uint64_t offset, const void* data, size_t size) override
+        {
+            return PwriteAll(fd, offset, data, size);
+        }
+
+        bool ReadAt(uint64_t offset, void* data, size_t size) override
+        {
+            size_t read = 0;
+            return PreadAll(fd, offset, data, size, &read) && read == size;
+        }
+
+        bool Close(uint64_t size) override
+        {
+            if (fd < 0)
+            {
+                return true;
+            }
+            // Releases any reservation and drops bytes past the logical size.
+            bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0;
+            close(fd);
+            fd = -1;
+            return ok;
+        }
+    };
+
+    // Maps the file through a sliding window; the file is grown a window at a time and
+    // trimmed back to the logical size on close.
+    struct MappedFileBackend : FileBackend
+    {
+        static constexpr uint64_t kWindowSize = 64ull << 20;
+
+        int fd = -1;
+        uint8_t* window = nullptr;
+        uint64_t windowBase = 0;
+        uint64_t mappedSize = 0;
+
+        ~MappedFileBackend() override
+        {
+            Unmap();
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+
+        bool Open(const std::wstring& path, bool existing, uint64_t* length) override
+        {
+            *length = 0;
+            fd = OpenOutputFd(path, existing, length);
+            mappedSize = *length;
+            return fd >= 0;
+        }
+
+        void Unmap()
+        {
+            if (window)
+            {
+                munmap(window, kWindowSize);
+                window = nullptr;
+            }
+        }
+
+        uint8_t* Map(uint64_t offset)
+        {
+            uint64_t base = offset & ~(kWindowSize - 1);
+            if (window && base == windowBase)
+            {
+                return window + (offset - base);
+            }
+            Unmap();
+            if (base + kWindowSize > mappedSize)
+            {
+                if (ftruncate(fd, static_cast<off_t>(base + kWindowSize)) != 0)
+                {
+                    return nullptr;
+                }
+                mappedSize = base + kWindowSize;
+            }
+            void* mapped = mmap(nullptr, kWindowSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, static_cast<off_t>(base));
+            if (mapped == MAP_FAILED)
+            {
+                return nullptr;
+            }
+            window = static_cast<uint8_t*>(mapped);
+            windowBase = base;
+            return window + (offset - base);
+        }
+
+        template <typename CopyFn>
+        bool Transfer(uint64_t offset, size_t size, CopyFn copy)
+        {
+            size_t done = 0;
+            while (done < size)
+            {
+                uint8_t* target = Map(offset + done);
+                if (!target)
+                {
+                    return false;
+                }
+                size_t room = static_cast<size_t>(windowBase + kWindowSize - (offset + done));
+                size_t chunk = std::min(size - done, room);
+                copy(target, done, chunk);
+                done += chunk;
+            }
+            return true;
+        }
+
+        bool WriteAt(uint64_t offset, const void* data, size_t size) override
+        {
+            const auto* bytes = static_cast<const uint8_t*>(data);
+            return Transfer(offset, size, [&](uint8_t* target, size_t done, size_t chunk)
+            {
+                memcpy(target, bytes + done, chunk);
+            });
+        }
+
+        bool ReadAt(uint64_t offset, void* data, size_t size) override
+        {
+            auto* bytes = static_cast<uint8_t*>(data);
+            return Transfer(offset, size, [&](uint8_t* source, size_t done, size_t chunk)
+            {
+                memcpy(bytes + done, source, chunk);
+            });
+        }
+
+        bool Close(uint64_t size) override
+        {
+            if (fd < 0)
+            {
+                return true;
+            }
+            Unmap();
+            bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0;
+            close(fd);
+            fd = -1;
+            return ok;
+        }
+    };
+
+#ifdef __linux__
+    // io_uring through the raw syscalls (no liburing dependency). Staged slots are submitted
+    // as IORING_OP_WRITEV so kernels from 5.1 on are accepted.
+    struct IoUringFileBackend : StagedFileBackend
+    {
+        int fd = -1;
+        int ringFd = -1;
+        void* sqRing = nullptr;
+        size_t sqRingSize = 0;
+        void* cqRing = nullptr;
+        size_t cqRingSize = 0;
+        io_uring_sqe* sqes = nullptr;
+        size_t sqesSize = 0;
+        unsigned* sqTail = nullptr;
+        unsigned* sqMask = nullptr;
+        unsigned* sqArray = nullptr;
+        unsigned* cqHead = nullptr;
+        unsigned* cqTail = nullptr;
+        unsigned* cqMask = nullptr;
+        io_uring_cqe* cqes = nullptr;
+        iovec vectors[kSlotCount] = {};
+        bool completed[kSlotCount] = {};
+        int results[kSlotCount] = {};
+
+        IoUringFileBackend()
+            : StagedFileBackend(1)
+        {
+        }
+
+        ~IoUringFileBackend() override
+        {
+            CloseRing();
+            if (fd >= 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+
+        void CloseRing()
+        {
+            if (sqes)
+            {
+                munmap(sqes, sqesSize);
+                sqes = nullptr;
+            }
+            if (cqRing && cqRing != sqRing)
+            {
+                munmap(cqRing, cqRingSize);
+            }
+            cqRing = nullptr;
+            if (sqRing)
+            {
+                munmap(sqRing, sqRingSize);
+                sqRing = nullptr;
+            }
+            if (ringFd >= 0)
+            {
+                close(ringFd);
+                ringFd = -1;
+            }
+        }
+
+        bool SetupRing()
+        {
+            io_uring_params params{};
+            ringFd = static_cast<int>(syscall(__NR_io_uring_setup, static_cast<unsigned>(kSlotCount), &params));
+            if (ringFd < 0)
+            {
+                return false;
+            }
+
+            sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (singleMap)
+            {
+                sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+            }
+
+            sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            if (sqRing == MAP_FAILED)
+            {
+                sqRing = nullptr;
+                return false;
+            }
+            if (singleMap)
+            {
+                cqRing = sqRing;
+            }
+            else
+            {
+                cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+                if (cqRing == MAP_FAILED)
+                {
+                    cqRing = nullptr;
+                    return false;
+                }
+            }
+            sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            void* mappedSqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+            if (mappedSqes == MAP_FAILED)
+            {
+                return false;
+            }
+            sqes = static_cast<io_uring_sqe*>(mappedSqes);
+
+            auto* sq = static_cast<uint8_t*>(sqRing);
+            auto* cq = static_cast<uint8_t*>(cqRing);
+            sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+            return true;
+        }
+
+        bool OpenFile(const std::wstring& path, bool existing, uint64_t* length) override
+        {
+            if (!SetupRing())
+            {
+                CloseRing();
+                return false;
+            }
+            fd = OpenOutputFd(path, existing, length);
+            return fd >= 0;
+        }
+
+        bool SubmitWrite(size_t slot, uint64_t offset, size_t size) override
+        {
+            vectors[slot].iov_base = slots[slot];
+            vectors[slot].iov_len = size;
+            completed[slot] = false;
+
+            unsigned tail = *sqTail;
+            unsigned index = tail & *sqMask;
+            io_uring_sqe& sqe = sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITEV;
+            sqe.fd = fd;
+            sqe.off = offset;
+            sqe.addr = reinterpret_cast<uint64_t>(&vectors[slot]);
+            sqe.len = 1;
+            sqe.user_data = slot;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+            while (syscall(__NR_io_uring_enter, ringFd, 1u, 0u, 0u, nullptr, 0) < 0)
+            {
+                if (errno != EINTR)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool WaitWrite(size_t slot) override
+        {
+            while (!completed[slot])
+            {
+                unsigned head = *cqHead;
+                if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+                {
+                    if (syscall(__NR_io_uring_enter, ringFd, 0u, 1u, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+                const io_uring_cqe& cqe = cqes[head & *cqMask];
+                size_t done = static_cast<size_t>(cqe.user_data);
+                if (done < kSlotCount)
+                {
+                    results[done] = cqe.res;
+                    completed[done] = true;
+                }
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+            }
+
+            int result = results[slot];
+            if (result < 0)
+            {
+                return false;
+            }
+            size_t written = std::min(static_cast<size_t>(result), slotBytes[slot]);
+            // A short completion is legal; finish the remainder synchronously.
+            return PwriteAll(fd, slotOffsets[slot] + written, slots[slot] + written, slotBytes[slot] - written);
+        }
+
+        bool ReadBlocks(uint64_t offset, uint8_t* buffer, size_t size, size_t* read) override
+        {
+            return PreadAll(fd, offset, buffer, size, read);
+        }
+
+        bool Reserve(uint64_t size) override
+        {
+            return ReserveFd(fd, size);
+        }
+
+        bool CloseFile(uint64_t size) override
+        {
+            CloseRing();
+            if (fd < 0)
+            {
+                return true;
+            }
+            bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0;
+            close(fd);
+            fd = -1;
+            return ok;
+        }
+    };
+#endif
+
+    bool RemoveFile(const std::wstring& path)
+    {
+        return unlink(NarrowPath(path).c_str()) == 0;
+    }
+
+    std::unique_ptr<FileBackend> CreateFileBackend(FileBackendKind kind)
+    {
+        switch (kind)
+        {
+        case FileBackendKind::Standard:
+            return std::make_unique<PwriteFileBackend>();
+#ifdef __linux__
+        case FileBackendKind::Queued:
+            return std::make_unique<IoUringFileBackend>();
+#endif
+        case FileBackendKind::Mapped:
+            return std::make_unique<MappedFileBackend>();
+        default:
+            return nullptr;
+        }
+    }
+#endif
+
+    // Serializes boxes straight into the output file through a fixed-size buffer.
+    // A measuring pass (no file) runs first and records every box size, so the
+    // writing pass can emit each header before its payload without seeking back.
+    struct Mp4StreamWriter
+    {
+        FileWriter* file = nullptr;
+        std::vector<uint8_t> buffer;
+        size_t used = 0;
+        uint64_t written = 0;
+        bool failed = false;
+        std::vector<uint64_t> boxSizes;
+        std::vector<uint64_t> boxStarts;
+        size_t nextBox = 0;
+
+        void BeginWrite(FileWriter* target)
+        {
+            file = target;
+            buffer.resize(64 * 1024);
+            used = 0;
+            written = 0;
+            failed = false;
+            nextBox = 0;
+        }
+
+        void Put(const uint8_t* bytes, size_t size)
+        {
+            written += size;
+            if (!file)
+            {
+                return;
+            }
+            while (size > 0)
+            {
+                size_t chunk = std::min(size, buffer.size() - used);
+                memcpy(buffer.data() + used, bytes, chunk);
+                used += chunk;
+                bytes += chunk;
+                size -= chunk;
+                if (used == buffer.size())
+                {
+                    Flush();
+                }
+            }
+        }
+
+        bool Flush()
+        {
+            if (file && used > 0 && !failed && !file->Write(buffer.data(), used))
+            {
+                failed = true;
+            }
+            used = 0;
+            return !failed;
+        }
+
+        void WriteU8(uint8_t value) { Put(&value, 1); }
+
+        void WriteU16(uint16_t value)
+        {
+            uint8_t bytes[2] = { static_cast<uint8_t>((value >> 8) & 0xFF), static_cast<uint8_t>(value & 0xFF) };
+            Put(bytes, sizeof(bytes));
+        }
+
+        void WriteU32(uint32_t value)
+        {
+            uint8_t bytes[4] = {
+                static_cast<uint8_t>((value >> 24) & 0xFF),
+                static_cast<uint8_t>((value >> 16) & 0xFF),
+                static_cast<uint8_t>((value >> 8) & 0xFF),
+                static_cast<uint8_t>(value & 0xFF)
+            };
+            Put(bytes, sizeof(bytes));
+        }
+
+        void WriteU64(uint64_t value)
+        {
+            uint8_t bytes[8];
+            for (int i = 7; i >= 0; --i)
+            {
+                bytes[7 - i] = static_cast<uint8_t>((value >> (i * 8)) & 0xFF);
+            }
+            Put(bytes, sizeof(bytes));
+        }
+
+        void WriteString4(const char* value) { Put(reinterpret_cast<const uint8_t*>(value), 4); }
+
+        void WriteBytes(const void* bytes, size_t size) { Put(static_cast<const uint8_t*>(bytes), size); }
+
+        void WriteBytes(const std::vector<uint8_t>& bytes) { Put(bytes.data(), bytes.size()); }
+
+        size_t BeginBox(const char* type)
+        {
+            size_t index = nextBox++;
+            if (!file)
+            {
+                boxSizes.push_back(0);
+                boxStarts.push_back(written);
+            }
+            WriteU32(static_cast<uint32_t>(boxSizes[index]));
+            WriteString4(type);
+            return index;
+        }
+
+        void EndBox(size_t index)
+        {
+            if (!file)
+            {
+                boxSizes[index] = written - boxStarts[index];
+            }
+        }
+    };
+
+#ifdef _WIN32
+    struct EventCompletionSignal : CompletionSignal
+    {
+        HANDLE event = nullptr;
+
+        ~EventCompletionSignal() override
+        {
+            if (event)
+            {
+                CloseHandle(event);
+            }
+        }
+
+        bool Create() override
+        {
+            event = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+            return event != nullptr;
+        }
+
+        void* Handle() override { return event; }
+
+        SignalWait Wait(uint32_t timeoutMs) override
+        {
+            const DWORD result = WaitForSingleObject(event, timeoutMs);
+            return result == WAIT_OBJECT_0 ? SignalWait::Signaled : result == WAIT_TIMEOUT ? SignalWait::Timeout : SignalWait::Failed;
+        }
+
+        void Signal() override { SetEvent(event); }
+    };
+
+    std::unique_ptr<CompletionSignal> CreateCompletionSignal()
+    {
+        auto signal = std::make_unique<EventCompletionSignal>();
+        return signal->Create() ? std::move(signal) : nullptr;
+    }
+#elif defined(__linux__)
+    struct EventFdCompletionSignal : CompletionSignal
+    {
+        int fd = -1;
+
+        ~EventFdCompletionSignal() override
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+
+        bool Create() override
+        {
+            fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            return fd >= 0;
+        }
+
+        void* Handle() override { return this; }
+
+        SignalWait Wait(uint32_t timeoutMs) override
+        {
+            pollfd entry{ fd, POLLIN, 0 };
+            const int ready = poll(&entry, 1, static_cast<int>(timeoutMs));
+            if (ready == 0 || (ready < 0 && errno == EINTR))
+            {
+                return SignalWait::Timeout;
+            }
+            uint64_t count = 0;
+            if (ready < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+            {
+                return SignalWait::Failed;
+            }
+            return SignalWait::Signaled;
+        }
+
+        void Signal() override
+        {
+            const uint64_t one = 1;
+            (void)!write(fd, &one, sizeof(one));
+        }
+    };
+
+    std::unique_ptr<CompletionSignal> CreateCompletionSignal()
+    {
+        auto signal = std::make_unique<EventFdCompletionSignal>();
+        return signal->Create() ? std::move(signal) : nullptr;
+    }
+#else
+    struct CondvarCompletionSignal : CompletionSignal
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool signaled = false;
+
+        bool Create() override { return true; }
+
+        void* Handle() override { return this; }
+
+        SignalWait Wait(uint32_t timeoutMs) override
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() { return signaled; }))
+            {
+                return SignalWait::Timeout;
+            }
+            signaled = false;
+            return SignalWait::Signaled;
+        }
+
+        void Signal() override
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            signaled = true;
+            cv.notify_one();
+        }
+    };
+
+    std::unique_ptr<CompletionSignal> CreateCompletionSignal()
+    {
+        return std::make_unique<CondvarCompletionSignal>();
+    }
+#endif
+
+    void SetError(MuxerState* state, const std::wstring& message)
+    {
+        if (state)
+        {
+            state->lastError = message;
+            LogLine(state, L"[error] " + message);
+        }
+    }
+
+    void OpenLog(MuxerState* state)
+    {
+        if (!state || !state->logEnabled || state->outputPath.empty())
+        {
+            return;
+        }
+
+        std::wstring path = state->outputPath + L".nvenc_log.txt";
+#ifdef _WIN32
+        if (state->logFile != INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+        state->logFile = CreateFileW(
+            path.c_str(),
+            FILE_APPEND_DATA,
+            FILE_SHARE_READ,
+            nullptr,
+            OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+#else
+        if (state->logFile >= 0)
+        {
+            return;
+        }
+        state->logFile = open(NarrowPath(path).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+#endif
+    }
+
+    void CloseLog(MuxerState* state)
+    {
+#ifdef _WIN32
+        if (!state || state->logFile == INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+        CloseHandle(state->logFile);
+        state->logFile = INVALID_HANDLE_VALUE;
+#else
+        if (!state || state->logFile < 0)
+        {
+            return;
+        }
+        close(state->logFile);
+        state->logFile = -1;
+#endif
+    }
+
+    void LogLine(MuxerState* state, const std::wstring& line)
+    {
+        if (!state || !state->logEnabled)
+        {
+            return;
+        }
+        OpenLog(state);
+
+        wchar_t prefix[64]{};
+#ifdef _WIN32
+        if (state->logFile == INVALID_HANDLE_VALUE)
+        {
+            return;
+        }
+
+        SYSTEMTIME st{};
+        GetLocalTime(&st);
+        swprintf_s(prefix, L"%04u-%02u-%02u %02u:%02u:%02u.%03u [t%lu] ",
+            st.wYear, st.wMonth, st.wDay,
+            st.wHour, st.wMinute, st.wSecond, st.wMilliseconds,
+            GetCurrentThreadId());
+
+        std::wstring full = prefix + line + L"\r\n";
+        int bytesNeeded = WideCharToMultiByte(CP_UTF8, 0, full.c_str(), static_cast<int>(full.size()), nullptr, 0, nullptr, nullptr);
+        if (bytesNeeded <= 0)
+        {
+            return;
+        }
+
+        std::string utf8(bytesNeeded, '\0');
+        WideCharToMultiByte(CP_UTF8, 0, full.c_str(), static_cast<int>(full.size()), &utf8[0], bytesNeeded, nullptr, nullptr);
+
+        std::lock_guard<std::mutex> lock(state->logMutex);
+        DWORD written = 0;
+        WriteFile(state->logFile, utf8.data(), static_cast<DWORD>(utf8.size()), &written, nullptr);
+#else
+        if (state->logFile < 0)
+        {
+            return;
+        }
+
+        const auto now = std::chrono::system_clock::now();
+        const time_t seconds = std::chrono::system_clock::to_time_t(now);
+        const long millis = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000);
+        struct tm local{};
+        localtime_r(&seconds, &local);
+#ifdef __linux__
+        const unsigned long threadId = static_cast<unsigned long>(syscall(SYS_gettid));
+#else
+        const unsigned long threadId = static_cast<unsigned long>(std::hash<std::thread::id>()(std::this_thread::get_id()) & 0xFFFFFFFFu);
+#endif
+        swprintf(prefix, 64, L"%04d-%02d-%02d %02d:%02d:%02d.%03ld [t%lu] ",
+            local.tm_year + 1900, local.tm_mon + 1, local.tm_mday,
+            local.tm_hour, local.tm_min, local.tm_sec, millis, threadId);
+
+        const std::string utf8 = NarrowPath(prefix + line + L"\r\n");
+        std::lock_guard<std::mutex> lock(state->logMutex);
+        const ssize_t written = write(state->logFile, utf8.data(), utf8.size());
+        (void)written;
+#endif
+    }
+
+    int ClampInt(int value, int minValue, int maxValue)
+    {
+        if (value < minValue) return minValue;
+        if (value > maxValue) return maxValue;
+        return value;
+    }
+
+    float ClampFloat(float value, float minValue, float maxValue)
+    {
+        if (value < minValue) return minValue;
+        if (value > maxValue) return maxValue;
+        return value;
+    }
+
+    uint64_t MaxU64(uint64_t a, uint64_t b)
+    {
+        return a > b ? a : b;
+    }
+
+    bool WriteU32BE(FileWriter& file, uint32_t value)
+    {
+        uint8_t bytes[4] = {
+            static_cast<uint8_t>((value >> 24) & 0xFF),
+            static_cast<uint8_t>((value >> 16) & 0xFF),
+            static_cast<uint8_t>((value >> 8) & 0xFF),
+            static_cast<uint8_t>(value & 0xFF)
+        };
+        return file.Write(bytes, sizeof(bytes));
+    }
+
+    bool WriteU64BE(FileWriter& file, uint64_t value)
+    {
+        uint8_t bytes[8];
+        for (int i = 7; i >= 0; --i)
+        {
+            bytes[7 - i] = static_cast<uint8_t>((value >> (i * 8)) & 0xFF);
+        }
+        return file.Write(bytes, sizeof(bytes));
+    }
+
+    bool WriteString4(FileWriter& file, const char* value)
+    {
+        return file.Write(value, 4);
+    }
+
+    bool WriteFtyp(FileWriter& file, bool hevc, bool fragmented)
+    {
+        const char* brand = hevc ? "hvc1" : "avc1";
+        const uint32_t boxSize = 32;
+        return WriteU32BE(file, boxSize)
+            && WriteString4(file, "ftyp")
+            && WriteString4(file, "isom")
+            && WriteU32BE(file, 0x00000200)
+            && WriteString4(file, "isom")
+            && WriteString4(file, fragmented ? "iso6" : "iso2")
+            && WriteString4(file, brand)
+            && WriteString4(file, "mp41");
+    }
+
+    bool WriteFreeBox(FileWriter& file, uint64_t size)
+    {
+        if (size < 8 || size > 0xFFFFFFFFu)
+        {
+            return false;
+        }
+        if (!WriteU32BE(file, static_cast<uint32_t>(size)) || !WriteString4(file, "free"))
+        {
+            return false;
+        }
+        std::vector<uint8_t> zeros(static_cast<size_t>(std::min<uint64_t>(size - 8, 1 << 16)), 0);
+        uint64_t remain = size - 8;
+        while (remain > 0)
+        {
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(remain, zeros.size()));
+            if (!file.Write(zeros.data(), chunk))
+            {
+                return false;
+            }
+            remain -= chunk;
+        }
+        return true;
+    }
+
+    uint64_t EstimateMoovSize(const MuxerState* state)
+    {
+        // Fixed boxes plus worst-case tables (stsz + co64 per sample, ctts per sample with
+        // B-frames, stss per second, and with open GOPs an sbgp run pair per second).
+        const uint64_t minReserve = 64 * 1024;
+        const uint64_t fps = state->fps > 0 ? static_cast<uint64_t>(state->fps) : 30;
+        const uint64_t frames = state->expectedFrameCount;
+        const uint64_t seconds = frames / fps + 1;
+        const uint64_t audioFrames = seconds * 48000 / 1024 + 1;
+        uint64_t estimate = 8192 + frames * (state->bFrames > 0 ? 20 : 12) + seconds * (state->openGop ? 20 : 4) + audioFrames * 12;
+        estimate += estimate / 10;
+        estimate = (estimate + 4095) & ~static_cast<uint64_t>(4095);
+        return std::min<uint64_t>(std::max<uint64_t>(estimate, minReserve), 0xFFFFF000u);
+    }
+
+    // Expected output size from the configured bitrates, or 0 when it can't be predicted.
+    uint64_t EstimateOutputSize(const MuxerState* state)
+    {
+        const uint64_t frames = state->expectedFrameCount;
+        const uint64_t videoBitrate = state->videoBitrate;
+        if (frames == 0 || videoBitrate == 0)
+        {
+            return 0;
+        }
+        const uint64_t fps = state->fps > 0 ? static_cast<uint64_t>(state->fps) : 30;
+        const uint64_t seconds = (frames + fps - 1) / fps;
+        uint64_t estimate = seconds * (videoBitrate + state->audioBitrate) / 8;
+        estimate += estimate / 20 + EstimateMoovSize(state);
+        const uint64_t extent = 1ull << 20;
+        return (estimate + extent - 1) & ~(extent - 1);
+    }
+
+    // Crash journal. The writer thread appends one record per sample and flushes them to
+    // "<output>.nvjournal" only after the sample bytes themselves have been written and
+    // committed to the output file (FileBackend::Commit, which drains the Queued backend's
+    // staged and in-flight slots), so every record on disk points at data the output file
+    // already has. NvencRepair rebuilds moov from it. Records (big-endian, after the "NVJ1" magic):
+    //   'M' hevc u8, faststart u8, width u32, height u32, fps u32, mdat header offset u64
+    //   'C' u32 length + avcC/hvcC
+    //   'A' sample rate u32, channels u32, bitrate u32, u32 length + AudioSpecificConfig
+    //   'D' description u32, u32 length + codec header; later video records use this stsd
+    //       entry (1 is the 'C' header and carries an empty blob, 2+ bring their own)
+    //   'v' offset u64, size u32, RandomAccess kind u8[, roll distance u16 when kind is Roll]
+    //   'b' as 'v', then composition offset u32 (only for samples whose ctts is non-zero)
+    //   'a' offset u64, size u32, duration u32
+    const wchar_t kJournalSuffix[] = L".nvjournal";
+    const auto kJournalFlushInterval = std::chrono::seconds(1);
+
+    std::wstring JournalPath(const std::wstring& outputPath)
+    {
+        return outputPath + kJournalSuffix;
+    }
+
+    void AppendJournalBlob(Mp4Buffer& out, const std::vector<uint8_t>& bytes)
+    {
+        out.WriteU32(static_cast<uint32_t>(bytes.size()));
+        out.WriteBytes(bytes);
+    }
+
+    void CloseJournal(MuxerState* state, bool remove)
+    {
+        if (!state->journal.IsOpen())
+        {
+            return;
+        }
+        state->journal.Close();
+        state->journalPending.data.clear();
+        if (remove)
+        {
+            RemoveFile(JournalPath(state->outputPath));
+        }
+    }
+
+    // Caller holds fileMutex (or owns the state exclusively). Fails only when the output file's
+    // pending writes fail.
+    bool FlushJournal(MuxerState* state)
+    {
+        state->journalFlushTime = std::chrono::steady_clock::now();
+        if (!state->journal.IsOpen() || state->journalPending.data.empty())
+        {
+            return true;
+        }
+        if (!state->file.Commit())
+        {
+            SetError(state, L"Failed to write sample data.");
+            return false;
+        }
+        if (!state->journal.Write(state->journalPending.data.data(), state->journalPending.data.size()))
+        {
+            // The journal only helps after a crash; losing it must not fail the render.
+            LogLine(state, L"journal write failed, journal disabled");
+            CloseJournal(state, false);
+            return true;
+        }
+        state->journalPending.data.clear();
+        return true;
+    }
+
+    void OpenJournal(MuxerState* state)
+    {
+        if (!state->journal.Open(JournalPath(state->outputPath)))
+        {
+            LogLine(state, L"journal open failed");
+            return;
+        }
+        Mp4Buffer& out = state->journalPending;
+        out.WriteString4("NVJ1");
+        out.WriteU8('M');
+        out.WriteU8(state->isHevc ? 1 : 0);
+        out.WriteU8(state->faststart ? 1 : 0);
+        out.WriteU32(static_cast<uint32_t>(state->width));
+        out.WriteU32(static_cast<uint32_t>(state->height));
+        out.WriteU32(static_cast<uint32_t>(state->fps));
+        out.WriteU64(state->mdatHeaderOffset);
+        state->journalVideoConfig = false;
+        state->journalAudioConfig = false;
+        state->journalDescription = 1;
+        FlushJournal(state);
+    }
+
+    // One sample as the journal records it (and as repair recovers it).
+    struct RecoveredSample
+    {
+        uint64_t offset = 0;
+        uint32_t size = 0;
+        uint32_t duration = 0;
+        bool keyframe = false;
+        bool isAudio = false;
+        uint32_t description = 1;
+        int32_t compositionOffset = 0;
+        RandomAccess randomAccess = RandomAccess::None;
+        int16_t rollDistance = 0;
+    };
+
+    void JournalSample(MuxerState* state, const RecoveredSample& sample)
+    {
+        if (!state->journal.IsOpen())
+        {
+            return;
+        }
+        Mp4Buffer& out = state->journalPending;
+        if (sample.isAudio)
+        {
+            if (!state->journalAudioConfig)
+            {
+                out.WriteU8('A');
+                out.WriteU32(static_cast<uint32_t>(state->audioSampleRate));
+                out.WriteU32(static_cast<uint32_t>(state->audioChannels));
+                out.WriteU32(state->audioBitrate);
+                AppendJournalBlob(out, state->audioSpecificConfig);
+                state->journalAudioConfig = true;
+            }
+            out.WriteU8('a');
+            out.WriteU64(sample.offset);
+            out.WriteU32(sample.size);
+            out.WriteU32(sample.duration);
+        }
+        else
+        {
+            if (!state->journalVideoConfig && !state->codecPrivate.empty())
+            {
+                out.WriteU8('C');
+                AppendJournalBlob(out, state->codecPrivate);
+                state->journalVideoConfig = true;
+            }
+            const uint32_t description = sample.description;
+            if (description != state->journalDescription)
+            {
+                // Later video records use this stsd entry; entries past the first carry their
+                // codec header with them.
+                out.WriteU8('D');
+                out.WriteU32(description);
+                AppendJournalBlob(out, description > 1 ? state->extraCodecPrivate[description - 2] : std::vector<uint8_t>());
+                state->journalDescription = description;
+            }
+            out.WriteU8(sample.compositionOffset != 0 ? 'b' : 'v');
+            out.WriteU64(sample.offset);
+            out.WriteU32(sample.size);
+            out.WriteU8(static_cast<uint8_t>(sample.randomAccess));
+            if (sample.randomAccess == RandomAccess::Roll)
+            {
+                out.WriteU16(static_cast<uint16_t>(sample.rollDistance));
+            }
+            if (sample.compositionOffset != 0)
+            {
+                out.WriteU32(static_cast<uint32_t>(sample.compositionOffset));
+            }
+        }
+    }
+
+    // Opens the output with the configured backend, falling back to the standard one.
+    bool OpenOutputFile(MuxerState* state, bool existing)
+    {
+        if (state->file.Open(state->outputPath, state->fileBackend, existing))
+        {
+            return true;
+        }
+        if (state->fileBackend == FileBackendKind::Standard)
+        {
+            return false;
+        }
+        LogLine(state, L"file backend " + std::to_wstring(static_cast<int>(state->fileBackend)) + L" unavailable, using standard");
+        state->fileBackend = FileBackendKind::Standard;
+        return state->file.Open(state->outputPath, state->fileBackend, existing);
+    }
+
+    bool InitializeMp4Writer(MuxerState* state, bool hevc, const std::vector<uint8_t>& codecPrivate)
+    {
+        if (state->writerInitialized)
+        {
+            if (!codecPrivate.empty() && state->codecPrivate.empty())
+            {
+                state->codecPrivate = codecPrivate;
+            }
+            return true;
+        }
+
+        if (!OpenOutputFile(state, false))
+        {
+            SetError(state, L"Failed to open output file.");
+            return false;
+        }
+
+        const uint64_t expectedSize = EstimateOutputSize(state);
+        if (expectedSize > 0)
+        {
+            bool reserved = state->file.Reserve(expectedSize);
+            LogLine(state, L"preallocate bytes=" + std::to_wstring(expectedSize) + (reserved ? L"" : L" (unsupported)"));
+        }
+
+        state->isHevc = hevc;
+        if (!codecPrivate.empty())
+        {
+            state->codecPrivate = codecPrivate;
+        }
+
+        if (!WriteFtyp(state->file, hevc, state->fragmented))
+        {
+            SetError(state, L"Failed to write ftyp.");
+            return false;
+        }
+
+        if (state->fragmented)
+        {
+            // moov is written together with the first fragment, once the codec headers are known.
+            state->writerInitialized = true;
+            return true;
+        }
+
+        if (state->faststart)
+        {
+            state->moovReserveOffset = state->file.Tell();
+            state->moovReserveSize = EstimateMoovSize(state);
+            if (!WriteFreeBox(state->file, state->moovReserveSize))
+            {
+                SetError(state, L"Failed to reserve moov space.");
+                return false;
+            }
+            LogLine(state, L"faststart moov reserve=" + std::to_wstring(state->moovReserveSize));
+        }
+
+        state->mdatHeaderOffset = state->file.Tell();
+        if (!WriteU32BE(state->file, 1) || !WriteString4(state->file, "mdat"))
+        {
+            SetError(state, L"Failed to write mdat header.");
+            return false;
+        }
+
+        state->mdatLargeSizeOffset = state->file.Tell();
+        if (!WriteU64BE(state->file, 0))
+        {
+            SetError(state, L"Failed to write mdat size.");
+            return false;
+        }
+
+        state->mdatDataOffset = state->file.Tell();
+        OpenJournal(state);
+        state->writerInitialized = true;
+        return true;
+    }
+
+    void WriteMatrix(Mp4StreamWriter& buffer)
+    {
+        buffer.WriteU32(0x00010000);
+        buffer.WriteU32(0);
+        buffer.WriteU32(0);
+        buffer.WriteU32(0);
+        buffer.WriteU32(0x00010000);
+        buffer.WriteU32(0);
+        buffer.WriteU32(0);
+        buffer.WriteU32(0);
+        buffer.WriteU32(0x40000000);
+    }
+
+    void WriteDescriptorSize(Mp4Buffer& buffer, size_t size)
+    {
+        uint8_t bytes[4] = {};
+        int count = 0;
+        do
+        {
+            bytes[count++] = static_cast<uint8_t>(size & 0x7F);
+            size >>= 7;
+        } while (size > 0 && count < 4);
+
+        for (int i = count - 1; i >= 0; --i)
+        {
+            uint8_t value = bytes[i];
+            if (i != 0)
+            {
+                value |= 0x80;
+            }
+            buffer.WriteU8(value);
+        }
+    }
+
+    void WriteDescriptor(Mp4Buffer& buffer, uint8_t tag, const std::vector<uint8_t>& payload)
+    {
+        buffer.WriteU8(tag);
+        WriteDescriptorSize(buffer, payload.size());
+        buffer.WriteBytes(payload);
+    }
+
+    std::vector<uint8_t> BuildAacSpecificConfig(int sampleRate, int channels)
+    {
+        int sampleRateIndex = 3;
+        struct RateMap { int rate; int index; };
+        const RateMap rates[] = {
+            { 96000, 0 }, { 88200, 1 }, { 64000, 2 }, { 48000, 3 }, { 44100, 4 }, { 32000, 5 },
+            { 24000, 6 }, { 22050, 7 }, { 16000, 8 }, { 12000, 9 }, { 11025, 10 }, { 8000, 11 }, { 7350, 12 }
+        };
+        for (const auto& r : rates)
+        {
+            if (r.rate == sampleRate)
+            {
+                sampleRateIndex = r.index;
+                break;
+            }
+        }
+
+        const uint8_t audioObjectType = 2; // AAC LC
+        const uint8_t channelConfig = static_cast<uint8_t>(ClampInt(channels, 1, 7));
+
+        std::vector<uint8_t> asc;
+        asc.resize(2);
+        asc[0] = static_cast<uint8_t>((audioObjectType << 3) | ((sampleRateIndex & 0x0E) >> 1));
+        asc[1] = static_cast<uint8_t>(((sampleRateIndex & 0x01) << 7) | (channelConfig << 3));
+        return asc;
+    }
+
+    std::vector<uint8_t> BuildEsds(const std::vector<uint8_t>& asc, uint32_t bitrate)
+    {
+        Mp4Buffer esds;
+        esds.WriteU32(0);
+
+        Mp4Buffer decSpecific;
+        decSpecific.WriteBytes(asc);
+
+        Mp4Buffer decConfig;
+        decConfig.WriteU8(0x40); // objectTypeIndication
+        decConfig.WriteU8(0x15); // streamType audio
+        decConfig.WriteU24(0);   // bufferSizeDB
+        decConfig.WriteU32(bitrate);
+        decConfig.WriteU32(bitrate);
+        WriteDescriptor(decConfig, 0x05, decSpecific.data);
+
+        Mp4Buffer slConfig;
+        slConfig.WriteU8(0x02);
+
+        Mp4Buffer esDesc;
+        esDesc.WriteU16(1);
+        esDesc.WriteU8(0);
+        WriteDescriptor(esDesc, 0x04, decConfig.data);
+        WriteDescriptor(esDesc, 0x06, slConfig.data);
+
+        WriteDescriptor(esds, 0x03, esDesc.data);
+        return esds.data;
+    }
+
+    void WriteStts(Mp4StreamWriter& out, const std::vector<uint32_t>& durations)
+    {
+        uint32_t entryCount = 0;
+        for (size_t i = 0; i < durations.size(); ++i)
+        {
+            if (i == 0 || durations[i] != durations[i - 1])
+            {
+                entryCount++;
+            }
+        }
+
+        size_t sttsStart = out.BeginBox("stts");
+        out.WriteU32(0);
+        out.WriteU32(entryCount);
+        size_t i = 0;
+        while (i < durations.size())
+        {
+            size_t run = i + 1;
+            while (run < durations.size() && durations[run] == durations[i])
+            {
+                ++run;
+            }
+            out.WriteU32(static_cast<uint32_t>(run - i));
+            out.WriteU32(durations[i]);
+            i = run;
+        }
+        out.EndBox(sttsStart);
+    }
+
+    using DescriptionChanges = std::vector<MuxerState::DescriptionChange>;
+
+    // Samples of one track that were written back to back form one chunk, unless their
+    // sample description changes in between.
+    template <typename Fn>
+    void ForEachChunk(const std::vector<uint64_t>& offsets, const std::vector<uint32_t>& sizes, const DescriptionChanges* changes, Fn&& fn)
+    {
+        size_t change = 0;
+        uint32_t description = 1;
+        size_t i = 0;
+        while (i < offsets.size())
+        {
+            while (changes && change < changes->size() && (*changes)[change].firstSample <= i)
+            {
+                description = (*changes)[change++].description;
+            }
+            const size_t next = changes && change < changes->size() ? (*changes)[change].firstSample : offsets.size();
+            const size_t first = i;
+            uint64_t expected = offsets[i] + sizes[i];
+            ++i;
+            while (i < next && offsets[i] == expected)
+            {
+                expected += sizes[i];
+                ++i;
+            }
+            fn(offsets[first], static_cast<uint32_t>(i - first), description);
+        }
+    }
+
+    void WriteStsc(Mp4StreamWriter& out, const std::vector<uint64_t>& offsets, const std::vector<uint32_t>& sizes,
+        const DescriptionChanges* changes = nullptr)
+    {
+        uint32_t entryCount = 0;
+        uint32_t lastSamples = 0;
+        uint32_t lastDescription = 0;
+        ForEachChunk(offsets, sizes, changes, [&](uint64_t, uint32_t samples, uint32_t description)
+        {
+            if (samples != lastSamples || description != lastDescription)
+            {
+                entryCount++;
+                lastSamples = samples;
+                lastDescription = description;
+            }
+        });
+
+        size_t stscStart = out.BeginBox("stsc");
+        out.WriteU32(0);
+        out.WriteU32(entryCount);
+        uint32_t chunkIndex = 0;
+        lastSamples = 0;
+        lastDescription = 0;
+        ForEachChunk(offsets, sizes, changes, [&](uint64_t, uint32_t samples, uint32_t description)
+        {
+            chunkIndex++;
+            if (samples != lastSamples || description != lastDescription)
+            {
+                out.WriteU32(chunkIndex);
+                out.WriteU32(samples);
+                out.WriteU32(description);
+                lastSamples = samples;
+                lastDescription = description;
+            }
+        });
+        out.EndBox(stscStart);
+    }
+
+    void WriteStsz(Mp4StreamWriter& out, const std::vector<uint32_t>& sizes)
+    {
+        bool constantSize = !sizes.empty();
+        for (uint32_t size : sizes)
+        {
+            if (size != sizes.front())
+            {
+                constantSize = false;
+                break;
+            }
+        }
+
+        size_t stszStart = out.BeginBox("stsz");
+        out.WriteU32(0);
+        out.WriteU32(constantSize ? sizes.front() : 0);
+        out.WriteU32(static_cast<uint32_t>(sizes.size()));
+        if (!constantSize)
+        {
+            for (uint32_t size : sizes)
+            {
+                out.WriteU32(size);
+            }
+        }
+        out.EndBox(stszStart);
+    }
+
+    void WriteChunkOffsets(Mp4StreamWriter& out, const std::vector<uint64_t>& offsets, const std::vector<uint32_t>& sizes,
+        const DescriptionChanges* changes = nullptr)
+    {
+        uint32_t chunkCount = 0;
+        bool useCo64 = false;
+        ForEachChunk(offsets, sizes, changes, [&](uint64_t offset, uint32_t, uint32_t)
+        {
+            chunkCount++;
+            if (offset > 0xFFFFFFFFu)
+            {
+                useCo64 = true;
+            }
+        });
+
+        size_t stcoStart = out.BeginBox(useCo64 ? "co64" : "stco");
+        out.WriteU32(0);
+        out.WriteU32(chunkCount);
+        ForEachChunk(offsets, sizes, changes, [&](uint64_t offset, uint32_t, uint32_t)
+        {
+            if (useCo64)
+            {
+                out.WriteU64(offset);
+            }
+            else
+            {
+                out.WriteU32(static_cast<uint32_t>(offset));
+            }
+        });
+        out.EndBox(stcoStart);
+    }
+
+    bool HasAudioTrack(const MuxerState* state)
+    {
+        if (state->fragmented)
+        {
+            return state->fragmentHasAudio;
+        }
+        return !state->audioSampleSizes.empty() && !state->audioSpecificConfig.empty();
+    }
+
+    void AppendMvex(Mp4StreamWriter& moov, const MuxerState* state, uint32_t frameDuration, uint64_t* mehdDurationPos)
+    {
+        size_t mvexStart = moov.BeginBox("mvex");
+
+        size_t mehdStart = moov.BeginBox("mehd");
+        moov.WriteU32(0x01000000);
+        if (mehdDurationPos)
+        {
+            *mehdDurationPos = moov.written;
+        }
+        moov.WriteU64(0); // patched by FinalizeMp4
+        moov.EndBox(mehdStart);
+
+        size_t trexStart = moov.BeginBox("trex");
+        moov.WriteU32(0);
+        moov.WriteU32(1);
+        moov.WriteU32(1);
+        moov.WriteU32(frameDuration);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.EndBox(trexStart);
+
+        if (HasAudioTrack(state))
+        {
+            size_t audioTrexStart = moov.BeginBox("trex");
+            moov.WriteU32(0);
+            moov.WriteU32(2);
+            moov.WriteU32(1);
+            moov.WriteU32(1024);
+            moov.WriteU32(0);
+            moov.WriteU32(0);
+            moov.EndBox(audioTrexStart);
+        }
+
+        moov.EndBox(mvexStart);
+    }
+
+    void AppendAudioTrak(Mp4StreamWriter& moov, const MuxerState* state, uint32_t trackId)
+    {
+        const uint32_t timescale = static_cast<uint32_t>(state->audioSampleRate);
+        const uint64_t duration = state->audioSampleTotal;
+        const uint32_t channels = static_cast<uint32_t>(state->audioChannels);
+
+        size_t trakStart = moov.BeginBox("trak");
+
+        size_t tkhdStart = moov.BeginBox("tkhd");
+        moov.WriteU32(0x00000007);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(trackId);
+        moov.WriteU32(0);
+        moov.WriteU32(static_cast<uint32_t>(duration));
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.WriteU16(0x0100);
+        moov.WriteU16(0);
+        WriteMatrix(moov);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.EndBox(tkhdStart);
+
+        size_t mdiaStart = moov.BeginBox("mdia");
+
+        size_t mdhdStart = moov.BeginBox("mdhd");
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(timescale);
+        moov.WriteU32(static_cast<uint32_t>(duration));
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.EndBox(mdhdStart);
+
+        size_t hdlrStart = moov.BeginBox("hdlr");
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteString4("soun");
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        const char handlerName[] = "SoundHandler";
+        moov.WriteBytes(handlerName, sizeof(handlerName));
+        moov.EndBox(hdlrStart);
+
+        size_t minfStart = moov.BeginBox("minf");
+
+        size_t smhdStart = moov.BeginBox("smhd");
+        moov.WriteU32(0);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.EndBox(smhdStart);
+
+        size_t dinfStart = moov.BeginBox("dinf");
+        size_t drefStart = moov.BeginBox("dref");
+        moov.WriteU32(0);
+        moov.WriteU32(1);
+        size_t urlStart = moov.BeginBox("url ");
+        moov.WriteU32(0x00000001);
+        moov.EndBox(urlStart);
+        moov.EndBox(drefStart);
+        moov.EndBox(dinfStart);
+
+        size_t stblStart = moov.BeginBox("stbl");
+
+        size_t stsdStart = moov.BeginBox("stsd");
+        moov.WriteU32(0);
+        moov.WriteU32(1);
+        size_t mp4aStart = moov.BeginBox("mp4a");
+        for (int i = 0; i < 6; ++i) moov.WriteU8(0);
+        moov.WriteU16(1);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.WriteU32(0);
+        moov.WriteU16(static_cast<uint16_t>(channels));
+        moov.WriteU16(16);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.WriteU32(static_cast<uint32_t>(timescale) << 16);
+
+        auto esds = BuildEsds(state->audioSpecificConfig, state->audioBitrate);
+        size_t esdsStart = moov.BeginBox("esds");
+        moov.WriteBytes(esds);
+        moov.EndBox(esdsStart);
+
+        moov.EndBox(mp4aStart);
+        moov.EndBox(stsdStart);
+
+        WriteStts(moov, state->audioSampleDurations);
+        WriteStsc(moov, state->audioSampleOffsets, state->audioSampleSizes);
+        WriteStsz(moov, state->audioSampleSizes);
+        WriteChunkOffsets(moov, state->audioSampleOffsets, state->audioSampleSizes);
+
+        moov.EndBox(stblStart);
+        moov.EndBox(minfStart);
+        moov.EndBox(mdiaStart);
+        moov.EndBox(trakStart);
+    }
+
+    uint32_t VideoFrameDuration(const MuxerState* state)
+    {
+        const uint32_t fps = state->fps > 0 ? static_cast<uint32_t>(state->fps) : 30;
+        return 90000 / fps;
+    }
+
+    void AppendVideoSampleEntry(Mp4StreamWriter& moov, const MuxerState* state, const std::vector<uint8_t>& codecPrivate)
+    {
+        size_t sampleEntryStart = moov.BeginBox(state->isHevc ? "hvc1" : "avc1");
+        for (int i = 0; i < 6; ++i) moov.WriteU8(0);
+        moov.WriteU16(1);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU16(static_cast<uint16_t>(state->width));
+        moov.WriteU16(static_cast<uint16_t>(state->height));
+        moov.WriteU32(0x00480000);
+        moov.WriteU32(0x00480000);
+        moov.WriteU32(0);
+        moov.WriteU16(1);
+        moov.WriteU8(0);
+        for (int i = 0; i < 31; ++i) moov.WriteU8(0);
+        moov.WriteU16(0x0018);
+        moov.WriteU16(0xFFFF);
+
+        size_t codecBoxStart = moov.BeginBox(state->isHevc ? "hvcC" : "avcC");
+        moov.WriteBytes(codecPrivate);
+        moov.EndBox(codecBoxStart);
+
+        moov.EndBox(sampleEntryStart);
+    }
+
+    // ctts version 1, run-length coded. Written only when B-frames reorder the samples.
+    void WriteCtts(Mp4StreamWriter& out, const std::vector<int32_t>& offsets)
+    {
+        uint32_t entryCount = 0;
+        for (size_t i = 0; i < offsets.size(); ++i)
+        {
+            if (i == 0 || offsets[i] != offsets[i - 1])
+            {
+                entryCount++;
+            }
+        }
+
+        size_t cttsStart = out.BeginBox("ctts");
+        out.WriteU32(0x01000000);
+        out.WriteU32(entryCount);
+        size_t i = 0;
+        while (i < offsets.size())
+        {
+            size_t run = i + 1;
+            while (run < offsets.size() && offsets[run] == offsets[i])
+            {
+                ++run;
+            }
+            out.WriteU32(static_cast<uint32_t>(run - i));
+            out.WriteU32(static_cast<uint32_t>(offsets[i]));
+            i = run;
+        }
+        out.EndBox(cttsStart);
+    }
+
+    // Presentation starts at the earliest composition time rather than at the first decode
+    // time, so reordered tracks begin with their first displayed frame at time zero. The
+    // fragmented init segment only has the first fragment's offsets and writes duration 0 (the
+    // whole track) for FinalizeFragments to patch at durationPos.
+    void AppendEditList(Mp4StreamWriter& moov, const std::vector<int32_t>& offsets, uint32_t frameDuration, uint64_t duration,
+        uint64_t* durationPos = nullptr)
+    {
+        int64_t mediaTime = 0;
+        for (size_t i = 0; i < offsets.size(); ++i)
+        {
+            const int64_t compositionTime = static_cast<int64_t>(i) * frameDuration + offsets[i];
+            mediaTime = i == 0 ? compositionTime : std::min(mediaTime, compositionTime);
+        }
+
+        size_t edtsStart = moov.BeginBox("edts");
+        size_t elstStart = moov.BeginBox("elst");
+        moov.WriteU32(0);
+        moov.WriteU32(1);
+        if (durationPos)
+        {
+            *durationPos = moov.written;
+        }
+        moov.WriteU32(static_cast<uint32_t>(duration));
+        moov.WriteU32(static_cast<uint32_t>(std::max<int64_t>(mediaTime, 0)));
+        moov.WriteU16(1);
+        moov.WriteU16(0);
+        moov.EndBox(elstStart);
+        moov.EndBox(edtsStart);
+    }
+
+    // One sample group: its distinct entries (sgpd) and the members that map to them, in
+    // sample order, as (sample, 1-based entry index).
+    struct SampleGroup
+    {
+        std::vector<uint16_t> entries;
+        std::vector<std::pair<uint32_t, uint32_t>> members;
+
+        void Add(uint32_t sample, uint16_t entry)
+        {
+            auto found = std::find(entries.begin(), entries.end(), entry);
+            if (found == entries.end())
+            {
+                found = entries.insert(entries.end(), entry);
+            }
+            members.push_back({ sample, static_cast<uint32_t>(found - entries.begin()) + 1 });
+        }
+    };
+
+    // sgpd version 1 with fixed-size entries, then an sbgp mapping members to indexBase + entry
+    // (0x10000 addresses the sgpd inside the same traf) and everything else to no group.
+    template <typename Writer>
+    void AppendSampleGroup(Writer& out, const char* type, uint32_t entrySize, const SampleGroup& group, uint32_t indexBase)
+    {
+        if (group.members.empty())
+        {
+            return;
+        }
+
+        size_t sgpdStart = out.BeginBox("sgpd");
+        out.WriteU32(0x01000000);
+        out.WriteString4(type);
+        out.WriteU32(entrySize);
+        out.WriteU32(static_cast<uint32_t>(group.entries.size()));
+        for (uint16_t entry : group.entries)
+        {
+            if (entrySize == 1)
+            {
+                out.WriteU8(static_cast<uint8_t>(entry));
+            }
+            else
+            {
+                out.WriteU16(entry);
+            }
+        }
+        out.EndBox(sgpdStart);
+
+        std::vector<std::pair<uint32_t, uint32_t>> runs;
+        auto addRun = [&runs](uint32_t count, uint32_t index)
+        {
+            if (!runs.empty() && runs.back().second == index)
+            {
+                runs.back().first += count;
+            }
+            else
+            {
+                runs.push_back({ count, index });
+            }
+        };
+        uint32_t next = 0;
+        for (const auto& member : group.members)
+        {
+            if (member.first > next)
+            {
+                addRun(member.first - next, 0);
+            }
+            addRun(1, indexBase + member.second);
+            next = member.first + 1;
+        }
+
+        size_t sbgpStart = out.BeginBox("sbgp");
+        out.WriteU32(0);
+        out.WriteString4(type);
+        out.WriteU32(static_cast<uint32_t>(runs.size()));
+        for (const auto& run : runs)
+        {
+            out.WriteU32(run.first);
+            out.WriteU32(run.second);
+        }
+        out.EndBox(sbgpStart);
+    }
+
+    // 'rap ' and 'roll' groups for the open random access points among samples (indices are
+    // relative to the first of them). A 'rap ' entry records how many of the samples that
+    // follow in decode order are presented before the point; players skip those when they
+    // start there.
+    template <typename Writer>
+    void AppendRandomAccessGroups(Writer& out, const std::vector<MuxerState::RandomAccessPoint>& points,
+        const std::vector<int32_t>& offsets, uint32_t frameDuration, uint32_t indexBase)
+    {
+        auto compositionTime = [&](size_t i)
+        {
+            return static_cast<int64_t>(i) * frameDuration + (i < offsets.size() ? offsets[i] : 0);
+        };
+
+        SampleGroup rap;
+        SampleGroup roll;
+        for (const auto& point : points)
+        {
+            if (point.kind == RandomAccess::Roll)
+            {
+                roll.Add(point.sample, static_cast<uint16_t>(point.rollDistance));
+                continue;
+            }
+            uint16_t leading = 0;
+            for (size_t i = point.sample + 1; i < offsets.size() && leading < 0x7F
+                && compositionTime(i) < compositionTime(point.sample); ++i)
+            {
+                ++leading;
+            }
+            rap.Add(point.sample, static_cast<uint16_t>(0x80 | leading));
+        }
+        AppendSampleGroup(out, "rap ", 1, rap, indexBase);
+        AppendSampleGroup(out, "roll", 2, roll, indexBase);
+    }
+
+    void SerializeMoov(Mp4StreamWriter& moov, const MuxerState* state, uint64_t* mehdDurationPos, uint64_t* elstDurationPos = nullptr)
+    {
+        const uint32_t timescale = 90000;
+        const uint32_t frameDuration = VideoFrameDuration(state);
+        const uint32_t sampleCount = static_cast<uint32_t>(state->sampleSizes.size());
+        const bool reordered = std::any_of(state->compositionOffsets.begin(), state->compositionOffsets.end(),
+            [](int32_t offset) { return offset != 0; });
+        // The init segment goes out with the first fragment, whose offsets show the reordering.
+        const bool fragmentReordered = state->fragmented && std::any_of(state->fragmentVideoOffsets.begin(),
+            state->fragmentVideoOffsets.end(), [](int32_t offset) { return offset != 0; });
+        const uint64_t videoDuration = static_cast<uint64_t>(frameDuration) * sampleCount;
+        uint64_t audioDuration = 0;
+        if (state->audioSampleRate > 0)
+        {
+            audioDuration = state->audioSampleTotal * timescale / static_cast<uint64_t>(state->audioSampleRate);
+        }
+        const uint64_t duration = MaxU64(videoDuration, audioDuration);
+
+        size_t moovStart = moov.BeginBox("moov");
+
+        size_t mvhdStart = moov.BeginBox("mvhd");
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(timescale);
+        moov.WriteU32(static_cast<uint32_t>(duration));
+        moov.WriteU32(0x00010000);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        WriteMatrix(moov);
+        for (int i = 0; i < 6; ++i)
+        {
+            moov.WriteU32(0);
+        }
+        uint32_t nextTrackId = HasAudioTrack(state) ? 3 : 2;
+        moov.WriteU32(nextTrackId);
+        moov.EndBox(mvhdStart);
+
+        size_t trakStart = moov.BeginBox("trak");
+
+        size_t tkhdStart = moov.BeginBox("tkhd");
+        moov.WriteU32(0x00000007);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(1);
+        moov.WriteU32(0);
+        moov.WriteU32(static_cast<uint32_t>(duration));
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        WriteMatrix(moov);
+        moov.WriteU32(static_cast<uint32_t>(state->width) << 16);
+        moov.WriteU32(static_cast<uint32_t>(state->height) << 16);
+        moov.EndBox(tkhdStart);
+        if (reordered)
+        {
+            AppendEditList(moov, state->compositionOffsets, frameDuration, videoDuration);
+        }
+        else if (fragmentReordered)
+        {
+            AppendEditList(moov, state->fragmentVideoOffsets, frameDuration, 0, elstDurationPos);
+        }
+
+        size_t mdiaStart = moov.BeginBox("mdia");
+
+        size_t mdhdStart = moov.BeginBox("mdhd");
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(timescale);
+        moov.WriteU32(static_cast<uint32_t>(duration));
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.EndBox(mdhdStart);
+
+        size_t hdlrStart = moov.BeginBox("hdlr");
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteString4("vide");
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        moov.WriteU32(0);
+        const char handlerName[] = "VideoHandler";
+        moov.WriteBytes(handlerName, sizeof(handlerName));
+        moov.EndBox(hdlrStart);
+
+        size_t minfStart = moov.BeginBox("minf");
+
+        size_t vmhdStart = moov.BeginBox("vmhd");
+        moov.WriteU32(0x00000001);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.WriteU16(0);
+        moov.EndBox(vmhdStart);
+
+        size_t dinfStart = moov.BeginBox("dinf");
+        size_t drefStart = moov.BeginBox("dref");
+        moov.WriteU32(0);
+        moov.WriteU32(1);
+        size_t urlStart = moov.BeginBox("url ");
+        moov.WriteU32(0x00000001);
+        moov.EndBox(urlStart);
+        moov.EndBox(drefStart);
+        moov.EndBox(dinfStart);
+
+        size_t stblStart = moov.BeginBox("stbl");
+
+        size_t stsdStart = moov.BeginBox("stsd");
+        moov.WriteU32(0);
+        moov.WriteU32(static_cast<uint32_t>(1 + state->extraCodecPrivate.size()));
+        AppendVideoSampleEntry(moov, state, state->codecPrivate);
+        for (const auto& codecPrivate : state->extraCodecPrivate)
+        {
+            AppendVideoSampleEntry(moov, state, codecPrivate);
+        }
+        moov.EndBox(stsdStart);
+
+        size_t sttsStart = moov.BeginBox("stts");
+        moov.WriteU32(0);
+        if (sampleCount > 0)
+        {
+            moov.WriteU32(1);
+            moov.WriteU32(sampleCount);
+            moov.WriteU32(frameDuration);
+        }
+        else
+        {
+            moov.WriteU32(0);
+        }
+        moov.EndBox(sttsStart);
+        if (reordered)
+        {
+            WriteCtts(moov, state->compositionOffsets);
+        }
+
+        WriteStsc(moov, state->sampleOffsets, state->sampleSizes, &state->descriptionChanges);
+        WriteStsz(moov, state->sampleSizes);
+        WriteChunkOffsets(moov, state->sampleOffsets, state->sampleSizes, &state->descriptionChanges);
+
+        if (!state->syncSamples.empty())
+        {
+            size_t stssStart = moov.BeginBox("stss");
+            moov.WriteU32(0);
+            moov.WriteU32(static_cast<uint32_t>(state->syncSamples.size()));
+            for (uint32_t sampleIndex : state->syncSamples)
+            {
+                moov.WriteU32(sampleIndex);
+            }
+            moov.EndBox(stssStart);
+        }
+        AppendRandomAccessGroups(moov, state->randomAccessPoints, state->compositionOffsets, frameDuration, 0);
+
+        moov.EndBox(stblStart);
+        moov.EndBox(minfStart);
+        moov.EndBox(mdiaStart);
+        moov.EndBox(trakStart);
+
+        if (HasAudioTrack(state))
+        {
+            AppendAudioTrak(moov, state, 2);
+        }
+        if (state->fragmented)
+        {
+            AppendMvex(moov, state, frameDuration, mehdDurationPos);
+        }
+        moov.EndBox(moovStart);
+    }
+
+    uint64_t MeasureMoov(const MuxerState* state)
+    {
+        Mp4StreamWriter measure;
+        SerializeMoov(measure, state, nullptr);
+        return measure.written;
+    }
+
+    bool WriteMoov(MuxerState* state, uint64_t* mehdDurationPos = nullptr, uint64_t* elstDurationPos = nullptr)
+    {
+        Mp4StreamWriter writer;
+        SerializeMoov(writer, state, nullptr);
+        writer.BeginWrite(&state->file);
+        SerializeMoov(writer, state, mehdDurationPos, elstDurationPos);
+        return writer.Flush();
+    }
+
+    bool WriteInitSegment(MuxerState* state)
+    {
+        if (state->codecPrivate.empty())
+        {
+            SetError(state, L"Video codec header not found.");
+            return false;
+        }
+
+        state->fragmentHasAudio = state->audioInitialized && !state->audioSpecificConfig.empty();
+        uint64_t mehdDurationPos = 0;
+        uint64_t elstDurationPos = 0;
+        uint64_t moovOffset = state->file.Tell();
+        if (!WriteMoov(state, &mehdDurationPos, &elstDurationPos))
+        {
+            SetError(state, L"Failed to write moov.");
+            return false;
+        }
+        state->mehdDurationOffset = moovOffset + mehdDurationPos;
+        state->elstDurationOffset = elstDurationPos > 0 ? moovOffset + elstDurationPos : 0;
+        state->initSegmentWritten = true;
+        LogLine(state, L"fragmented moov written audio=" + std::to_wstring(state->fragmentHasAudio ? 1 : 0));
+        return true;
+    }
+
+    void AppendTraf(Mp4Buffer& moof, uint32_t trackId, uint64_t baseTime, uint32_t defaultDuration, uint32_t defaultFlags,
+        const std::vector<uint32_t>& sizes, const std::vector<uint32_t>* durations, const std::vector<int32_t>* compositionOffsets,
+        const uint32_t* firstSampleFlags, const std::vector<MuxerState::RandomAccessPoint>* randomAccess, size_t* dataOffsetPos)
+    {
+        size_t trafStart = moof.BeginBox("traf");
+
+        size_t tfhdStart = moof.BeginBox("tfhd");
+        moof.WriteU32(0x00020028); // default-base-is-moof, default duration, default flags
+        moof.WriteU32(trackId);
+        moof.WriteU32(defaultDuration);
+        moof.WriteU32(defaultFlags);
+        moof.EndBox(tfhdStart);
+
+        size_t tfdtStart = moof.BeginBox("tfdt");
+        moof.WriteU32(0x01000000);
+        moof.WriteU64(baseTime);
+        moof.EndBox(tfdtStart);
+
+        uint32_t trunFlags = 0x00000201; // data offset, sample size
+        if (firstSampleFlags)
+        {
+            trunFlags |= 0x00000004;
+        }
+        if (durations)
+        {
+            trunFlags |= 0x00000100;
+        }
+        if (compositionOffsets)
+        {
+            trunFlags |= 0x01000800; // version 1: signed composition offsets
+        }
+        size_t trunStart = moof.BeginBox("trun");
+        moof.WriteU32(trunFlags);
+        moof.WriteU32(static_cast<uint32_t>(sizes.size()));
+        *dataOffsetPos = moof.data.size();
+        moof.WriteU32(0);
+        if (firstSampleFlags)
+        {
+            moof.WriteU32(*firstSampleFlags);
+        }
+        for (size_t i = 0; i < sizes.size(); ++i)
+        {
+            if (durations)
+            {
+                moof.WriteU32((*durations)[i]);
+            }
+            moof.WriteU32(sizes[i]);
+            if (compositionOffsets)
+            {
+                moof.WriteU32(static_cast<uint32_t>((*compositionOffsets)[i]));
+            }
+        }
+        moof.EndBox(trunStart);
+        if (randomAccess)
+        {
+            static const std::vector<int32_t> noOffsets;
+            AppendRandomAccessGroups(moof, *randomAccess, compositionOffsets ? *compositionOffsets : noOffsets, defaultDuration, 0x10000);
+        }
+
+        moof.EndBox(trafStart);
+    }
+
+    bool FlushFragment(MuxerState* state)
+    {
+        if (state->fragmentVideoSizes.empty() && state->fragmentAudioSizes.empty())
+        {
+            return true;
+        }
+        if (!state->initSegmentWritten && !WriteInitSegment(state))
+        {
+            return false;
+        }
+        if (!state->fragmentHasAudio)
+        {
+            state->fragmentAudioData.clear();
+            state->fragmentAudioSizes.clear();
+            state->fragmentAudioDurations.clear();
+            if (state->fragmentVideoSizes.empty())
+            {
+                return true;
+            }
+        }
+
+        const uint32_t frameDuration = VideoFrameDuration(state);
+        const uint32_t nonSyncFlags = 0x01010000; // depends on others, non-sync
+        const uint32_t syncFlags = 0x02000000;
+        const uint64_t moofOffset = state->file.Tell();
+
+        Mp4Buffer moof;
+        size_t moofStart = moof.BeginBox("moof");
+        size_t mfhdStart = moof.BeginBox("mfhd");
+        moof.WriteU32(0);
+        moof.WriteU32(++state->fragmentSequence);
+        moof.EndBox(mfhdStart);
+
+        size_t videoOffsetPos = 0;
+        size_t audioOffsetPos = 0;
+        if (!state->fragmentVideoSizes.empty())
+        {
+            const uint32_t firstFlags = state->fragmentStartsWithSync ? syncFlags : nonSyncFlags;
+            const bool reordered = std::any_of(state->fragmentVideoOffsets.begin(), state->fragmentVideoOffsets.end(),
+                [](int32_t offset) { return offset != 0; });
+            AppendTraf(moof, 1, state->fragmentVideoTime, frameDuration, nonSyncFlags,
+                state->fragmentVideoSizes, nullptr, reordered ? &state->fragmentVideoOffsets : nullptr, &firstFlags,
+                &state->fragmentRandomAccess, &videoOffsetPos);
+        }
+        if (!state->fragmentAudioSizes.empty())
+        {
+            AppendTraf(moof, 2, state->fragmentAudioTime, 1024, syncFlags,
+                state->fragmentAudioSizes, &state->fragmentAudioDurations, nullptr, nullptr, nullptr, &audioOffsetPos);
+        }
+        moof.EndBox(moofStart);
+
+        const uint64_t payloadSize = static_cast<uint64_t>(state->fragmentVideoData.size()) + state->fragmentAudioData.size();
+        const bool largeMdat = payloadSize + 8 > 0xFFFFFFFFu;
+        const uint64_t mdatHeaderSize = largeMdat ? 16 : 8;
+        const uint64_t videoDataOffset = moof.data.size() + mdatHeaderSize;
+        if (!state->fragmentVideoSizes.empty())
+        {
+            moof.PatchU32(videoOffsetPos, static_cast<uint32_t>(videoDataOffset));
+        }
+        if (!state->fragmentAudioSizes.empty())
+        {
+            moof.PatchU32(audioOffsetPos, static_cast<uint32_t>(videoDataOffset + state->fragmentVideoData.size()));
+        }
+
+        bool ok = state->file.Write(moof.data.data(), moof.data.size());
+        if (ok && largeMdat)
+        {
+            ok = WriteU32BE(state->file, 1) && WriteString4(state->file, "mdat") && WriteU64BE(state->file, payloadSize + 16);
+        }
+        else if (ok)
+        {
+            ok = WriteU32BE(state->file, static_cast<uint32_t>(payloadSize + 8)) && WriteString4(state->file, "mdat");
+        }
+        if (ok && !state->fragmentVideoData.empty())
+        {
+            ok = state->file.Write(state->fragmentVideoData.data(), state->fragmentVideoData.size());
+        }
+        if (ok && !state->fragmentAudioData.empty())
+        {
+            ok = state->file.Write(state->fragmentAudioData.data(), state->fragmentAudioData.size());
+        }
+        if (!ok)
+        {
+            SetError(state, L"Failed to write fragment.");
+            return false;
+        }
+
+        if (!state->fragmentVideoSizes.empty() && state->fragmentStartsWithSync)
+        {
+            state->fragmentIndex.push_back({ state->fragmentVideoTime, moofOffset });
+        }
+        state->fragmentVideoTime += static_cast<uint64_t>(frameDuration) * state->fragmentVideoSizes.size();
+        for (uint32_t d : state->fragmentAudioDurations)
+        {
+            state->fragmentAudioTime += d;
+        }
+
+        // clear() keeps capacity, so steady-state fragments reuse the same buffers.
+        state->fragmentVideoData.clear();
+        state->fragmentVideoSizes.clear();
+        state->fragmentVideoOffsets.clear();
+        state->fragmentRandomAccess.clear();
+        state->fragmentAudioData.clear();
+        state->fragmentAudioSizes.clear();
+        state->fragmentAudioDurations.clear();
+        state->fragmentStartsWithSync = false;
+        return true;
+    }
+
+    bool AppendFragmentSample(MuxerState* state, const MuxerState::EncodedSample& sample)
+    {
+        if (sample.isAudio)
+        {
+            if (state->initSegmentWritten && !state->fragmentHasAudio)
+            {
+                // The init segment has no audio trak to put it in; dropping the track would
+                // leave a silent file that looks like a successful render.
+                SetError(state, L"Audio started after the fragmented MP4 header was written.");
+                return false;
+            }
+            state->fragmentAudioData.insert(state->fragmentAudioData.end(), sample.data.begin(), sample.data.end());
+            state->fragmentAudioSizes.push_back(static_cast<uint32_t>(sample.data.size()));
+            state->fragmentAudioDurations.push_back(sample.audioDuration);
+            return true;
+        }
+
+        if (sample.keyframe && !state->fragmentVideoSizes.empty())
+        {
+            if (!FlushFragment(state))
+            {
+                return false;
+            }
+        }
+        if (state->fragmentVideoSizes.empty())
+        {
+            state->fragmentStartsWithSync = sample.keyframe;
+        }
+        if (sample.randomAccess > RandomAccess::Sync)
+        {
+            state->fragmentRandomAccess.push_back({ static_cast<uint32_t>(state->fragmentVideoSizes.size()), sample.randomAccess, sample.rollDistance });
+        }
+        state->fragmentVideoData.insert(state->fragmentVideoData.end(), sample.data.begin(), sample.data.end());
+        state->fragmentVideoSizes.push_back(static_cast<uint32_t>(sample.data.size()));
+        state->fragmentVideoOffsets.push_back(sample.compositionOffset);
+        return true;
+    }
+
+    bool FinalizeFragments(MuxerState* state)
+    {
+        if (!FlushFragment(state))
+        {
+            return false;
+        }
+        if (!state->initSegmentWritten && !WriteInitSegment(state))
+        {
+            return false;
+        }
+
+        Mp4Buffer mfra;
+        size_t mfraStart = mfra.BeginBox("mfra");
+        size_t tfraStart = mfra.BeginBox("tfra");
+        mfra.WriteU32(0x01000000);
+        mfra.WriteU32(1);
+        mfra.WriteU32(0); // 1-byte traf/trun/sample numbers
+        mfra.WriteU32(static_cast<uint32_t>(state->fragmentIndex.size()));
+        for (const auto& entry : state->fragmentIndex)
+        {
+            mfra.WriteU64(entry.time);
+            mfra.WriteU64(entry.moofOffset);
+            mfra.WriteU8(1);
+            mfra.WriteU8(1);
+            mfra.WriteU8(1);
+        }
+        mfra.EndBox(tfraStart);
+        size_t mfroStart = mfra.BeginBox("mfro");
+        mfra.WriteU32(0);
+        mfra.WriteU32(static_cast<uint32_t>(mfra.data.size() + 4));
+        mfra.EndBox(mfroStart);
+        mfra.EndBox(mfraStart);
+
+        if (!state->file.Write(mfra.data.data(), mfra.data.size()))
+        {
+            SetError(state, L"Failed to write mfra.");
+            return false;
+        }
+
+        uint64_t fileSize = state->file.Tell();
+        uint64_t duration = state->fragmentVideoTime;
+        if (state->fragmentHasAudio && state->audioSampleRate > 0)
+        {
+            duration = MaxU64(duration, state->fragmentAudioTime * 90000 / static_cast<uint64_t>(state->audioSampleRate));
+        }
+        if (!state->file.Seek(state->mehdDurationOffset) || !WriteU64BE(state->file, duration))
+        {
+            SetError(state, L"Failed to update mehd duration.");
+            return false;
+        }
+        if (state->elstDurationOffset > 0
+            && (!state->file.Seek(state->elstDurationOffset) || !WriteU32BE(state->file, static_cast<uint32_t>(state->fragmentVideoTime))))
+        {
+            SetError(state, L"Failed to update elst duration.");
+            return false;
+        }
+        state->file.Seek(fileSize);
+        return true;
+    }
+
+    void ShiftSampleOffsets(MuxerState* state, uint64_t delta)
+    {
+        for (auto& offset : state->sampleOffsets)
+        {
+            offset += delta;
+        }
+        for (auto& offset : state->audioSampleOffsets)
+        {
+            offset += delta;
+        }
+    }
+
+    bool RelocateMdat(MuxerState* state, uint64_t dataEnd, uint64_t shift)
+    {
+        // Copy the last block first so no data is overwritten before it has been moved.
+        const size_t blockSize = 8 * 1024 * 1024;
+        std::vector<uint8_t> block(static_cast<size_t>(std::min<uint64_t>(blockSize, dataEnd - state->mdatHeaderOffset)));
+        uint64_t end = dataEnd;
+        while (end > state->mdatHeaderOffset)
+        {
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(end - state->mdatHeaderOffset, block.size()));
+            uint64_t src = end - chunk;
+            if (!state->file.Seek(src) || !state->file.Read(block.data(), chunk)
+                || !state->file.Seek(src + shift) || !state->file.Write(block.data(), chunk))
+            {
+                return false;
+            }
+            end = src;
+        }
+        state->mdatHeaderOffset += shift;
+        state->mdatLargeSizeOffset += shift;
+        state->mdatDataOffset += shift;
+        return true;
+    }
+
+    bool FinalizeFaststart(MuxerState* state, uint64_t dataEnd)
+    {
+        uint64_t available = state->moovReserveSize;
+        uint64_t shift = 0;
+        uint64_t moovSize = MeasureMoov(state);
+        // The moov must fill the reserve exactly or leave room for a trailing free box header.
+        while (moovSize != available && moovSize + 8 > available)
+        {
+            uint64_t grow = moovSize + 8 - available;
+            grow = (grow + 4095) & ~static_cast<uint64_t>(4095);
+            ShiftSampleOffsets(state, grow);
+            shift += grow;
+            available += grow;
+            moovSize = MeasureMoov(state);
+        }
+
+        const uint64_t mdatSize = dataEnd - state->mdatHeaderOffset;
+        if (shift > 0)
+        {
+            LogLine(state, L"faststart reserve too small moov=" + std::to_wstring(moovSize)
+                + L" reserve=" + std::to_wstring(state->moovReserveSize) + L" relocating by " + std::to_wstring(shift));
+            if (!RelocateMdat(state, dataEnd, shift))
+            {
+                SetError(state, L"Failed to relocate mdat.");
+                return false;
+            }
+        }
+
+        if (!state->file.Seek(state->mdatLargeSizeOffset) || !WriteU64BE(state->file, mdatSize))
+        {
+            SetError(state, L"Failed to update mdat size.");
+            return false;
+        }
+
+        if (!state->file.Seek(state->moovReserveOffset) || !WriteMoov(state))
+        {
+            SetError(state, L"Failed to write moov.");
+            return false;
+        }
+        if (available > moovSize)
+        {
+            if (!WriteU32BE(state->file, static_cast<uint32_t>(available - moovSize)) || !WriteString4(state->file, "free"))
+            {
+                SetError(state, L"Failed to write free box.");
+                return false;
+            }
+        }
+
+        state->file.Seek(dataEnd + shift);
+        return true;
+    }
+
+    bool FinalizeMp4(MuxerState* state)
+    {
+        if (!state->writerInitialized || state->mp4Finalized)
+        {
+            return true;
+        }
+
+        LogLine(state, L"finalize mp4 start");
+        StopWriterThread(state);
+        if (state->writerError)
+        {
+            // The writer stopped on an error it has already set; the file is incomplete.
+            return false;
+        }
+
+        if (state->codecPrivate.empty())
+        {
+            SetError(state, L"Video codec header not found.");
+            return false;
+        }
+
+        if (state->fragmented)
+        {
+            if (!FinalizeFragments(state))
+            {
+                return false;
+            }
+            if (!state->file.Close())
+            {
+                SetError(state, L"Failed to flush output file.");
+                return false;
+            }
+            state->mp4Finalized = true;
+            LogLine(state, L"finalize fragmented mp4 done fragments=" + std::to_wstring(state->fragmentSequence));
+            return true;
+        }
+
+        uint64_t dataEnd = state->file.Tell();
+
+        if (state->faststart)
+        {
+            if (!FinalizeFaststart(state, dataEnd))
+            {
+                return false;
+            }
+            if (!state->file.Close())
+            {
+                SetError(state, L"Failed to flush output file.");
+                return false;
+            }
+            CloseJournal(state, true);
+            state->mp4Finalized = true;
+            LogLine(state, L"finalize faststart mp4 done");
+            return true;
+        }
+
+        if (!WriteMoov(state))
+        {
+            SetError(state, L"Failed to write moov.");
+            return false;
+        }
+
+        uint64_t fileSize = state->file.Tell();
+        uint64_t mdatSize = dataEnd - state->mdatHeaderOffset;
+        if (!state->file.Seek(state->mdatLargeSizeOffset) || !WriteU64BE(state->file, mdatSize))
+        {
+            SetError(state, L"Failed to update mdat size.");
+            return false;
+        }
+
+        state->file.Seek(fileSize);
+        if (!state->file.Close())
+        {
+            SetError(state, L"Failed to flush output file.");
+            return false;
+        }
+        CloseJournal(state, true);
+        state->mp4Finalized = true;
+        LogLine(state, L"finalize mp4 done");
+        return true;
+    }
+
+    struct ByteReader
+    {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        size_t pos = 0;
+
+        bool Has(size_t count) const
+        {
+            return size - pos >= count;
+        }
+
+        uint8_t U8()
+        {
+            return data[pos++];
+        }
+
+        uint16_t U16()
+        {
+            const uint16_t high = U8();
+            return static_cast<uint16_t>((high << 8) | U8());
+        }
+
+        uint32_t U32()
+        {
+            uint32_t value = (static_cast<uint32_t>(data[pos]) << 24) | (static_cast<uint32_t>(data[pos + 1]) << 16)
+                | (static_cast<uint32_t>(data[pos + 2]) << 8) | data[pos + 3];
+            pos += 4;
+            return value;
+        }
+
+        uint64_t U64()
+        {
+            uint64_t high = U32();
+            return (high << 32) | U32();
+        }
+
+        bool Blob(std::vector<uint8_t>& out)
+        {
+            if (!Has(4))
+            {
+                return false;
+            }
+            uint32_t length = U32();
+            if (!Has(length))
+            {
+                return false;
+            }
+            out.assign(data + pos, data + pos + length);
+            pos += length;
+            return true;
+        }
+    };
+
+    // Restores the stream setup into state and returns the sample records in write order.
+    // A torn record at the end (crash mid-flush) simply ends the list.
+    bool ReadJournal(MuxerState* state, std::vector<RecoveredSample>& samples)
+    {
+        FileWriter journal;
+        if (!journal.Open(JournalPath(state->outputPath), FileBackendKind::Standard, true))
+        {
+            return false;
+        }
+        std::vector<uint8_t> bytes(static_cast<size_t>(journal.size));
+        bool ok = bytes.size() >= 4 && journal.Read(bytes.data(), bytes.size());
+        journal.Close();
+        if (!ok || memcmp(bytes.data(), "NVJ1", 4) != 0)
+        {
+            return false;
+        }
+
+        ByteReader reader{ bytes.data(), bytes.size(), 4 };
+        bool haveSetup = false;
+        uint32_t description = 1;
+        while (reader.Has(1))
+        {
+            uint8_t tag = reader.U8();
+            if (tag == 'M' && reader.Has(22))
+            {
+                state->isHevc = reader.U8() != 0;
+                state->faststart = reader.U8() != 0;
+                state->width = static_cast<int>(reader.U32());
+                state->height = static_cast<int>(reader.U32());
+                state->fps = static_cast<int>(reader.U32());
+                state->mdatHeaderOffset = reader.U64();
+                state->mdatLargeSizeOffset = state->mdatHeaderOffset + 8;
+                state->mdatDataOffset = state->mdatHeaderOffset + 16;
+                haveSetup = true;
+            }
+            else if (tag == 'C')
+            {
+                if (!reader.Blob(state->codecPrivate))
+                {
+                    break;
+                }
+            }
+            else if (tag == 'D' && reader.Has(4))
+            {
+                description = reader.U32();
+                std::vector<uint8_t> codecPrivate;
+                if (!reader.Blob(codecPrivate) || description == 0 || description > state->extraCodecPrivate.size() + 2)
+                {
+                    break;
+                }
+                if (description == state->extraCodecPrivate.size() + 2)
+                {
+                    state->extraCodecPrivate.push_back(std::move(codecPrivate));
+                }
+            }
+            else if (tag == 'A' && reader.Has(12))
+            {
+                state->audioSampleRate = static_cast<int>(reader.U32());
+                state->audioChannels = static_cast<int>(reader.U32());
+                state->audioBitrate = reader.U32();
+                if (!reader.Blob(state->audioSpecificConfig))
+                {
+                    break;
+                }
+            }
+            else if ((tag == 'v' && reader.Has(13)) || (tag == 'b' && reader.Has(17)))
+            {
+                RecoveredSample sample;
+                sample.offset = reader.U64();
+                sample.size = reader.U32();
+                const uint8_t kind = reader.U8();
+                if (kind > static_cast<uint8_t>(RandomAccess::Roll))
+                {
+                    break;
+                }
+                sample.randomAccess = static_cast<RandomAccess>(kind);
+                sample.keyframe = sample.randomAccess == RandomAccess::Sync || sample.randomAccess == RandomAccess::OpenSync;
+                if (sample.randomAccess == RandomAccess::Roll)
+                {
+                    if (!reader.Has(tag == 'b' ? 6 : 2))
+                    {
+                        break;
+                    }
+                    sample.rollDistance = static_cast<int16_t>(reader.U16());
+                }
+                sample.description = description;
+                sample.compositionOffset = tag == 'b' ? static_cast<int32_t>(reader.U32()) : 0;
+                samples.push_back(sample);
+            }
+            else if (tag == 'a' && reader.Has(16))
+            {
+                RecoveredSample sample;
+                sample.offset = reader.U64();
+                sample.size = reader.U32();
+                sample.duration = reader.U32();
+                sample.isAudio = true;
+                samples.push_back(sample);
+            }
+            else
+            {
+                break;
+            }
+        }
+        return haveSetup && !state->codecPrivate.empty();
+    }
+
+    uint32_t LoadU32BE(const uint8_t* p)
+    {
+        return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+    }
+
+    void StoreU32BE(uint8_t* p, uint32_t value)
+    {
+        p[0] = static_cast<uint8_t>(value >> 24);
+        p[1] = static_cast<uint8_t>(value >> 16);
+        p[2] = static_cast<uint8_t>(value >> 8);
+        p[3] = static_cast<uint8_t>(value);
+    }
+
+    bool IsPlausibleNal(const uint8_t* nal, size_t size, bool hevc)
+    {
+        if (size < (hevc ? 2u : 1u) || (nal[0] & 0x80) != 0)
+        {
+            return false;
+        }
+        if (hevc)
+        {
+            const uint8_t type = (nal[0] >> 1) & 0x3F;
+            const uint8_t layer = static_cast<uint8_t>(((nal[0] & 1) << 5) | (nal[1] >> 3));
+            const uint8_t temporalIdPlus1 = nal[1] & 0x07;
+            return layer == 0 && temporalIdPlus1 != 0 && (type <= 21 || type == 35 || type == 39 || type == 40);
+        }
+        const uint8_t type = nal[0] & 0x1F;
+        return (type >= 1 && type <= 6) || type == 9 || type == 12;
+    }
+
+    bool IsVclNal(const uint8_t* nal, bool hevc)
+    {
+        return hevc ? ((nal[0] >> 1) & 0x3F) <= 21 : ((nal[0] & 0x1F) >= 1 && (nal[0] & 0x1F) <= 5);
+    }
+
+    bool IsIdrNal(const uint8_t* nal, bool hevc)
+    {
+        const uint8_t type = hevc ? ((nal[0] >> 1) & 0x3F) : (nal[0] & 0x1F);
+        return hevc ? (type == 19 || type == 20) : type == 5;
+    }
+
+    // AUD, prefix SEI, or the first slice of a picture (first_mb_in_slice == 0 /
+    // first_slice_segment_in_pic_flag, i.e. the top bit after the NAL header).
+    bool StartsPicture(const uint8_t* nal, size_t size, bool hevc)
+    {
+        const uint8_t type = hevc ? ((nal[0] >> 1) & 0x3F) : (nal[0] & 0x1F);
+        const size_t header = hevc ? 2 : 1;
+        if (hevc ? (type == 35 || type == 39) : (type == 9 || type == 6))
+        {
+            return true;
+        }
+        return IsVclNal(nal, hevc) && size > header && (nal[header] & 0x80) != 0;
+    }
+
+    // True when data holds a whole number of plausible 4-byte length-prefixed NAL units,
+    // at least one of them a slice.
+    bool IsLengthPrefixedSample(const uint8_t* data, size_t size, bool hevc)
+    {
+        bool hasSlice = false;
+        size_t pos = 0;
+        while (pos < size)
+        {
+            if (size - pos < 4)
+            {
+                return false;
+            }
+            const size_t length = LoadU32BE(data + pos);
+            pos += 4;
+            if (length > size - pos || !IsPlausibleNal(data + pos, length, hevc))
+            {
+                return false;
+            }
+            hasSlice = hasSlice || IsVclNal(data + pos, hevc);
+            pos += length;
+        }
+        return hasSlice;
+    }
+
+    // Reads [from, end) of the output through a sliding window.
+    struct ScanWindow
+    {
+        FileWriter* file = nullptr;
+        uint64_t end = 0;
+        uint64_t start = 0;
+        std::vector<uint8_t> bytes;
+
+        const uint8_t* At(uint64_t pos, size_t need)
+        {
+            if (pos + need > end)
+            {
+                return nullptr;
+            }
+            if (pos < start || pos + need > start + bytes.size())
+            {
+                size_t length = static_cast<size_t>(std::min<uint64_t>(std::max<size_t>(need, 16u << 20), end - pos));
+                bytes.resize(length);
+                if (!file->Seek(pos) || !file->Read(bytes.data(), length))
+                {
+                    bytes.clear();
+                    return nullptr;
+                }
+                start = pos;
+            }
+            return bytes.data() + (pos - start);
+        }
+    };
+
+    // Recovers video samples from mdat without an index by walking length-prefixed NAL units
+    // and splitting at picture starts. Bytes that don't parse (audio chunks, a torn tail) are
+    // skipped; after such a gap a picture is only trusted once the next one follows it, since
+    // audio payload can occasionally look like a NAL header.
+    void ScanVideoSamples(FileWriter& file, uint64_t from, uint64_t end, bool hevc, std::vector<RecoveredSample>& out)
+    {
+        const size_t maxNalSize = 64u << 20;
+        ScanWindow window{ &file, end, 0, {} };
+        bool anchored = true;
+        bool open = false;
+        bool openAnchored = false;
+        bool hasSlice = false;
+        uint64_t sampleEnd = 0;
+        RecoveredSample current;
+        auto emit = [&]()
+        {
+            current.size = static_cast<uint32_t>(sampleEnd - current.offset);
+            out.push_back(current);
+            open = false;
+        };
+
+        uint64_t pos = from;
+        while (pos + 4 < end)
+        {
+            const uint8_t* prefix = window.At(pos, 4);
+            const size_t length = prefix ? LoadU32BE(prefix) : 0;
+            if (open && length > 0 && length <= maxNalSize && pos + 4 + length > end)
+            {
+                // A further slice of the open picture that runs past the data: the write was
+                // cut off inside it, so the picture is incomplete.
+                const size_t available = static_cast<size_t>(std::min<uint64_t>(end - pos - 4, 3));
+                const uint8_t* header = window.At(pos + 4, available);
+                if (header && IsPlausibleNal(header, available, hevc) && IsVclNal(header, hevc) && !StartsPicture(header, available, hevc))
+                {
+                    open = false;
+                }
+            }
+            const uint8_t* nal = (length > 0 && length <= maxNalSize) ? window.At(pos + 4, length) : nullptr;
+            if (!nal || !IsPlausibleNal(nal, length, hevc))
+            {
+                if (open && openAnchored && hasSlice)
+                {
+                    emit();
+                }
+                open = false;
+                anchored = false;
+                ++pos;
+                continue;
+            }
+
+            const bool pictureStart = StartsPicture(nal, length, hevc);
+            if (open && pictureStart && hasSlice)
+            {
+                emit();
+                anchored = true;
+            }
+            if (!open)
+            {
+                if (!pictureStart)
+                {
+                    anchored = false;
+                    ++pos;
+                    continue;
+                }
+                open = true;
+                openAnchored = anchored;
+                hasSlice = false;
+                current = RecoveredSample{};
+                current.offset = pos;
+            }
+            if (IsVclNal(nal, hevc))
+            {
+                hasSlice = true;
+                if (IsIdrNal(nal, hevc))
+                {
+                    current.keyframe = true;
+                    current.randomAccess = RandomAccess::Sync;
+                }
+            }
+            pos += 4 + length;
+            sampleEnd = pos;
+        }
+        if (open && hasSlice && (openAnchored || sampleEnd == end))
+        {
+            emit();
+        }
+    }
+
+    // Refills the sample tables of a state restored by ReadJournal: journaled samples are kept
+    // up to the first one that is missing from the file, then any newer video is recovered by
+    // scanning. Returns the end of the last sample kept.
+    uint64_t RestoreSampleTables(MuxerState* state, const std::vector<RecoveredSample>& journaled, uint64_t fileLength)
+    {
+        uint64_t dataEnd = state->mdatDataOffset;
+        std::vector<uint8_t> scratch;
+        std::vector<RecoveredSample> samples;
+        samples.reserve(journaled.size());
+        for (const auto& sample : journaled)
+        {
+            if (sample.offset < state->mdatDataOffset || sample.offset + sample.size > fileLength || sample.size == 0)
+            {
+                break;
+            }
+            if (!sample.isAudio)
+            {
+                scratch.resize(sample.size);
+                if (!state->file.Seek(sample.offset) || !state->file.Read(scratch.data(), scratch.size())
+                    || !IsLengthPrefixedSample(scratch.data(), scratch.size(), state->isHevc))
+                {
+                    break;
+                }
+            }
+            samples.push_back(sample);
+            dataEnd = std::max(dataEnd, sample.offset + sample.size);
+        }
+
+        const size_t journaledCount = samples.size();
+        ScanVideoSamples(state->file, dataEnd, fileLength, state->isHevc, samples);
+        if (samples.size() > journaledCount)
+        {
+            LogLine(state, L"repair scanned samples=" + std::to_wstring(samples.size() - journaledCount));
+            // Samples past the journal continue with the last description it recorded.
+            uint32_t description = 1;
+            for (size_t i = 0; i < journaledCount; ++i)
+            {
+                description = samples[i].isAudio ? description : samples[i].description;
+            }
+            for (size_t i = journaledCount; i < samples.size(); ++i)
+            {
+                samples[i].description = description;
+            }
+        }
+
+        for (const auto& sample : samples)
+        {
+            if (sample.isAudio)
+            {
+                state->audioSampleOffsets.push_back(sample.offset);
+                state->audioSampleSizes.push_back(sample.size);
+                state->audioSampleDurations.push_back(sample.duration);
+                state->audioSampleTotal += sample.duration;
+            }
+            else
+            {
+                const uint32_t current = state->descriptionChanges.empty() ? 1 : state->descriptionChanges.back().description;
+                if (sample.description != current)
+                {
+                    state->descriptionChanges.push_back({ static_cast<uint32_t>(state->sampleSizes.size()), sample.description });
+                }
+                state->sampleOffsets.push_back(sample.offset);
+                state->sampleSizes.push_back(sample.size);
+                state->compositionOffsets.push_back(sample.compositionOffset);
+                if (sample.randomAccess > RandomAccess::Sync)
+                {
+                    state->randomAccessPoints.push_back({ static_cast<uint32_t>(state->sampleSizes.size() - 1), sample.randomAccess, sample.rollDistance });
+                }
+                if (sample.keyframe)
+                {
+                    state->syncSamples.push_back(static_cast<uint32_t>(state->sampleSizes.size()));
+                }
+            }
+            dataEnd = std::max(dataEnd, sample.offset + sample.size);
+        }
+        return dataEnd;
+    }
+
+    // Returns the offset of the first top-level box of the given type, or 0 if there is none.
+    uint64_t FindTopLevelBox(FileWriter& file, uint64_t fileLength, const char* type)
+    {
+        uint64_t pos = 0;
+        uint8_t header[16];
+        while (pos + 8 <= fileLength)
+        {
+            if (!file.Seek(pos) || !file.Read(header, 8))
+            {
+                return 0;
+            }
+            if (memcmp(header + 4, type, 4) == 0)
+            {
+                return pos;
+            }
+            uint64_t size = LoadU32BE(header);
+            if (size == 1)
+            {
+                if (pos + 16 > fileLength || !file.Read(header + 8, 8))
+                {
+                    return 0;
+                }
+                size = (static_cast<uint64_t>(LoadU32BE(header + 8)) << 32) | LoadU32BE(header + 12);
+            }
+            if (size < 8)
+            {
+                // size 0 (runs to end of file) or an unfinished largesize.
+                return 0;
+            }
+            pos += size;
+        }
+        return 0;
+    }
+
+    // Returns the number of video frames recovered, 0 if the file was already complete,
+    // or -1 with lastError set.
+    int RepairOutput(MuxerState* state)
+    {
+        if (!state->file.Open(state->outputPath, FileBackendKind::Standard, true))
+        {
+            SetError(state, L"Failed to open output file.");
+            return -1;
+        }
+        const uint64_t fileLength = state->file.size;
+        if (FindTopLevelBox(state->file, fileLength, "moov") != 0)
+        {
+            state->file.Close();
+            return 0;
+        }
+
+        std::vector<RecoveredSample> journaled;
+        if (!ReadJournal(state, journaled))
+        {
+            state->file.Close();
+            SetError(state, L"Repair journal not found or incomplete.");
+            return -1;
+        }
+
+        uint8_t type[4] = {};
+        if (!state->file.Seek(state->mdatHeaderOffset + 4) || !state->file.Read(type, 4) || memcmp(type, "mdat", 4) != 0)
+        {
+            state->file.Close();
+            SetError(state, L"Repair journal does not match the output file.");
+            return -1;
+        }
+
+        const uint64_t dataEnd = RestoreSampleTables(state, journaled, fileLength);
+        if (state->sampleSizes.empty())
+        {
+            state->file.Close();
+            SetError(state, L"No complete video frames to recover.");
+            return -1;
+        }
+
+        // moov goes after the last good sample; anything torn beyond it is cut off.
+        if (!state->file.Seek(dataEnd) || !WriteMoov(state))
+        {
+            state->file.Close();
+            SetError(state, L"Failed to write moov.");
+            return -1;
+        }
+        const uint64_t fileEnd = state->file.Tell();
+        if (!state->file.Seek(state->mdatLargeSizeOffset) || !WriteU64BE(state->file, dataEnd - state->mdatHeaderOffset))
+        {
+            state->file.Close();
+            SetError(state, L"Failed to update mdat size.");
+            return -1;
+        }
+        state->file.Truncate(fileEnd);
+        if (!state->file.Close())
+        {
+            SetError(state, L"Failed to flush output file.");
+            return -1;
+        }
+        RemoveFile(JournalPath(state->outputPath));
+        return static_cast<int>(state->sampleSizes.size());
+    }
+
+    // Start-code search for ParseAnnexB. Each scanner returns the first position at or after
+    // from holding 00 00 01 (with the 01 inside the buffer), or size. The vector versions
+    // compare 16 or 32 positions per step and finish the last few bytes with the scalar loop.
+    size_t ScanStartCodeScalar(const uint8_t* data, size_t size, size_t from)
+    {
+        for (size_t j = from; j + 2 < size; ++j)
+        {
+            if (data[j + 2] > 1)
+            {
+                // No start code can cover j, j+1 or j+2.
+                j += 2;
+            }
+            else if (data[j] == 0 && data[j + 1] == 0 && data[j + 2] == 1)
+            {
+                return j;
+            }
+        }
+        return size;
+    }
+
+#if defined(_M_X64) || defined(__x86_64__)
+    uint32_t LowestSetBit(uint32_t mask)
+    {
+#ifdef _MSC_VER
+        unsigned long index = 0;
+        _BitScanForward(&index, mask);
+        return static_cast<uint32_t>(index);
+#else
+        return static_cast<uint32_t>(__builtin_ctz(mask));
+#endif
+    }
+
+    size_t ScanStartCodeSse2(const uint8_t* data, size_t size, size_t from)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi8(1);
+        size_t j = from;
+        for (; j + 18 <= size; j += 16)
+        {
+            const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + j));
+            const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + j + 1));
+            const __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + j + 2));
+            const __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), _mm_cmpeq_epi8(b2, one));
+            const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(hit));
+            if (mask != 0)
+            {
+                return j + LowestSetBit(mask);
+            }
+        }
+        return ScanStartCodeScalar(data, size, j);
+    }
+
+#ifdef __GNUC__
+    __attribute__((target("avx2")))
+#endif
+    size_t ScanStartCodeAvx2(const uint8_t* data, size_t size, size_t from)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i one = _mm256_set1_epi8(1);
+        size_t j = from;
+        for (; j + 34 <= size; j += 32)
+        {
+            const __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + j));
+            const __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + j + 1));
+            const __m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + j + 2));
+            const __m256i hit = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)), _mm256_cmpeq_epi8(b2, one));
+            const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+            if (mask != 0)
+            {
+                return j + LowestSetBit(mask);
+            }
+        }
+        return ScanStartCodeSse2(data, size, j);
+    }
+
+    bool CpuHasAvx2()
+    {
+#ifdef _MSC_VER
+        int info[4] = {};
+        __cpuid(info, 0);
+        if (info[0] < 7)
+        {
+            return false;
+        }
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        {
+            return false;
+        }
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+
+    using StartCodeScanner = size_t (*)(const uint8_t*, size_t, size_t);
+
+    StartCodeScanner SelectStartCodeScanner()
+    {
+#if defined(_M_X64) || defined(__x86_64__)
+        return CpuHasAvx2() ? ScanStartCodeAvx2 : ScanStartCodeSse2;
+#else
+        return ScanStartCodeScalar;
+#endif
+    }
+
+    // Returns the first start code (3- or 4-byte form) at or after from, or size. A 4-byte
+    // code is reported at its leading zero so that zero isn't left on the previous NAL.
+    size_t FindStartCode(const uint8_t* data, size_t size, size_t from)
+    {
+        static const StartCodeScanner scan = SelectStartCodeScanner();
+        const size_t pos = scan(data, size, from);
+        if (pos >= size)
+        {
+            return size;
+        }
+        if (pos > from && data[pos - 1] == 0)
+        {
+            return pos - 1;
+        }
+        // A 3-byte code must leave at least one NAL byte after it.
+        return pos + 3 < size ? pos : size;
+    }
+
+    // Splits an Annex B buffer into NAL units (start codes excluded), replacing units.
+    void ParseAnnexB(const uint8_t* data, size_t size, bool hevc, std::vector<NalUnit>& units)
+    {
+        units.clear();
+        size_t start = FindStartCode(data, size, 0);
+        while (start < size)
+        {
+            size_t scSize = (data[start + 2] == 1) ? 3 : 4;
+            size_t nalStart = start + scSize;
+            size_t next = FindStartCode(data, size, nalStart);
+            if (next > nalStart)
+            {
+                uint8_t type = 0;
+                if (hevc)
+                {
+                    type = (data[nalStart] >> 1) & 0x3F;
+                }
+                else
+                {
+                    type = data[nalStart] & 0x1F;
+                }
+                units.push_back({ data + nalStart, next - nalStart, type });
+            }
+            start = next;
+        }
+    }
+
+    std::vector<uint8_t> BuildAvcC(const std::vector<uint8_t>& sps, const std::vector<uint8_t>& pps)
+    {
+        if (sps.size() < 4)
+        {
+            return {};
+        }
+        std::vector<uint8_t> avcc;
+        avcc.push_back(1);
+        avcc.push_back(sps[1]);
+        avcc.push_back(sps[2]);
+        avcc.push_back(sps[3]);
+        avcc.push_back(0xFF); // lengthSizeMinusOne=3
+        avcc.push_back(0xE1); // numOfSPS=1
+        avcc.push_back(static_cast<uint8_t>((sps.size() >> 8) & 0xFF));
+        avcc.push_back(static_cast<uint8_t>(sps.size() & 0xFF));
+        avcc.insert(avcc.end(), sps.begin(), sps.end());
+        avcc.push_back(1); // numOfPPS=1
+        avcc.push_back(static_cast<uint8_t>((pps.size() >> 8) & 0xFF));
+        avcc.push_back(static_cast<uint8_t>(pps.size() & 0xFF));
+        avcc.insert(avcc.end(), pps.begin(), pps.end());
+        return avcc;
+    }
+
+    std::vector<uint8_t> BuildHvcC(const std::vector<uint8_t>& vps, const std::vector<uint8_t>& sps, const std::vector<uint8_t>& pps)
+    {
+        // Minimal hvcC. Many fields are set to defaults; VPS/SPS/PPS are included.
+        std::vector<uint8_t> hvcc;
+        hvcc.reserve(64 + vps.size() + sps.size() + pps.size());
+
+        hvcc.push_back(1); // configurationVersion
+        hvcc.push_back(1); // general_profile_space(0), tier(0), profile_idc(1=Main)
+        hvcc.insert(hvcc.end(), 4, 0); // general_profile_compatibility_flags
+        hvcc.insert(hvcc.end(), 6, 0); // general_constraint_indicator_flags
+        hvcc.push_back(120); // general_level_idc (4.0)
+        hvcc.push_back(0xF0); // min_spatial_segmentation_idc (upper 4 bits set)
+        hvcc.push_back(0);
+        hvcc.push_back(0xFC); // parallelismType (reserved)
+        hvcc.push_back(0xFC); // chromaFormat (reserved)
+        hvcc.push_back(0xF8); // bitDepthLumaMinus8 (reserved)
+        hvcc.push_back(0xF8); // bitDepthChromaMinus8 (reserved)
+        hvcc.push_back(0); // avgFrameRate
+        hvcc.push_back(0);
+        hvcc.push_back(0x03); // constantFrameRate=0, numTemporalLayers=0, temporalIdNested=0, lengthSizeMinusOne=3
+
+        uint8_t numArrays = 0;
+        if (!vps.empty()) numArrays++;
+        if (!sps.empty()) numArrays++;
+        if (!pps.empty()) numArrays++;
+        hvcc.push_back(numArrays);
+
+        auto appendArray = [&](uint8_t nalType, const std::vector<uint8_t>& data)
+        {
+            hvcc.push_back(0x80 | nalType); // array_completeness=1
+            hvcc.push_back(0); // numNalus (hi)
+            hvcc.push_back(1); // numNalus (lo)
+            hvcc.push_back(static_cast<uint8_t>((data.size() >> 8) & 0xFF));
+            hvcc.push_back(static_cast<uint8_t>(data.size() & 0xFF));
+            hvcc.insert(hvcc.end(), data.begin(), data.end());
+        };
+
+        if (!vps.empty()) appendArray(32, vps);
+        if (!sps.empty()) appendArray(33, sps);
+        if (!pps.empty()) appendArray(34, pps);
+
+        return hvcc;
+    }
+
+    bool IsParameterSet(const NalUnit& unit, bool hevc)
+    {
+        return hevc ? (unit.type == 32 || unit.type == 33 || unit.type == 34) : (unit.type == 7 || unit.type == 8);
+    }
+
+    // The first VPS/SPS/PPS of an access unit, pointing into the parsed bitstream.
+    struct ParameterSets
+    {
+        const NalUnit* vps = nullptr;
+        const NalUnit* sps = nullptr;
+        const NalUnit* pps = nullptr;
+
+        bool Empty() const
+        {
+            return !vps && !sps && !pps;
+        }
+
+        // FNV-1a over the NAL payloads, so an unchanged set costs one pass over a few dozen
+        // bytes instead of rebuilding the codec header.
+        uint64_t Hash() const
+        {
+            uint64_t hash = 14695981039346656037ull;
+            for (const NalUnit* unit : { vps, sps, pps })
+            {
+                const uint32_t size = unit ? static_cast<uint32_t>(unit->size) : 0;
+                for (int shift = 0; shift < 32; shift += 8)
+                {
+                    hash = (hash ^ ((size >> shift) & 0xFF)) * 1099511628211ull;
+                }
+                for (uint32_t i = 0; i < size; ++i)
+                {
+                    hash = (hash ^ unit->data[i]) * 1099511628211ull;
+                }
+            }
+            return hash != 0 ? hash : 1;
+        }
+    };
+
+    ParameterSets FindParameterSets(const std::vector<NalUnit>& units, bool hevc)
+    {
+        ParameterSets sets;
+        for (const auto& unit : units)
+        {
+            const NalUnit** target = nullptr;
+            if (hevc)
+            {
+                target = unit.type == 32 ? &sets.vps : unit.type == 33 ? &sets.sps : unit.type == 34 ? &sets.pps : nullptr;
+            }
+            else
+            {
+                target = unit.type == 7 ? &sets.sps : unit.type == 8 ? &sets.pps : nullptr;
+            }
+            if (target && !*target)
+            {
+                *target = &unit;
+            }
+        }
+        return sets;
+    }
+
+    std::vector<uint8_t> BuildCodecPrivate(const ParameterSets& sets, bool hevc)
+    {
+        auto copy = [](const NalUnit* unit)
+        {
+            return unit ? std::vector<uint8_t>(unit->data, unit->data + unit->size) : std::vector<uint8_t>();
+        };
+        return hevc ? BuildHvcC(copy(sets.vps), copy(sets.sps), copy(sets.pps)) : BuildAvcC(copy(sets.sps), copy(sets.pps));
+    }
+
+    // Writes the access unit parsed into units as 4-byte length-prefixed NALs, leaving out
+    // the parameter sets (they are carried in avcC/hvcC) unless keepParameterSets is set.
+    // Each payload byte is copied once; when every start code is already 4 bytes and nothing
+    // is left out, the frame is copied whole and the start codes are overwritten with the lengths.
+    void ConvertToLengthPrefixed(const uint8_t* data, size_t size, const std::vector<NalUnit>& units, bool hevc,
+        bool keepParameterSets, std::vector<uint8_t>& out)
+    {
+        size_t total = 0;
+        bool inPlace = true;
+        for (const auto& unit : units)
+        {
+            if (!keepParameterSets && IsParameterSet(unit, hevc))
+            {
+                inPlace = false;
+                continue;
+            }
+            inPlace = inPlace && unit.data == data + total + 4;
+            total += 4 + unit.size;
+        }
+
+        out.clear();
+        if (inPlace && total == size)
+        {
+            out.assign(data, data + size);
+            uint8_t* prefix = out.data();
+            for (const auto& unit : units)
+            {
+                StoreU32BE(prefix, static_cast<uint32_t>(unit.size));
+                prefix += 4 + unit.size;
+            }
+            return;
+        }
+
+        out.reserve(total);
+        for (const auto& unit : units)
+        {
+            if (!keepParameterSets && IsParameterSet(unit, hevc))
+            {
+                continue;
+            }
+            uint8_t prefix[4];
+            StoreU32BE(prefix, static_cast<uint32_t>(unit.size));
+            out.insert(out.end(), prefix, prefix + 4);
+            out.insert(out.end(), unit.data, unit.data + unit.size);
+        }
+    }
+
+    std::vector<uint8_t> CodecPrivateFromAnnexB(const uint8_t* data, size_t size, bool hevc)
+    {
+        std::vector<NalUnit> units;
+        ParseAnnexB(data, size, hevc, units);
+        return BuildCodecPrivate(FindParameterSets(units, hevc), hevc);
+    }
+
+    // Reads exp-Golomb fields from a NAL payload, skipping emulation prevention bytes.
+    // Reading past the end yields zero bits and sets overrun.
+    struct RbspReader
+    {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        size_t position = 0;
+        int bit = 8;
+        uint8_t current = 0;
+        int zeros = 0;
+        bool overrun = false;
+
+        RbspReader(const uint8_t* bytes, size_t length) : data(bytes), size(length) {}
+
+        bool Byte(uint8_t* value)
+        {
+            if (position < size && zeros >= 2 && data[position] == 3)
+            {
+                ++position;
+                zeros = 0;
+            }
+            if (position >= size)
+            {
+                overrun = true;
+                return false;
+            }
+            *value = data[position++];
+            zeros = *value == 0 ? zeros + 1 : 0;
+            return true;
+        }
+
+        uint32_t Bit()
+        {
+            if (bit == 8)
+            {
+                if (!Byte(&current))
+                {
+                    return 0;
+                }
+                bit = 0;
+            }
+            return (current >> (7 - bit++)) & 1;
+        }
+
+        uint32_t Ue()
+        {
+            int leading = 0;
+            while (Bit() == 0)
+            {
+                if (overrun || ++leading > 31)
+                {
+                    overrun = true;
+                    return 0;
+                }
+            }
+            uint32_t value = 0;
+            for (int i = 0; i < leading; ++i)
+            {
+                value = (value << 1) | Bit();
+            }
+            return (1u << leading) - 1 + value;
+        }
+
+        int32_t Se()
+        {
+            const uint32_t value = Ue();
+            return (value & 1) ? static_cast<int32_t>((value + 1) / 2) : -static_cast<int32_t>(value / 2);
+        }
+    };
+
+    // Finds a recovery point SEI message (payloadType 6) in an H.264 SEI or HEVC prefix SEI
+    // NAL and returns its recovery_frame_cnt / recovery_poc_cnt.
+    bool FindRecoveryPoint(const NalUnit& unit, bool hevc, int32_t* count)
+    {
+        const size_t header = hevc ? 2 : 1;
+        if (unit.size <= header)
+        {
+            return false;
+        }
+        RbspReader reader(unit.data + header, unit.size - header);
+        uint8_t byte = 0;
+        while (reader.Byte(&byte) && byte != 0x80)
+        {
+            uint32_t payloadType = byte;
+            while (byte == 0xFF && reader.Byte(&byte))
+            {
+                payloadType += byte;
+            }
+            uint32_t payloadSize = 0;
+            do
+            {
+                if (!reader.Byte(&byte))
+                {
+                    return false;
+                }
+                payloadSize += byte;
+            } while (byte == 0xFF);
+
+            if (payloadType == 6)
+            {
+                *count = hevc ? reader.Se() : static_cast<int32_t>(reader.Ue());
+                return !reader.overrun;
+            }
+            for (uint32_t i = 0; i < payloadSize; ++i)
+            {
+                if (!reader.Byte(&byte))
+                {
+                    return false;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Works out how playback can start at an access unit. IDRs are sync samples; HEVC CRA/BLA
+    // pictures are too, but their RASL leading pictures are not decodable from there, so they
+    // also go in the 'rap ' group. Open-GOP H.264 I-frames only announce themselves through a
+    // recovery point SEI.
+    RandomAccess ClassifyRandomAccess(const std::vector<NalUnit>& units, bool hevc, int16_t* rollDistance)
+    {
+        RandomAccess kind = RandomAccess::None;
+        int32_t recovery = -1;
+        bool intra = false;
+        for (const auto& unit : units)
+        {
+            if (hevc ? (unit.type == 19 || unit.type == 20) : unit.type == 5)
+            {
+                return RandomAccess::Sync;
+            }
+            if (hevc && unit.type >= 16 && unit.type <= 21)
+            {
+                kind = RandomAccess::OpenSync;
+            }
+            else if (!hevc && unit.type == 1 && unit.size > 1)
+            {
+                // slice_type of the first slice: first_mb_in_slice, then slice_type (2 or 7 = I).
+                RbspReader reader(unit.data + 1, unit.size - 1);
+                reader.Ue();
+                intra = intra || reader.Ue() % 5 == 2;
+            }
+            else if (unit.type == (hevc ? 39 : 6) && recovery < 0)
+            {
+                int32_t count = 0;
+                if (FindRecoveryPoint(unit, hevc, &count) && count >= 0)
+                {
+                    recovery = count;
+                }
+            }
+        }
+        if (kind != RandomAccess::None || recovery < 0)
+        {
+            return kind;
+        }
+        if (recovery > 0)
+        {
+            *rollDistance = static_cast<int16_t>(std::min<int32_t>(recovery, INT16_MAX));
+            return RandomAccess::Roll;
+        }
+        // A zero recovery distance on an HEVC non-IRAP picture or an H.264 I-frame: decodable
+        // from here once the leading pictures are dropped.
+        return hevc || intra ? RandomAccess::Recovery : RandomAccess::None;
+    }
+
+    void ClearSampleTables(MuxerState* state)
+    {
+        state->sampleSizes.clear();
+        state->sampleOffsets.clear();
+        state->syncSamples.clear();
+        state->audioSampleSizes.clear();
+        state->audioSampleOffsets.clear();
+        state->audioSampleDurations.clear();
+        state->audioSampleTotal = 0;
+        state->descriptionChanges.clear();
+        state->compositionOffsets.clear();
+        state->randomAccessPoints.clear();
+    }
+
+    // Reopens the output of an interrupted render (found through its journal) and cuts it
+    // back to the last keyframe whose GOP can be continued, so encoding restarts with an IDR
+    // at state->resumeFrame. *resumed stays false when there is nothing to resume; the caller
+    // then starts a new file. Returns false with lastError set when the partial output can't
+    // be continued with the current settings.
+    bool ResumeMp4Writer(MuxerState* state, bool hevc, const std::vector<uint8_t>& sessionCodecPrivate, bool* resumed)
+    {
+        *resumed = false;
+        auto saved = std::make_unique<MuxerState>();
+        saved->outputPath = state->outputPath;
+        std::vector<RecoveredSample> journaled;
+        if (state->fragmented || !ReadJournal(saved.get(), journaled))
+        {
+            LogLine(state, L"resume: no journal, starting a new file");
+            return true;
+        }
+
+        if (saved->isHevc != hevc || saved->faststart != state->faststart || saved->width != state->width
+            || saved->height != state->height || saved->fps != state->fps)
+        {
+            SetError(state, L"Interrupted output was encoded with different settings.");
+            return false;
+        }
+        if (sessionCodecPrivate.empty())
+        {
+            LogLine(state, L"resume: sequence params unavailable, parameter sets not checked");
+        }
+        else if (sessionCodecPrivate != saved->codecPrivate
+            && std::find(saved->extraCodecPrivate.begin(), saved->extraCodecPrivate.end(), sessionCodecPrivate) == saved->extraCodecPrivate.end())
+        {
+            SetError(state, L"Interrupted output was encoded with different settings.");
+            return false;
+        }
+
+        if (!state->file.Open(state->outputPath, FileBackendKind::Standard, true))
+        {
+            LogLine(state, L"resume: output missing, starting a new file");
+            return true;
+        }
+        uint64_t fileLength = state->file.size;
+        uint8_t type[4] = {};
+        if (FindTopLevelBox(state->file, fileLength, "moov") != 0
+            || !state->file.Seek(saved->mdatHeaderOffset + 4) || !state->file.Read(type, 4) || memcmp(type, "mdat", 4) != 0)
+        {
+            // Finished (or foreign) file: a render to the same path simply replaces it.
+            state->file.Close();
+            LogLine(state, L"resume: output is not an interrupted render, starting a new file");
+            return true;
+        }
+
+        state->isHevc = hevc;
+        state->mdatHeaderOffset = saved->mdatHeaderOffset;
+        state->mdatLargeSizeOffset = saved->mdatLargeSizeOffset;
+        state->mdatDataOffset = saved->mdatDataOffset;
+        const uint64_t dataEnd = RestoreSampleTables(state, journaled, fileLength);
+
+        // Cut at the last keyframe, keeping the tail GOP only if it is already complete.
+        // Audio is kept up to the restart time, and everything kept has to end before the
+        // first dropped sample, so a chunk written out of order can push the cut back a GOP.
+        const size_t videoCount = state->sampleSizes.size();
+        const size_t audioCount = state->audioSampleSizes.size();
+        std::vector<uint64_t> videoEnd(videoCount + 1, 0);
+        for (size_t i = 0; i < videoCount; ++i)
+        {
+            videoEnd[i + 1] = std::max(videoEnd[i], state->sampleOffsets[i] + state->sampleSizes[i]);
+        }
+        std::vector<uint64_t> audioEnd(audioCount + 1, 0);
+        std::vector<uint64_t> audioTime(audioCount + 1, 0);
+        for (size_t i = 0; i < audioCount; ++i)
+        {
+            audioEnd[i + 1] = std::max(audioEnd[i], state->audioSampleOffsets[i] + state->audioSampleSizes[i]);
+            audioTime[i + 1] = audioTime[i] + state->audioSampleDurations[i];
+        }
+
+        const uint64_t frameDuration = VideoFrameDuration(state);
+        const uint64_t audioRate = saved->audioSampleRate > 0 ? static_cast<uint64_t>(saved->audioSampleRate) : 48000;
+        // Encoding restarts with an IDR, so the cut has to be one too: frames decoded after a
+        // CRA may be shown before it. A complete tail GOP (of either kind) is kept whole.
+        std::vector<uint32_t> restartPoints;
+        size_t point = 0;
+        for (uint32_t sync : state->syncSamples)
+        {
+            while (point < state->randomAccessPoints.size() && state->randomAccessPoints[point].sample < sync - 1)
+            {
+                ++point;
+            }
+            const bool open = point < state->randomAccessPoints.size() && state->randomAccessPoints[point].sample == sync - 1;
+            if (!open)
+            {
+                restartPoints.push_back(sync);
+            }
+        }
+        size_t keyIndex = restartPoints.size();
+        size_t keep = 0;
+        const uint64_t gop = state->gopLength;
+        if (!state->syncSamples.empty() && gop > 0 && videoCount - (state->syncSamples.back() - 1) >= gop)
+        {
+            keep = videoCount;
+        }
+        else if (keyIndex > 0)
+        {
+            keep = restartPoints[keyIndex - 1] - 1;
+        }
+        size_t audioKeep = audioCount;
+        uint64_t cut = dataEnd;
+        while (keep > 0)
+        {
+            const uint64_t restartTime = keep * frameDuration;
+            while (audioKeep > 0 && audioTime[audioKeep] * 90000 / audioRate > restartTime)
+            {
+                --audioKeep;
+            }
+            cut = dataEnd;
+            if (keep < videoCount)
+            {
+                cut = std::min(cut, state->sampleOffsets[keep]);
+            }
+            if (audioKeep < audioCount)
+            {
+                cut = std::min(cut, state->audioSampleOffsets[audioKeep]);
+            }
+            while (audioKeep > 0 && audioEnd[audioKeep] > cut)
+            {
+                --audioKeep;
+                cut = std::min(cut, state->audioSampleOffsets[audioKeep]);
+            }
+            if (videoEnd[keep] <= cut)
+            {
+                break;
+            }
+            while (keyIndex > 0 && restartPoints[keyIndex - 1] - 1 >= keep)
+            {
+                --keyIndex;
+            }
+            keep = keyIndex > 0 ? restartPoints[keyIndex - 1] - 1 : 0;
+        }
+
+        if (keep == 0)
+        {
+            state->file.Close();
+            ClearSampleTables(state);
+            LogLine(state, L"resume: no complete GOP, starting a new file");
+            return true;
+        }
+
+        state->sampleSizes.resize(keep);
+        state->sampleOffsets.resize(keep);
+        state->compositionOffsets.resize(keep);
+        while (!state->descriptionChanges.empty() && state->descriptionChanges.back().firstSample >= keep)
+        {
+            state->descriptionChanges.pop_back();
+        }
+        while (!state->syncSamples.empty() && state->syncSamples.back() > keep)
+        {
+            state->syncSamples.pop_back();
+        }
+        while (!state->randomAccessPoints.empty() && state->randomAccessPoints.back().sample >= keep)
+        {
+            state->randomAccessPoints.pop_back();
+        }
+        state->audioSampleSizes.resize(audioKeep);
+        state->audioSampleOffsets.resize(audioKeep);
+        state->audioSampleDurations.resize(audioKeep);
+        state->audioSampleTotal = audioTime[audioKeep];
+
+        // Trim for real: a later repair scans past the journal and must not find the old tail.
+        state->file.Truncate(cut);
+        if (!state->file.Close() || !OpenOutputFile(state, true) || state->file.size != cut || !state->file.Seek(cut))
+        {
+            state->file.Close();
+            SetError(state, L"Failed to truncate interrupted output.");
+            return false;
+        }
+        const uint64_t expectedSize = EstimateOutputSize(state);
+        if (expectedSize > cut)
+        {
+            state->file.Reserve(expectedSize);
+        }
+
+        state->codecPrivate = saved->codecPrivate;
+        state->extraCodecPrivate = saved->extraCodecPrivate;
+        if (state->faststart)
+        {
+            state->moovReserveOffset = FindTopLevelBox(state->file, cut, "free");
+            state->moovReserveSize = state->moovReserveOffset > 0 ? state->mdatHeaderOffset - state->moovReserveOffset : 0;
+            state->file.Seek(cut);
+        }
+        state->audioSampleRate = saved->audioSampleRate;
+        state->audioChannels = saved->audioChannels;
+        state->audioSpecificConfig = saved->audioSpecificConfig;
+        state->frameIndex = keep;
+        state->outputFrames = keep;
+        state->interleaveVideoTime = keep * frameDuration;
+        state->interleaveAudioSamples = state->audioSampleTotal;
+        state->resumeFrame = keep;
+        state->resumeAudioPending = true;
+
+        // Start the journal over with only what was kept, in file order.
+        std::vector<RecoveredSample> kept;
+        kept.reserve(keep + audioKeep);
+        size_t sync = 0;
+        size_t change = 0;
+        size_t access = 0;
+        uint32_t description = 1;
+        for (size_t i = 0; i < keep; ++i)
+        {
+            if (change < state->descriptionChanges.size() && state->descriptionChanges[change].firstSample == i)
+            {
+                description = state->descriptionChanges[change++].description;
+            }
+            RecoveredSample sample;
+            sample.offset = state->sampleOffsets[i];
+            sample.size = state->sampleSizes[i];
+            sample.keyframe = sync < state->syncSamples.size() && state->syncSamples[sync] == i + 1;
+            sync += sample.keyframe ? 1 : 0;
+            sample.randomAccess = sample.keyframe ? RandomAccess::Sync : RandomAccess::None;
+            if (access < state->randomAccessPoints.size() && state->randomAccessPoints[access].sample == i)
+            {
+                sample.randomAccess = state->randomAccessPoints[access].kind;
+                sample.rollDistance = state->randomAccessPoints[access++].rollDistance;
+            }
+            sample.description = description;
+            sample.compositionOffset = state->compositionOffsets[i];
+            kept.push_back(sample);
+        }
+        for (size_t i = 0; i < audioKeep; ++i)
+        {
+            RecoveredSample sample;
+            sample.offset = state->audioSampleOffsets[i];
+            sample.size = state->audioSampleSizes[i];
+            sample.duration = state->audioSampleDurations[i];
+            sample.isAudio = true;
+            kept.push_back(sample);
+        }
+        std::stable_sort(kept.begin(), kept.end(), [](const RecoveredSample& a, const RecoveredSample& b) { return a.offset < b.offset; });
+        OpenJournal(state);
+        for (const auto& sample : kept)
+        {
+            JournalSample(state, sample);
+        }
+        if (!FlushJournal(state))
+        {
+            return false;
+        }
+
+        state->writerInitialized = true;
+        *resumed = true;
+        LogLine(state, L"resume frame=" + std::to_wstring(keep) + L" audio=" + std::to_wstring(audioKeep) + L" cut=" + std::to_wstring(cut));
+        return true;
+    }
+
+    // Called when an access unit carries parameter sets other than the last ones seen. Picks
+    // the sample description matching them, adding an stsd entry for a real mid-stream change.
+    // fMP4 writes its moov up front, so there the changed sets stay in-band in the samples.
+    bool UpdateSampleDescription(MuxerState* state, const ParameterSets& sets, bool hevc)
+    {
+        std::vector<uint8_t> codecPrivate = BuildCodecPrivate(sets, hevc);
+        if (codecPrivate.empty())
+        {
+            return true;
+        }
+        const uint64_t hash = sets.Hash();
+        if (!state->writerInitialized)
+        {
+            if (!InitializeMp4Writer(state, hevc, codecPrivate))
+            {
+                return false;
+            }
+        }
+        else if (state->codecPrivate.empty())
+        {
+            state->codecPrivate = codecPrivate;
+        }
+        state->parameterSetHash = hash;
+
+        auto& hashes = state->descriptionHashes;
+        const size_t count = 1 + state->extraCodecPrivate.size();
+        hashes.resize(count, 0);
+        size_t found = count;
+        for (size_t i = 0; i < count && found == count; ++i)
+        {
+            if (hashes[i] == 0 && (i == 0 ? state->codecPrivate : state->extraCodecPrivate[i - 1]) == codecPrivate)
+            {
+                hashes[i] = hash;
+            }
+            found = hashes[i] == hash ? i : count;
+        }
+
+        if (state->fragmented)
+        {
+            state->inbandParameterSets = found != 0;
+            if (state->inbandParameterSets)
+            {
+                LogLine(state, L"parameter sets changed, kept in-band");
+            }
+            return true;
+        }
+        if (found == count)
+        {
+            std::lock_guard<std::mutex> fileLock(state->fileMutex);
+            state->extraCodecPrivate.push_back(std::move(codecPrivate));
+            hashes.push_back(hash);
+            LogLine(state, L"parameter sets changed, sample description " + std::to_wstring(found + 1));
+        }
+        state->currentDescription = static_cast<uint32_t>(found + 1);
+        return true;
+    }
+
+    // timeStamp is the frame's inputTimeStamp (its display index) as reported by the lock;
+    // frames arrive in decode order, so with B-frames the two differ.
+    // Converts an encoded access unit and queues it for the writer. With sub-frame readback a
+    // frame arrives in pieces (runs of whole slices): the first carries the parameter sets and
+    // decides the frame's metadata, the last may be empty and only ends the frame.
+    bool ProcessEncodedBitstream(MuxerState* state, const uint8_t* data, size_t size, uint64_t timeStamp,
+        bool firstPiece, bool lastPiece)
+    {
+        if (!state || ((!data || size == 0) && (firstPiece || !lastPiece)))
+        {
+            return true;
+        }
+
+        const bool hevc = state->isHevc;
+        std::vector<NalUnit>& units = state->nalUnits;
+        ParseAnnexB(data, size, hevc, units);
+
+        int16_t rollDistance = 0;
+        RandomAccess randomAccess = RandomAccess::None;
+        if (firstPiece)
+        {
+            randomAccess = ClassifyRandomAccess(units, hevc, &rollDistance);
+            const ParameterSets parameterSets = FindParameterSets(units, hevc);
+            if (!parameterSets.Empty() && parameterSets.Hash() != state->parameterSetHash
+                && !UpdateSampleDescription(state, parameterSets, hevc))
+            {
+                return false;
+            }
+        }
+        if (!state->writerInitialized)
+        {
+            return true;
+        }
+
+        // Length prefixes add at most one byte per NAL over the 3-byte start codes.
+        std::vector<uint8_t> sampleData = state->samplePool.Acquire(size + units.size());
+        ConvertToLengthPrefixed(data, size, units, hevc, state->inbandParameterSets, sampleData);
+        if (sampleData.empty() && (firstPiece || !lastPiece))
+        {
+            state->samplePool.Release(std::move(sampleData));
+            return true;
+        }
+
+        if (!state->writerStarted)
+        {
+            StartWriterThread(state);
+        }
+        if (state->writerError)
+        {
+            return false;
+        }
+        const bool isKeyframe = randomAccess == RandomAccess::Sync || randomAccess == RandomAccess::OpenSync;
+        MuxerState::EncodedSample sample{ std::move(sampleData), isKeyframe, false, 0 };
+        sample.partial = !lastPiece;
+        if (firstPiece)
+        {
+            sample.description = state->currentDescription;
+            sample.randomAccess = randomAccess;
+            sample.rollDistance = rollDistance;
+            const int64_t reorder = static_cast<int64_t>(timeStamp) - static_cast<int64_t>(state->outputFrames++);
+            sample.compositionOffset = static_cast<int32_t>(reorder * VideoFrameDuration(state));
+        }
+        return QueueSample(state, std::move(sample));
+    }
+
+    void BeginSegments(MuxerState* state, uint32_t segmentFrames)
+    {
+        std::lock_guard<std::mutex> lock(state->segmentMutex);
+        state->segmentFrames = segmentFrames;
+        // A resumed render continues inside the segment its restart frame falls in.
+        state->segmentCurrent = segmentFrames > 0 ? state->frameIndex / segmentFrames : 0;
+        state->segmentCurrentFrames = segmentFrames > 0 ? static_cast<uint32_t>(state->frameIndex % segmentFrames) : 0;
+        state->segmentPending.clear();
+        state->segmentBufferedBytes = 0;
+        state->segmentBufferedPeak = 0;
+        state->segmentsStitched = 0;
+        state->segmentWaits = 0;
+    }
+
+    // Hands a buffered segment's pieces on in arrival order (per segment that is decode order,
+    // a single session produced them) and returns their buffers to the pool.
+    bool ReplaySegment(MuxerState* state, MuxerState::PendingSegment& segment)
+    {
+        bool ok = true;
+        for (MuxerState::SegmentPiece& piece : segment.pieces)
+        {
+            ok = ok && ProcessEncodedBitstream(state, piece.data.data(), piece.data.size(), piece.timeStamp,
+                piece.firstPiece, piece.lastPiece);
+            state->segmentBufferedBytes -= piece.data.size();
+            state->samplePool.Release(std::move(piece.data));
+        }
+        segment.pieces.clear();
+        return ok;
+    }
+
+    // The current segment is complete: moves on through every buffered segment that is
+    // complete too. The first incomplete one becomes current with what it has so far.
+    bool AdvanceSegments(MuxerState* state)
+    {
+        while (state->segmentCurrentFrames >= state->segmentFrames)
+        {
+            ++state->segmentCurrent;
+            ++state->segmentsStitched;
+            state->segmentCurrentFrames = 0;
+            auto it = state->segmentPending.find(state->segmentCurrent);
+            if (it == state->segmentPending.end())
+            {
+                break;
+            }
+            state->segmentCurrentFrames = it->second.frames;
+            const bool ok = ReplaySegment(state, it->second);
+            state->segmentPending.erase(it);
+            // Sessions held back by the budget: the buffer shrank, or their segment is current.
+            state->segmentCv.notify_all();
+            if (!ok)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Blocks the session delivering a later segment while the stitcher's copies plus the
+    // writer's queue would exceed the budget with this piece. Only sessions ahead of the
+    // current segment wait, and every frame of the segments before theirs has already been
+    // submitted, so the current one still completes and frees them. A piece is let through
+    // when nothing is buffered, however large it is. Caller holds lock on segmentMutex.
+    bool WaitForSegmentBudget(MuxerState* state, std::unique_lock<std::mutex>& lock, uint64_t segment, uint64_t size)
+    {
+        auto over = [state, segment, size]()
+        {
+            return segment > state->segmentCurrent && state->segmentBufferedBytes > 0
+                && state->segmentBufferedBytes + state->queuedBytes.load() + size > state->queueBudget;
+        };
+        if (state->queueBudget == 0 || !over())
+        {
+            return true;
+        }
+
+        ++state->segmentWaits;
+        const auto start = std::chrono::steady_clock::now();
+        // AdvanceSegments notifies; the timeout picks up bytes the writer frees meanwhile.
+        while (!state->writerError && over())
+        {
+            state->segmentCv.wait_for(lock, std::chrono::milliseconds(5));
+        }
+        const auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        state->throttleMicroseconds.fetch_add(static_cast<uint64_t>(waited.count()));
+        return !state->writerError;
+    }
+
+    // Each segment is a closed run of frames from one session starting with an IDR, so the
+    // segments joined in order are one valid stream: no re-encode, and the sample tables,
+    // ctts and sync samples come out as if a single session had produced it.
+    bool StitchSegmentBitstream(MuxerState* state, const uint8_t* data, size_t size, uint64_t timeStamp,
+        bool firstPiece, bool lastPiece)
+    {
+        if (!state || ((!data || size == 0) && (firstPiece || !lastPiece)))
+        {
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(state->segmentMutex);
+        const uint64_t segment = timeStamp / state->segmentFrames;
+        if (!WaitForSegmentBudget(state, lock, segment, size))
+        {
+            return false;
+        }
+        if (segment < state->segmentCurrent)
+        {
+            SetError(state, L"Encoded frame arrived after its segment was complete.");
+            return false;
+        }
+        if (segment == state->segmentCurrent)
+        {
+            if (!ProcessEncodedBitstream(state, data, size, timeStamp, firstPiece, lastPiece))
+            {
+                return false;
+            }
+            state->segmentCurrentFrames += lastPiece ? 1 : 0;
+            return AdvanceSegments(state);
+        }
+
+        MuxerState::SegmentPiece piece;
+        piece.data = state->samplePool.Acquire(size);
+        if (size > 0)
+        {
+            piece.data.insert(piece.data.end(), data, data + size);
+        }
+        piece.timeStamp = timeStamp;
+        piece.firstPiece = firstPiece;
+        piece.lastPiece = lastPiece;
+        MuxerState::PendingSegment& pending = state->segmentPending[segment];
+        pending.pieces.push_back(std::move(piece));
+        pending.frames += lastPiece ? 1 : 0;
+        state->segmentBufferedBytes += size;
+        state->segmentBufferedPeak = std::max(state->segmentBufferedPeak, state->segmentBufferedBytes);
+        return true;
+    }
+
+    bool FinishSegments(MuxerState* state)
+    {
+        if (!state || state->segmentFrames == 0)
+        {
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lock(state->segmentMutex);
+        // Complete segments have all been handed on and the last, shorter one is current, so
+        // anything still buffered means a session lost frames: the current segment is short or
+        // a segment between it and the buffered ones never arrived. Joining across the gap would
+        // drop frames from the middle of the output, so the render fails instead.
+        bool ok = true;
+        for (auto& entry : state->segmentPending)
+        {
+            if (ok)
+            {
+                LogLine(state, L"segment " + std::to_wstring(state->segmentCurrent) + L" incomplete ("
+                    + std::to_wstring(state->segmentCurrentFrames) + L" of " + std::to_wstring(state->segmentFrames) + L" frames)");
+                SetError(state, L"An encoder session lost frames of its segment.");
+                ok = false;
+            }
+            LogLine(state, L"segment " + std::to_wstring(entry.first) + L" dropped ("
+                + std::to_wstring(entry.second.frames) + L" frames)");
+            for (MuxerState::SegmentPiece& piece : entry.second.pieces)
+            {
+                state->segmentBufferedBytes -= piece.data.size();
+                state->samplePool.Release(std::move(piece.data));
+            }
+        }
+        state->segmentPending.clear();
+        if (state->segmentCurrentFrames > 0)
+        {
+            ++state->segmentsStitched;
+        }
+        LogLine(state, L"segments stitched=" + std::to_wstring(state->segmentsStitched)
+            + L" frames=" + std::to_wstring(state->segmentFrames)
+            + L" buffered peak=" + std::to_wstring(state->segmentBufferedPeak)
+            + L" budget waits=" + std::to_wstring(state->segmentWaits));
+        return ok;
+    }
+
+    void StageAudioPcm(MuxerState* state, const float* samples, size_t sampleCount)
+    {
+        // Drop consumed frames before growing the buffer again.
+        if (state->audioPcmRead > 8192)
+        {
+            state->audioPcmBuffer.erase(state->audioPcmBuffer.begin(), state->audioPcmBuffer.begin() + static_cast<long long>(state->audioPcmRead));
+            state->audioPcmRead = 0;
+        }
+
+        if (state->resumeAudioPending)
+        {
+            // Silence from the end of the kept audio up to the restart frame.
+            const uint64_t restartSamples = state->resumeFrame * VideoFrameDuration(state) * static_cast<uint64_t>(state->audioSampleRate) / 90000;
+            if (restartSamples > state->audioSampleTotal)
+            {
+                state->audioPcmBuffer.insert(state->audioPcmBuffer.end(), static_cast<size_t>(restartSamples - state->audioSampleTotal) * static_cast<size_t>(state->audioChannels), 0);
+            }
+            state->resumeAudioPending = false;
+        }
+
+        state->audioPcmBuffer.reserve(state->audioPcmBuffer.size() + sampleCount);
+        for (size_t i = 0; i < sampleCount; ++i)
+        {
+            float v = samples[i];
+            v = ClampFloat(v, -1.0f, 1.0f);
+            int16_t s = static_cast<int16_t>(v * 32767.0f);
+            state->audioPcmBuffer.push_back(s);
+        }
+    }
+
+    const int16_t* NextAudioPcmFrame(MuxerState* state)
+    {
+        const size_t frameCount = static_cast<size_t>(kAacFrameSamples) * static_cast<size_t>(state->audioChannels);
+        if (frameCount == 0 || state->audioPcmBuffer.size() - state->audioPcmRead < frameCount)
+        {
+            return nullptr;
+        }
+        const int16_t* frame = state->audioPcmBuffer.data() + state->audioPcmRead;
+        state->audioPcmRead += frameCount;
+        return frame;
+    }
+
+    bool TakeAudioPcmTail(MuxerState* state, std::vector<int16_t>* frame)
+    {
+        if (state->audioPcmBuffer.size() <= state->audioPcmRead)
+        {
+            return false;
+        }
+        const size_t frameCount = static_cast<size_t>(kAacFrameSamples) * static_cast<size_t>(state->audioChannels);
+        const size_t toCopy = std::min<size_t>(state->audioPcmBuffer.size() - state->audioPcmRead, frameCount);
+        frame->assign(frameCount, 0);
+        memcpy(frame->data(), state->audioPcmBuffer.data() + state->audioPcmRead, toCopy * sizeof(int16_t));
+        state->audioPcmRead += toCopy;
+        return true;
+    }
+
+    // Samples are gathered in writeStaging and reach the file in blocks of this size,
+    // so short AAC frames no longer cost one write call each.
+    const size_t kWriteCoalesceBytes = 4 * 1024 * 1024;
+
+    // Caller holds fileMutex.
+    bool FlushWriteStaging(MuxerState* state)
+    {
+        if (state->writeStaging.empty())
+        {
+            return FlushJournal(state);
+        }
+        bool ok = state->file.Write(state->writeStaging.data(), state->writeStaging.size());
+        state->writeStaging.clear();
+        if (!ok)
+        {
+            SetError(state, L"Failed to write sample data.");
+            return false;
+        }
+        return FlushJournal(state);
+    }
+
+    // Enters a sample whose bytes are at offset (in the file or staged) in the sample tables
+    // and the journal. Caller holds fileMutex.
+    void RecordSample(MuxerState* state, const MuxerState::EncodedSample& sample, uint64_t offset, uint32_t size)
+    {
+        if (sample.isAudio)
+        {
+            state->audioSampleOffsets.push_back(offset);
+            state->audioSampleSizes.push_back(size);
+            state->audioSampleDurations.push_back(sample.audioDuration);
+            state->audioSampleTotal += sample.audioDuration;
+        }
+        else
+        {
+            const uint32_t current = state->descriptionChanges.empty() ? 1 : state->descriptionChanges.back().description;
+            if (sample.description != current)
+            {
+                state->descriptionChanges.push_back({ static_cast<uint32_t>(state->sampleSizes.size()), sample.description });
+            }
+            state->sampleOffsets.push_back(offset);
+            state->sampleSizes.push_back(size);
+            state->compositionOffsets.push_back(sample.compositionOffset);
+            if (sample.randomAccess > RandomAccess::Sync)
+            {
+                state->randomAccessPoints.push_back({ static_cast<uint32_t>(state->sampleSizes.size() - 1), sample.randomAccess, sample.rollDistance });
+            }
+            if (sample.keyframe)
+            {
+                state->syncSamples.push_back(static_cast<uint32_t>(state->sampleSizes.size()));
+            }
+        }
+
+        RecoveredSample record;
+        record.offset = offset;
+        record.size = size;
+        record.duration = sample.audioDuration;
+        record.isAudio = sample.isAudio;
+        record.description = sample.description;
+        record.compositionOffset = sample.compositionOffset;
+        record.randomAccess = sample.randomAccess;
+        record.rollDistance = sample.rollDistance;
+        JournalSample(state, record);
+    }
+
+    bool WriteSample(MuxerState* state, const MuxerState::EncodedSample& sample)
+    {
+        std::lock_guard<std::mutex> fileLock(state->fileMutex);
+        if (state->fragmented)
+        {
+            return AppendFragmentSample(state, sample);
+        }
+        const size_t size = sample.data.size();
+        if (state->writeStaging.size() + size > kWriteCoalesceBytes && !FlushWriteStaging(state))
+        {
+            return false;
+        }
+        // The sample's file offset is fixed now even though the bytes may still be staged.
+        uint64_t offset = state->file.Tell() + state->writeStaging.size();
+        if (size >= kWriteCoalesceBytes)
+        {
+            if (!state->file.Write(sample.data.data(), size))
+            {
+                SetError(state, L"Failed to write sample data.");
+                return false;
+            }
+        }
+        else
+        {
+            if (state->writeStaging.capacity() < kWriteCoalesceBytes)
+            {
+                state->writeStaging.reserve(kWriteCoalesceBytes);
+            }
+            state->writeStaging.insert(state->writeStaging.end(), sample.data.begin(), sample.data.end());
+        }
+        RecordSample(state, sample, offset, static_cast<uint32_t>(size));
+        if (size >= kWriteCoalesceBytes
+            || (state->journal.IsOpen() && std::chrono::steady_clock::now() - state->journalFlushTime >= kJournalFlushInterval))
+        {
+            // Staged bytes go out first, so the journal never points past the file.
+            return FlushWriteStaging(state);
+        }
+        return true;
+    }
+
+    // Blocks a producer while the queued bytes plus this sample would exceed the budget. A
+    // sample is always let through when nothing is queued, however large it is.
+    bool WaitForQueueBudget(MuxerState* state, uint64_t size)
+    {
+        auto fits = [state, size]()
+        {
+            const uint64_t queued = state->queuedBytes.load();
+            return queued == 0 || queued + size <= state->queueBudget;
+        };
+        if (fits())
+        {
+            return true;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        {
+            std::unique_lock<std::mutex> lock(state->writerMutex);
+            state->throttledProducers.fetch_add(1);
+            // The writer may be parked with samples held back for interleaving.
+            state->writerCv.notify_one();
+            state->budgetCv.wait(lock, [state, &fits]()
+            {
+                return state->writerError || fits();
+            });
+            state->throttledProducers.fetch_sub(1);
+        }
+        const auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        state->throttleMicroseconds.fetch_add(static_cast<uint64_t>(waited.count()));
+        return !state->writerError;
+    }
+
+    // Writer thread: the sample's bytes are in the file (or staged), so its buffer and its
+    // share of the queue budget are handed back. The buffer goes first, so a producer that
+    // sees the budget freed also finds the buffer pooled.
+    void ReleaseSample(MuxerState* state, MuxerState::EncodedSample& sample)
+    {
+        const uint64_t size = sample.data.size();
+        state->samplePool.Release(std::move(sample.data));
+        state->queuedBytes.fetch_sub(size);
+        if (state->throttledProducers.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(state->writerMutex);
+            state->budgetCv.notify_all();
+        }
+    }
+
+    // A track may emit its next chunk once it holds a full window of samples, or once
+    // the other track has run two windows ahead (or is silent) so a stalled track never
+    // holds the other one back indefinitely.
+    bool InterleaveChunkReady(const std::deque<MuxerState::EncodedSample>& track,
+        const std::deque<MuxerState::EncodedSample>& other, uint64_t window, bool flushing)
+    {
+        if (track.empty())
+        {
+            return false;
+        }
+        if (flushing)
+        {
+            return true;
+        }
+        const uint64_t start = track.front().decodeTime;
+        if (other.empty())
+        {
+            return track.back().decodeTime >= start + 2 * window;
+        }
+        return track.back().decodeTime >= start + window || other.back().decodeTime >= start + 2 * window;
+    }
+
+    bool DrainInterleaver(MuxerState* state, bool flushing)
+    {
+        auto& video = state->interleaveVideo;
+        auto& audio = state->interleaveAudio;
+        const uint64_t window = state->interleaveWindow;
+        while (!video.empty() || !audio.empty())
+        {
+            const bool videoFirst = audio.empty() || (!video.empty() && video.front().decodeTime <= audio.front().decodeTime);
+            auto& track = videoFirst ? video : audio;
+            auto& other = videoFirst ? audio : video;
+            if (!InterleaveChunkReady(track, other, window, flushing))
+            {
+                break;
+            }
+
+            // Written back to back, the samples form one chunk in the sample tables.
+            const uint64_t chunkEnd = track.front().decodeTime + window;
+            do
+            {
+                if (!WriteSample(state, track.front()))
+                {
+                    return false;
+                }
+                ReleaseSample(state, track.front());
+                track.pop_front();
+            } while (!track.empty() && track.front().decodeTime < chunkEnd);
+        }
+        return true;
+    }
+
+    bool InterleaveSample(MuxerState* state, MuxerState::EncodedSample&& sample)
+    {
+        if (state->interleaveWindow == 0)
+        {
+            const bool ok = WriteSample(state, sample);
+            ReleaseSample(state, sample);
+            return ok;
+        }
+
+        if (sample.isAudio)
+        {
+            const uint64_t rate = state->audioSampleRate > 0 ? static_cast<uint64_t>(state->audioSampleRate) : 48000;
+            sample.decodeTime = state->interleaveAudioSamples * 90000 / rate;
+            state->interleaveAudioSamples += sample.audioDuration;
+            state->interleaveAudio.push_back(std::move(sample));
+        }
+        else
+        {
+            sample.decodeTime = state->interleaveVideoTime;
+            state->interleaveVideoTime += VideoFrameDuration(state);
+            state->interleaveVideo.push_back(std::move(sample));
+        }
+        return DrainInterleaver(state, false);
+    }
+
+    // Writer thread: one piece of a frame read back slice by slice. Without interleaving or
+    // fragments the pieces are written as they arrive, so the frame reaches the file while the
+    // encoder is still producing its later slices; the frame enters the tables with its last
+    // piece, and audio arriving in between waits so the frame's bytes stay contiguous.
+    // Otherwise the pieces are joined and the frame is interleaved like any other.
+    bool AcceptSlicePiece(MuxerState* state, MuxerState::EncodedSample&& piece)
+    {
+        MuxerState::EncodedSample& frame = state->sliceFrame;
+        const bool first = !state->sliceFrameOpen;
+        const bool last = !piece.partial;
+        if (state->fragmented || state->interleaveWindow > 0)
+        {
+            if (first)
+            {
+                frame = std::move(piece);
+            }
+            else
+            {
+                // The joined frame is released from the queue budget as a whole.
+                frame.data.insert(frame.data.end(), piece.data.begin(), piece.data.end());
+                state->samplePool.Release(std::move(piece.data));
+            }
+            state->sliceFrameOpen = !last;
+            if (!last)
+            {
+                return true;
+            }
+            frame.partial = false;
+            return InterleaveSample(state, std::move(frame));
+        }
+
+        {
+            std::lock_guard<std::mutex> fileLock(state->fileMutex);
+            if (first)
+            {
+                state->sliceFrameOffset = state->file.Tell() + state->writeStaging.size();
+                state->sliceFrameBytes = 0;
+            }
+            if (!FlushWriteStaging(state))
+            {
+                return false;
+            }
+            if (!piece.data.empty() && !state->file.Write(piece.data.data(), piece.data.size()))
+            {
+                SetError(state, L"Failed to write sample data.");
+                return false;
+            }
+            state->sliceFrameBytes += piece.data.size();
+            if (last)
+            {
+                RecordSample(state, first ? piece : frame, state->sliceFrameOffset, static_cast<uint32_t>(state->sliceFrameBytes));
+                if (!FlushJournal(state))
+                {
+                    return false;
+                }
+            }
+        }
+        ReleaseSample(state, piece);
+        state->sliceFrameOpen = !last;
+        if (!last)
+        {
+            if (first)
+            {
+                frame = std::move(piece);
+            }
+            return true;
+        }
+        while (!state->sliceHeldAudio.empty())
+        {
+            const bool ok = InterleaveSample(state, std::move(state->sliceHeldAudio.front()));
+            state->sliceHeldAudio.pop_front();
+            if (!ok)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Routes a sample popped from the ring: pieces of a sliced frame (and audio that has to
+    // wait for one) take the slice path, everything else goes to the interleaver.
+    bool AcceptSample(MuxerState* state, MuxerState::EncodedSample&& sample)
+    {
+        if (!sample.isAudio && (sample.partial || state->sliceFrameOpen))
+        {
+            return AcceptSlicePiece(state, std::move(sample));
+        }
+        if (sample.data.empty())
+        {
+            return true;
+        }
+        if (sample.isAudio && state->sliceFrameOpen && !state->fragmented && state->interleaveWindow == 0)
+        {
+            state->sliceHeldAudio.push_back(std::move(sample));
+            return true;
+        }
+        return InterleaveSample(state, std::move(sample));
+    }
+
+    // Hands a sample to the writer thread. A full ring or an exhausted queue budget means the
+    // writer is behind, so the producer waits for it; returns false if the writer has failed.
+    bool QueueSample(MuxerState* state, MuxerState::EncodedSample&& sample)
+    {
+        const uint64_t size = sample.data.size();
+        if (state->queueBudget > 0 && !WaitForQueueBudget(state, size))
+        {
+            return false;
+        }
+        const uint64_t depth = state->queuedBytes.fetch_add(size) + size;
+        uint64_t peak = state->queuePeakBytes.load(std::memory_order_relaxed);
+        while (depth > peak && !state->queuePeakBytes.compare_exchange_weak(peak, depth, std::memory_order_relaxed))
+        {
+        }
+        state->queueDepthSum.fetch_add(depth, std::memory_order_relaxed);
+        state->queuePushes.fetch_add(1, std::memory_order_relaxed);
+
+        for (uint32_t attempt = 0; !state->sampleRing.TryPush(sample); ++attempt)
+        {
+            if (state->writerError)
+            {
+                return false;
+            }
+            if (attempt < 64)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        // Pairs with the fence in WaitForSamples: either the writer sees this slot claimed
+        // before it sleeps, or this thread sees writerSleeping. Only the producer that clears
+        // the flag notifies; the writer then drains every claimed slot before sleeping again.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (state->writerSleeping.exchange(false, std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(state->writerMutex);
+            state->writerCv.notify_one();
+        }
+        return true;
+    }
+
+    // Producers are waiting for budget that only the interleaver's held-back samples occupy.
+    bool WriterThrottling(const MuxerState* state)
+    {
+        return state->throttledProducers.load() > 0 && (!state->interleaveVideo.empty() || !state->interleaveAudio.empty());
+    }
+
+    // Parks the writer thread until a sample arrives, a producer is throttled, or a stop is
+    // requested. Returns false once stopping with nothing left to write.
+    bool WaitForSamples(MuxerState* state)
+    {
+        std::unique_lock<std::mutex> lock(state->writerMutex);
+        for (;;)
+        {
+            // Re-armed on every wakeup: a producer that was slow to reach its check may have
+            // cleared the flag (and notified) for samples the writer had already taken.
+            state->writerSleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (state->writerStop || !state->sampleRing.Idle() || WriterThrottling(state))
+            {
+                break;
+            }
+            state->writerCv.wait(lock);
+        }
+        state->writerSleeping.store(false, std::memory_order_relaxed);
+        return !state->sampleRing.Idle() || !state->writerStop;
+    }
+
+    void StartWriterThread(MuxerState* state)
+    {
+        if (!state || state->writerStarted)
+        {
+            return;
+        }
+        LogLine(state, L"writer thread start");
+        state->writerStop = false;
+        state->writerError = false;
+        state->writerStarted = true;
+        state->writerThread = std::thread([state]()
+        {
+            MuxerState::EncodedSample sample;
+            while (!state->writerError)
+            {
+                if (!state->sampleRing.TryPop(sample))
+                {
+                    if (!state->sampleRing.Idle())
+                    {
+                        // A producer is between claiming its slot and publishing it.
+                        std::this_thread::yield();
+                    }
+                    else if (WriterThrottling(state))
+                    {
+                        // Out of budget with nothing more to read: write what the interleaver
+                        // holds even though its chunks are not complete yet.
+                        if (!DrainInterleaver(state, true))
+                        {
+                            state->writerError = true;
+                        }
+                    }
+                    else if (!WaitForSamples(state))
+                    {
+                        break;
+                    }
+                    continue;
+                }
+                if (!AcceptSample(state, std::move(sample)))
+                {
+                    state->writerError = true;
+                }
+            }
+            // Audio held back for a frame whose last slices never came.
+            while (!state->writerError && !state->sliceHeldAudio.empty())
+            {
+                if (!InterleaveSample(state, std::move(state->sliceHeldAudio.front())))
+                {
+                    state->writerError = true;
+                }
+                state->sliceHeldAudio.pop_front();
+            }
+            if (!state->writerError && !DrainInterleaver(state, true))
+            {
+                state->writerError = true;
+            }
+            if (!state->writerError)
+            {
+                std::lock_guard<std::mutex> fileLock(state->fileMutex);
+                if (!FlushWriteStaging(state))
+                {
+                    state->writerError = true;
+                }
+            }
+            {
+                // Producers throttled when the writer failed must not wait forever.
+                std::lock_guard<std::mutex> lock(state->writerMutex);
+                state->budgetCv.notify_all();
+            }
+            const uint64_t pushes = state->queuePushes.load();
+            LogLine(state, L"writer thread exit buffers allocated=" + std::to_wstring(state->samplePool.allocated)
+                + L" reused=" + std::to_wstring(state->samplePool.reused)
+                + L" queue peak=" + std::to_wstring(state->queuePeakBytes.load())
+                + L" avg=" + std::to_wstring(pushes > 0 ? state->queueDepthSum.load() / pushes : 0)
+                + L" throttled ms=" + std::to_wstring(state->throttleMicroseconds.load() / 1000));
+        });
+    }
+
+    void StopWriterThread(MuxerState* state)
+    {
+        if (!state || !state->writerStarted)
+        {
+            return;
+        }
+        LogLine(state, L"writer thread stop request");
+        {
+            std::lock_guard<std::mutex> lock(state->writerMutex);
+            state->writerStop = true;
+        }
+        state->writerCv.notify_all();
+        if (state->writerThread.joinable())
+        {
+            state->writerThread.join();
+        }
+        state->writerStarted = false;
+        LogLine(state, L"writer thread stopped");
+    }
+}
@@ -0,0 +1,690 @@
+#pragma once
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Platform-neutral half of NvencNative: MP4 writing (standard, fragmented and faststart
+// layouts, crash journal, repair and resume), Annex B / NAL processing, the writer thread and
+// its sample queue, audio PCM staging and the debug log. Nothing here touches D3D11, NVENC or
+// Media Foundation, so it also builds as a static library on Linux (CMakeLists.txt); the
+// encoder glue in NvencNative.cpp derives its EncoderState from MuxerState.
+namespace NvencCore
+{
+    enum class FileBackendKind
+    {
+        Standard = 0,   // synchronous buffered writes (WriteFile / pwrite)
+        Queued = 1,     // several writes in flight (overlapped unbuffered / io_uring)
+        Mapped = 2,     // memory-mapped file windows (POSIX only)
+    };
+
+    // Positional file I/O. FileWriter owns the logical position; backends only see offsets.
+    struct FileBackend
+    {
+        virtual ~FileBackend() = default;
+        // Creates (or truncates) the file, or opens it as is when existing is set;
+        // length receives the current size.
+        virtual bool Open(const std::wstring& path, bool existing, uint64_t* length) = 0;
+        virtual bool WriteAt(uint64_t offset, const void* data, size_t size) = 0;
+        virtual bool ReadAt(uint64_t offset, void* data, size_t size) = 0;
+        // Allocates disk space up to size without moving the end of file.
+        virtual bool Reserve(uint64_t /*size*/) { return false; }
+        // Hands every write accepted so far to the OS, so it reaches the file even if the
+        // process dies right after. Backends whose WriteAt returns only then have nothing to do.
+        virtual bool Commit() { return true; }
+        // Flushes everything still pending and trims the file to the logical size.
+        virtual bool Close(uint64_t size) = 0;
+    };
+
+    // Returns nullptr when the platform has no such backend.
+    std::unique_ptr<FileBackend> CreateFileBackend(FileBackendKind kind);
+    bool RemoveFile(const std::wstring& path);
+
+    struct FileWriter
+    {
+        std::unique_ptr<FileBackend> backend;
+        uint64_t position = 0;
+        uint64_t size = 0;
+        uint64_t reserved = 0;
+        uint64_t reserveStep = 0;
+
+        bool Open(const std::wstring& path, FileBackendKind kind = FileBackendKind::Standard, bool existing = false)
+        {
+            // A file still open is closed at its logical size, not dropped with the backend.
+            Close();
+            uint64_t length = 0;
+            backend = CreateFileBackend(kind);
+            if (!backend || !backend->Open(path, existing, &length))
+            {
+                backend.reset();
+                return false;
+            }
+            position = 0;
+            size = length;
+            reserved = 0;
+            return true;
+        }
+
+        // Drops everything past newSize when the file is closed.
+        void Truncate(uint64_t newSize)
+        {
+            size = newSize;
+            position = std::min(position, newSize);
+        }
+
+        // Preallocates expected bytes; if the output outgrows it, the reservation is
+        // extended by a quarter of the estimate at a time.
+        bool Reserve(uint64_t expected)
+        {
+            if (!IsOpen() || !backend->Reserve(expected))
+            {
+                return false;
+            }
+            reserved = expected;
+            reserveStep = std::max<uint64_t>(expected / 4, 64ull << 20);
+            return true;
+        }
+
+        bool IsOpen() const
+        {
+            return backend != nullptr;
+        }
+
+        bool Write(const void* data, size_t count)
+        {
+            if (!IsOpen() || !backend->WriteAt(position, data, count))
+            {
+                return false;
+            }
+            position += count;
+            size = std::max(size, position);
+            if (reserved != 0 && size > reserved)
+            {
+                reserved = backend->Reserve(size + reserveStep) ? size + reserveStep : 0;
+            }
+            return true;
+        }
+
+        bool Commit()
+        {
+            return !IsOpen() || backend->Commit();
+        }
+
+        bool Read(void* data, size_t count)
+        {
+            if (!IsOpen() || !backend->ReadAt(position, data, count))
+            {
+                return false;
+            }
+            position += count;
+            return true;
+        }
+
+        bool Seek(uint64_t pos)
+        {
+            if (!IsOpen())
+            {
+                return false;
+            }
+            position = pos;
+            return true;
+        }
+
+        uint64_t Tell() const
+        {
+            return position;
+        }
+
+        bool Close()
+        {
+            if (!IsOpen())
+            {
+                return true;
+            }
+            bool ok = backend->Close(size);
+            backend.reset();
+            return ok;
+        }
+    };
+
+    struct Mp4Buffer
+    {
+        std::vector<uint8_t> data;
+
+        void WriteU8(uint8_t value) { data.push_back(value); }
+
+        void WriteU16(uint16_t value)
+        {
+            data.push_back(static_cast<uint8_t>((value >> 8) & 0xFF));
+            data.push_back(static_cast<uint8_t>(value & 0xFF));
+        }
+
+        void WriteU32(uint32_t value)
+        {
+            data.push_back(static_cast<uint8_t>((value >> 24) & 0xFF));
+            data.push_back(static_cast<uint8_t>((value >> 16) & 0xFF));
+            data.push_back(static_cast<uint8_t>((value >> 8) & 0xFF));
+            data.push_back(static_cast<uint8_t>(value & 0xFF));
+        }
+
+        void WriteU24(uint32_t value)
+        {
+            data.push_back(static_cast<uint8_t>((value >> 16) & 0xFF));
+            data.push_back(static_cast<uint8_t>((value >> 8) & 0xFF));
+            data.push_back(static_cast<uint8_t>(value & 0xFF));
+        }
+
+        void WriteU64(uint64_t value)
+        {
+            for (int i = 7; i >= 0; --i)
+            {
+                data.push_back(static_cast<uint8_t>((value >> (i * 8)) & 0xFF));
+            }
+        }
+
+        void WriteString4(const char* value)
+        {
+            data.push_back(static_cast<uint8_t>(value[0]));
+            data.push_back(static_cast<uint8_t>(value[1]));
+            data.push_back(static_cast<uint8_t>(value[2]));
+            data.push_back(static_cast<uint8_t>(value[3]));
+        }
+
+        void WriteBytes(const std::vector<uint8_t>& bytes)
+        {
+            data.insert(data.end(), bytes.begin(), bytes.end());
+        }
+
+        size_t BeginBox(const char* type)
+        {
+            size_t start = data.size();
+            WriteU32(0);
+            WriteString4(type);
+            return start;
+        }
+
+        void EndBox(size_t start)
+        {
+            PatchU32(start, static_cast<uint32_t>(data.size() - start));
+        }
+
+        void PatchU32(size_t pos, uint32_t value)
+        {
+            data[pos + 0] = static_cast<uint8_t>((value >> 24) & 0xFF);
+            data[pos + 1] = static_cast<uint8_t>((value >> 16) & 0xFF);
+            data[pos + 2] = static_cast<uint8_t>((value >> 8) & 0xFF);
+            data[pos + 3] = static_cast<uint8_t>(value & 0xFF);
+        }
+    };
+
+    enum class SignalWait
+    {
+        Signaled,
+        Timeout,
+        Failed,
+    };
+
+    // Completion signal of one async output slot. Handle() is what NVENC registers and signals
+    // as the slot's completionEvent; Wait consumes a signal (auto-reset). Windows uses an event;
+    // elsewhere an eventfd (Linux) or a mutex/condvar pair stands in, whose handle is the signal
+    // itself, so the harvest thread can run against a fake encoder.
+    struct CompletionSignal
+    {
+        virtual ~CompletionSignal() = default;
+        virtual bool Create() = 0;
+        virtual void* Handle() = 0;
+        virtual SignalWait Wait(uint32_t timeoutMs) = 0;
+        virtual void Signal() = 0;
+    };
+
+    std::unique_ptr<CompletionSignal> CreateCompletionSignal();
+
+    struct NalUnit
+    {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        uint8_t type = 0;
+    };
+
+    // How a video sample can start playback. Sync and OpenSync samples are listed in stss;
+    // OpenSync and Recovery go in the 'rap ' sample group (their leading pictures may reference
+    // the previous GOP), Roll in the 'roll' group. Values are stored in the journal.
+    enum class RandomAccess : uint8_t
+    {
+        None = 0,
+        Sync = 1,     // IDR
+        OpenSync = 2, // HEVC CRA / BLA
+        Recovery = 3, // I-frame with a recovery point SEI and no recovery distance
+        Roll = 4,     // recovery point SEI that converges after rollDistance frames
+    };
+
+    // Recycles sample payload buffers: producers (encode and audio threads) take them, the
+    // writer thread hands them back once the bytes are staged. Buffers are filed by capacity
+    // class (powers of two from 4 KB), so a steady stream of frames stops allocating once the
+    // classes it uses are warm.
+    struct SampleBufferPool
+    {
+        static constexpr size_t kMinClassBytes = 4096;
+        static constexpr size_t kClassCount = 16;
+        static constexpr size_t kMaxPooledBytes = 64u << 20;
+
+        std::mutex mutex;
+        std::vector<std::vector<uint8_t>> classes[kClassCount];
+        size_t pooledBytes = 0;
+        uint64_t allocated = 0;
+        uint64_t reused = 0;
+
+        // Returns an empty buffer with capacity for at least bytes.
+        std::vector<uint8_t> Acquire(size_t bytes)
+        {
+            size_t index = 0;
+            while (index < kClassCount && (kMinClassBytes << index) < bytes)
+            {
+                ++index;
+            }
+            std::vector<uint8_t> buffer;
+            if (index == kClassCount)
+            {
+                buffer.reserve(bytes);
+                return buffer;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto& list = classes[index];
+                if (!list.empty())
+                {
+                    buffer = std::move(list.back());
+                    list.pop_back();
+                    pooledBytes -= buffer.capacity();
+                    ++reused;
+                    return buffer;
+                }
+                ++allocated;
+            }
+            buffer.reserve(kMinClassBytes << index);
+            return buffer;
+        }
+
+        void Release(std::vector<uint8_t>&& buffer)
+        {
+            const size_t capacity = buffer.capacity();
+            if (capacity < kMinClassBytes)
+            {
+                return;
+            }
+            // File under the largest class the capacity fully covers.
+            size_t index = 0;
+            while (index + 1 < kClassCount && (kMinClassBytes << (index + 1)) <= capacity)
+            {
+                ++index;
+            }
+            buffer.clear();
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pooledBytes + capacity <= kMaxPooledBytes)
+            {
+                pooledBytes += capacity;
+                classes[index].push_back(std::move(buffer));
+            }
+        }
+    };
+
+    // Bounded multi-producer / single-consumer ring (sequence-numbered slots). Producers
+    // claim a slot with one CAS on tail and publish it through the slot's sequence; only
+    // the consumer moves head, so popping takes no atomic read-modify-write at all.
+    template <typename T>
+    struct MpscRing
+    {
+        struct Slot
+        {
+            std::atomic<size_t> sequence{ 0 };
+            T value;
+        };
+
+        explicit MpscRing(size_t capacity)
+            : slots(new Slot[capacity]), mask(capacity - 1)
+        {
+            for (size_t i = 0; i < capacity; ++i)
+            {
+                slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        // Moves from value only when it returns true; false means the ring is full.
+        bool TryPush(T& value)
+        {
+            size_t pos = tail.load(std::memory_order_relaxed);
+            Slot* slot = nullptr;
+            for (;;)
+            {
+                slot = &slots[pos & mask];
+                const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+                const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+                if (diff == 0)
+                {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+            slot->value = std::move(value);
+            slot->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer only.
+        bool TryPop(T& value)
+        {
+            Slot& slot = slots[head & mask];
+            if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+            {
+                return false;
+            }
+            value = std::move(slot.value);
+            slot.sequence.store(head + mask + 1, std::memory_order_release);
+            ++head;
+            return true;
+        }
+
+        // Consumer only. False while any producer has claimed a slot, even one it hasn't
+        // published yet.
+        bool Idle() const
+        {
+            return tail.load(std::memory_order_acquire) == head;
+        }
+
+        std::unique_ptr<Slot[]> slots;
+        const size_t mask;
+        alignas(64) std::atomic<size_t> tail{ 0 };
+        alignas(64) size_t head = 0;
+    };
+
+    // Everything the muxer and writer thread work on. Producers fill it through
+    // ProcessEncodedBitstream (video) and QueueSample (audio); the writer thread owns the file.
+    struct MuxerState
+    {
+        // B-frames between reference frames (frameIntervalP - 1); only used with async encode.
+        int bFrames = 0;
+        // IDRs only every few GOPs; the GOPs between them start with CRA / recovery-point I-frames.
+        bool openGop = false;
+        std::mutex fileMutex;
+        std::mutex logMutex;
+        std::mutex writerMutex;
+        std::condition_variable writerCv;
+        std::thread writerThread;
+        bool writerStarted = false;
+        bool writerStop = false;
+        bool writerError = false;
+        struct EncodedSample
+        {
+            std::vector<uint8_t> data;
+            bool keyframe = false;
+            bool isAudio = false;
+            uint32_t audioDuration = 0;
+            uint64_t decodeTime = 0;
+            uint32_t description = 1;
+            // Presentation minus decode time in the 90 kHz track timescale (B-frames).
+            int32_t compositionOffset = 0;
+            RandomAccess randomAccess = RandomAccess::None;
+            int16_t rollDistance = 0;
+            // One run of slices of a frame read back slice by slice, with more to follow. The
+            // frame's metadata is on its first piece; the last piece clears this (and may be empty).
+            bool partial = false;
+        };
+        // Encoded samples on their way to the writer thread. writerSleeping tells producers
+        // that the writer is (about to be) parked on writerCv and needs a notify.
+        static constexpr size_t kSampleRingSize = 1024;
+        MpscRing<EncodedSample> sampleRing{ kSampleRingSize };
+        std::atomic<bool> writerSleeping{ false };
+        // Byte budget for samples between the producers and the file (ring plus interleaver).
+        // Producers over budget wait on budgetCv; throttledProducers tells the writer to flush
+        // held-back samples and to notify as it frees bytes. Segments buffered by the stitcher
+        // count against it too (StitchSegmentBitstream). Zero disables the budget.
+        uint64_t queueBudget = 0;
+        std::atomic<uint64_t> queuedBytes{ 0 };
+        std::atomic<int> throttledProducers{ 0 };
+        std::condition_variable budgetCv;
+        // Queue statistics, reported when the writer thread exits.
+        std::atomic<uint64_t> queuePeakBytes{ 0 };
+        std::atomic<uint64_t> queueDepthSum{ 0 };
+        std::atomic<uint64_t> queuePushes{ 0 };
+        std::atomic<uint64_t> throttleMicroseconds{ 0 };
+        SampleBufferPool samplePool;
+        // Writer-thread interleaver: samples are held per track and written as chunks
+        // in decode-time order. Times are in 90 kHz ticks; a zero window keeps arrival order.
+        uint64_t interleaveWindow = 0;
+        uint64_t interleaveVideoTime = 0;
+        uint64_t interleaveAudioSamples = 0;
+        std::deque<EncodedSample> interleaveVideo;
+        std::deque<EncodedSample> interleaveAudio;
+        // Sample payloads waiting to be written as one block (writer thread only).
+        std::vector<uint8_t> writeStaging;
+        // Writer thread: the frame whose slices are still arriving. Without interleaving the
+        // pieces go to the file as they come (at sliceFrameOffset, audio held back meanwhile);
+        // otherwise sliceFrame collects them.
+        EncodedSample sliceFrame;
+        bool sliceFrameOpen = false;
+        uint64_t sliceFrameOffset = 0;
+        uint64_t sliceFrameBytes = 0;
+        std::deque<EncodedSample> sliceHeldAudio;
+        // Crash journal beside the output (standard and faststart layouts only).
+        FileWriter journal;
+        Mp4Buffer journalPending;
+        bool journalVideoConfig = false;
+        bool journalAudioConfig = false;
+        std::chrono::steady_clock::time_point journalFlushTime;
+        int width = 0;
+        int height = 0;
+        int fps = 30;
+        // Encoder settings the container needs: average video bitrate (bits per second) for
+        // the preallocation estimate, and the GOP length for resuming.
+        uint64_t videoBitrate = 0;
+        uint32_t gopLength = 0;
+        uint64_t frameIndex = 0;
+        // Video frames handed to the writer, i.e. the decode-order index of the next one.
+        uint64_t outputFrames = 0;
+        // NAL boundaries of the frame being converted (encode thread only).
+        std::vector<NalUnit> nalUnits;
+        // Segment encoding: frames come from several sessions, each taking segmentFrames
+        // consecutive frames (opened with an IDR) at a time. The current segment goes straight
+        // to ProcessEncodedBitstream; later ones are copied aside until every segment before
+        // them is complete. Guarded by segmentMutex; zero segmentFrames means one session.
+        // A session delivering a later segment waits on segmentCv while the buffered bytes
+        // plus queuedBytes are over queueBudget, so the copies stay within the budget.
+        struct SegmentPiece
+        {
+            std::vector<uint8_t> data;
+            uint64_t timeStamp = 0;
+            bool firstPiece = true;
+            bool lastPiece = true;
+        };
+        struct PendingSegment
+        {
+            std::vector<SegmentPiece> pieces;
+            uint32_t frames = 0;
+        };
+        uint32_t segmentFrames = 0;
+        std::mutex segmentMutex;
+        uint64_t segmentCurrent = 0;
+        uint32_t segmentCurrentFrames = 0;
+        std::map<uint64_t, PendingSegment> segmentPending;
+        uint64_t segmentBufferedBytes = 0;
+        uint64_t segmentBufferedPeak = 0;
+        uint64_t segmentsStitched = 0;
+        std::condition_variable segmentCv;
+        uint64_t segmentWaits = 0;
+        // Set when NvencCreate continued an interrupted output: the first frame still to
+        // encode, and whether the audio gap up to it has yet to be filled with silence.
+        uint64_t resumeFrame = 0;
+        bool resumeAudioPending = false;
+        bool writerInitialized = false;
+        bool mp4Finalized = false;
+        bool isHevc = false;
+        FileWriter file;
+        uint64_t mdatHeaderOffset = 0;
+        uint64_t mdatLargeSizeOffset = 0;
+        uint64_t mdatDataOffset = 0;
+        std::vector<uint32_t> sampleSizes;
+        std::vector<uint64_t> sampleOffsets;
+        std::vector<uint32_t> syncSamples;
+        std::vector<int32_t> compositionOffsets;
+        // Samples that are random access points other than IDRs (0-based sample numbers).
+        struct RandomAccessPoint
+        {
+            uint32_t sample = 0;
+            RandomAccess kind = RandomAccess::None;
+            int16_t rollDistance = 0;
+        };
+        std::vector<RandomAccessPoint> randomAccessPoints;
+        std::vector<uint8_t> codecPrivate;
+        // Parameter sets that differ from codecPrivate get their own stsd entries (index 2 on,
+        // appended by the producer under fileMutex). The writer records where each run of
+        // samples with one description starts; no entries means description 1 throughout.
+        struct DescriptionChange
+        {
+            uint32_t firstSample = 0;
+            uint32_t description = 1;
+        };
+        std::vector<std::vector<uint8_t>> extraCodecPrivate;
+        std::vector<DescriptionChange> descriptionChanges;
+        uint32_t journalDescription = 1;
+        // Producer side: hash of the parameter sets last seen in the bitstream, the description
+        // they map to, and the hash of each description (0 until first seen in the bitstream).
+        uint64_t parameterSetHash = 0;
+        uint32_t currentDescription = 1;
+        std::vector<uint64_t> descriptionHashes;
+        bool inbandParameterSets = false;
+        // Fragmented MP4: one moof+mdat per GOP, only the open fragment is kept in memory.
+        bool fragmented = false;
+        bool initSegmentWritten = false;
+        bool fragmentHasAudio = false;
+        uint32_t fragmentSequence = 0;
+        uint64_t fragmentVideoTime = 0;
+        uint64_t fragmentAudioTime = 0;
+        uint64_t mehdDurationOffset = 0;
+        // Video edit list duration in the init segment, 0 when it has no edit list.
+        uint64_t elstDurationOffset = 0;
+        bool fragmentStartsWithSync = false;
+        std::vector<uint8_t> fragmentVideoData;
+        std::vector<uint32_t> fragmentVideoSizes;
+        std::vector<int32_t> fragmentVideoOffsets;
+        std::vector<RandomAccessPoint> fragmentRandomAccess;
+        std::vector<uint8_t> fragmentAudioData;
+        std::vector<uint32_t> fragmentAudioSizes;
+        std::vector<uint32_t> fragmentAudioDurations;
+        struct FragmentEntry
+        {
+            uint64_t time = 0;
+            uint64_t moofOffset = 0;
+        };
+        std::vector<FragmentEntry> fragmentIndex;
+        // Faststart: a free box after ftyp is reserved for the final moov.
+        bool faststart = false;
+        uint64_t expectedFrameCount = 0;
+        uint64_t moovReserveOffset = 0;
+        uint64_t moovReserveSize = 0;
+        bool audioInitialized = false;
+        int audioSampleRate = 0;
+        int audioChannels = 0;
+        uint32_t audioBitrate = 192000;
+        uint64_t audioSampleTotal = 0;
+        std::vector<int16_t> audioPcmBuffer;
+        size_t audioPcmRead = 0;
+        std::vector<uint32_t> audioSampleSizes;
+        std::vector<uint64_t> audioSampleOffsets;
+        std::vector<uint32_t> audioSampleDurations;
+        std::vector<uint8_t> audioSpecificConfig;
+        std::wstring outputPath;
+        FileBackendKind fileBackend = FileBackendKind::Standard;
+        std::wstring lastError;
+        bool logEnabled = false;
+#ifdef _WIN32
+        HANDLE logFile = INVALID_HANDLE_VALUE;
+#else
+        int logFile = -1;
+#endif
+    };
+
+    void SetError(MuxerState* state, const std::wstring& message);
+    void OpenLog(MuxerState* state);
+    void CloseLog(MuxerState* state);
+    void LogLine(MuxerState* state, const std::wstring& line);
+
+    uint32_t VideoFrameDuration(const MuxerState* state);
+    std::vector<uint8_t> BuildAacSpecificConfig(int sampleRate, int channels);
+    bool InitializeMp4Writer(MuxerState* state, bool hevc, const std::vector<uint8_t>& codecPrivate);
+    // Continues an interrupted render of state->outputPath; sessionCodecPrivate holds the
+    // parameter sets the encoder will emit (empty when unknown).
+    bool ResumeMp4Writer(MuxerState* state, bool hevc, const std::vector<uint8_t>& sessionCodecPrivate, bool* resumed);
+    // Stops the writer thread and completes the container. Audio still held by the encoder
+    // must have been queued before.
+    bool FinalizeMp4(MuxerState* state);
+    void CloseJournal(MuxerState* state, bool remove);
+    int RepairOutput(MuxerState* state);
+
+    // Start-code scanners behind ParseAnnexB: each returns the first position at or after from
+    // holding 00 00 01 (with the 01 inside the buffer), or size. The vector ones are x86-64 only.
+    size_t ScanStartCodeScalar(const uint8_t* data, size_t size, size_t from);
+#if defined(_M_X64) || defined(__x86_64__)
+    size_t ScanStartCodeSse2(const uint8_t* data, size_t size, size_t from);
+#ifdef __GNUC__
+    __attribute__((target("avx2")))
+#endif
+    size_t ScanStartCodeAvx2(const uint8_t* data, size_t size, size_t from);
+    bool CpuHasAvx2();
+#endif
+    // Splits an Annex B buffer into NAL units (start codes excluded), replacing units.
+    void ParseAnnexB(const uint8_t* data, size_t size, bool hevc, std::vector<NalUnit>& units);
+
+    // avcC / hvcC from the parameter sets in an Annex B buffer; empty if they are missing.
+    std::vector<uint8_t> CodecPrivateFromAnnexB(const uint8_t* data, size_t size, bool hevc);
+    bool ProcessEncodedBitstream(MuxerState* state, const uint8_t* data, size_t size, uint64_t timeStamp,
+        bool firstPiece = true, bool lastPiece = true);
+
+    // Segment encoding: BeginSegments switches stitching on from the current frameIndex.
+    // StitchSegmentBitstream takes the same arguments as ProcessEncodedBitstream from any
+    // session thread, timeStamp being the frame's global index. FinishSegments, once every
+    // session has drained, fails if frames are still buffered, i.e. a session lost some.
+    void BeginSegments(MuxerState* state, uint32_t segmentFrames);
+    bool StitchSegmentBitstream(MuxerState* state, const uint8_t* data, size_t size, uint64_t timeStamp,
+        bool firstPiece = true, bool lastPiece = true);
+    bool FinishSegments(MuxerState* state);
+
+    void StartWriterThread(MuxerState* state);
+    void StopWriterThread(MuxerState* state);
+    bool QueueSample(MuxerState* state, MuxerState::EncodedSample&& sample);
+
+    // AAC takes PCM in frames of this many samples per channel.
+    const uint32_t kAacFrameSamples = 1024;
+    // Appends interleaved float samples as 16-bit PCM (after the silence a resumed render
+    // still owes up to its restart frame).
+    void StageAudioPcm(MuxerState* state, const float* samples, size_t sampleCount);
+    // The next complete frame of staged PCM, or nullptr. Valid until the next StageAudioPcm.
+    const int16_t* NextAudioPcmFrame(MuxerState* state);
+    // The staged remainder padded with silence to a whole frame; false if nothing is left.
+    bool TakeAudioPcmTail(MuxerState* state, std::vector<int16_t>* frame);
+}
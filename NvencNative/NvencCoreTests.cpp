@@ -0,0 +1,712 @@
+// Checks of the core that need more than a mux run: each test is selected by name and returns
+// non-zero on the first mismatch, printing what differed. CMakeLists.txt registers one ctest
+// test per name.
+//
+//   nvenc_core_tests scanner|pool|fragment_edit_list|fragment_late_audio|stitch_lost_frames|stitch_order
+
+#include "NvencTestSupport.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+
+using namespace NvencCore;
+using namespace NvencTest;
+
+namespace
+{
+    using Scanner = size_t (*)(const uint8_t*, size_t, size_t);
+
+    struct NamedScanner
+    {
+        const char* name;
+        Scanner scan;
+    };
+
+    std::vector<NamedScanner> VectorScanners()
+    {
+        std::vector<NamedScanner> scanners;
+#if defined(_M_X64) || defined(__x86_64__)
+        scanners.push_back({ "sse2", ScanStartCodeSse2 });
+        if (CpuHasAvx2())
+        {
+            scanners.push_back({ "avx2", ScanStartCodeAvx2 });
+        }
+        else
+        {
+            printf("scanner: no AVX2 on this CPU, checking SSE2 only\n");
+        }
+#endif
+        return scanners;
+    }
+
+    // Every from position of the buffer must give the scalar result.
+    bool CompareScanners(const std::vector<NamedScanner>& scanners, const uint8_t* data, size_t size, const char* what)
+    {
+        for (size_t from = 0; from <= size; ++from)
+        {
+            const size_t expected = ScanStartCodeScalar(data, size, from);
+            for (const NamedScanner& scanner : scanners)
+            {
+                const size_t actual = scanner.scan(data, size, from);
+                if (actual != expected)
+                {
+                    printf("scanner: %s %s size %zu from %zu: got %zu, scalar %zu\n", scanner.name, what, size, from, actual, expected);
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool TestScanner()
+    {
+        const std::vector<NamedScanner> scanners = VectorScanners();
+        std::mt19937 random(1234);
+        // A single 00 00 01 (and the 4-byte form) at every position around the 16- and
+        // 32-byte steps and the buffer tail, in a background with no other start code. Each
+        // buffer is its own allocation, so an over-read shows up under the address sanitizer.
+        for (size_t size = 3; size <= 100; ++size)
+        {
+            for (size_t at = 0; at + 3 <= size; ++at)
+            {
+                for (int four = 0; four < 2; ++four)
+                {
+                    std::vector<uint8_t> buffer(size);
+                    for (uint8_t& byte : buffer)
+                    {
+                        byte = static_cast<uint8_t>(2 + random() % 254);
+                    }
+                    buffer[at] = 0;
+                    buffer[at + 1] = 0;
+                    buffer[at + 2] = 1;
+                    if (four && at > 0)
+                    {
+                        buffer[at - 1] = 0;
+                    }
+                    if (!CompareScanners(scanners, buffer.data(), buffer.size(), four ? "placed 4-byte code" : "placed code"))
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+
+        // Start codes cut off by the end of the buffer: 00, 00 00, 00 00 00 as the tail.
+        for (size_t size = 1; size <= 100; ++size)
+        {
+            for (size_t zeros = 1; zeros <= 3 && zeros <= size; ++zeros)
+            {
+                std::vector<uint8_t> buffer(size, 0x55);
+                std::fill(buffer.end() - zeros, buffer.end(), 0);
+                if (!CompareScanners(scanners, buffer.data(), buffer.size(), "truncated tail"))
+                {
+                    return false;
+                }
+            }
+        }
+
+        // Random buffers over a small alphabet, so zeros, ones and partial codes are dense. The
+        // data starts at a random offset into its allocation so every load alignment is hit.
+        const uint8_t alphabet[] = { 0, 0, 0, 1, 1, 2, 3, 0x80, 0xFF };
+        std::vector<uint8_t> storage;
+        for (int round = 0; round < 20000; ++round)
+        {
+            const size_t size = random() % 200;
+            const size_t offset = random() % 64;
+            storage.resize(offset + size);
+            for (size_t i = offset; i < storage.size(); ++i)
+            {
+                storage[i] = alphabet[random() % sizeof(alphabet)];
+            }
+            if (!CompareScanners(scanners, storage.data() + offset, size, "random"))
+            {
+                return false;
+            }
+        }
+
+        // Long sparse buffers, as slice payloads are, checked from a few starting points.
+        for (int round = 0; round < 200; ++round)
+        {
+            std::vector<uint8_t> buffer(4096 + random() % 4096);
+            for (uint8_t& byte : buffer)
+            {
+                byte = static_cast<uint8_t>(random());
+            }
+            for (int codes = random() % 4; codes > 0; --codes)
+            {
+                const size_t at = random() % (buffer.size() - 2);
+                buffer[at] = 0;
+                buffer[at + 1] = 0;
+                buffer[at + 2] = 1;
+            }
+            for (size_t from = 0; from < buffer.size(); from += 1 + random() % 700)
+            {
+                const size_t expected = ScanStartCodeScalar(buffer.data(), buffer.size(), from);
+                for (const NamedScanner& scanner : scanners)
+                {
+                    if (scanner.scan(buffer.data(), buffer.size(), from) != expected)
+                    {
+                        printf("scanner: %s sparse size %zu from %zu differs from scalar\n", scanner.name, buffer.size(), from);
+                        return false;
+                    }
+                }
+            }
+        }
+        printf("scanner: ok\n");
+        return true;
+    }
+
+    const int kFps = 30;
+    const int kGop = 30;
+
+    // A muxer writing 1080p H.264 with 48 kHz stereo AAC to path, in arrival order.
+    MuxerState* CreateMuxer(const char* path)
+    {
+        auto* state = new MuxerState();
+        state->outputPath = WidePath(path);
+        state->width = 1920;
+        state->height = 1080;
+        state->fps = kFps;
+        state->gopLength = kGop;
+        state->audioInitialized = true;
+        state->audioSampleRate = 48000;
+        state->audioChannels = 2;
+        state->audioSpecificConfig = BuildAacSpecificConfig(48000, 2);
+        return state;
+    }
+
+    void DestroyMuxer(MuxerState* state)
+    {
+        StopWriterThread(state);
+        state->file.Close();
+        CloseJournal(state, true);
+        delete state;
+    }
+
+    // Waits until the writer has handed back every queued sample.
+    bool WaitForWriter(MuxerState* state)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (state->queuedBytes.load() != 0)
+        {
+            if (state->writerError || std::chrono::steady_clock::now() > deadline)
+            {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> ReadWholeFile(const char* path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    uint32_t ReadU32(const uint8_t* p)
+    {
+        return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+    }
+
+    uint64_t ReadU64(const uint8_t* p)
+    {
+        return (static_cast<uint64_t>(ReadU32(p)) << 32) | ReadU32(p + 4);
+    }
+
+    struct Box
+    {
+        size_t payload = 0;
+        size_t end = 0;
+    };
+
+    // The first box of the given type directly inside [begin, end).
+    bool FindBox(const std::vector<uint8_t>& file, size_t begin, size_t end, const char* type, Box* box)
+    {
+        size_t pos = begin;
+        while (pos + 8 <= end)
+        {
+            uint64_t size = ReadU32(&file[pos]);
+            size_t header = 8;
+            if (size == 1 && pos + 16 <= end)
+            {
+                size = ReadU64(&file[pos + 8]);
+                header = 16;
+            }
+            else if (size == 0)
+            {
+                size = end - pos;
+            }
+            if (size < header || size > end - pos)
+            {
+                return false;
+            }
+            if (memcmp(&file[pos + 4], type, 4) == 0)
+            {
+                box->payload = pos + header;
+                box->end = pos + static_cast<size_t>(size);
+                return true;
+            }
+            pos += static_cast<size_t>(size);
+        }
+        return false;
+    }
+
+    // Follows a path of nested boxes from the top level, e.g. { "moov", "trak", "edts" }.
+    bool FindPath(const std::vector<uint8_t>& file, std::initializer_list<const char*> path, Box* box)
+    {
+        Box current{ 0, file.size() };
+        for (const char* type : path)
+        {
+            if (!FindBox(file, current.payload, current.end, type, &current))
+            {
+                return false;
+            }
+        }
+        *box = current;
+        return true;
+    }
+
+    struct EditList
+    {
+        bool present = false;
+        uint32_t duration = 0;
+        uint32_t mediaTime = 0;
+    };
+
+    EditList ReadVideoEditList(const char* path)
+    {
+        const std::vector<uint8_t> file = ReadWholeFile(path);
+        EditList edit;
+        Box elst;
+        if (FindPath(file, { "moov", "trak", "edts", "elst" }, &elst) && elst.end - elst.payload >= 20 && ReadU32(&file[elst.payload + 4]) == 1)
+        {
+            edit.present = true;
+            edit.duration = ReadU32(&file[elst.payload + 8]);
+            edit.mediaTime = ReadU32(&file[elst.payload + 12]);
+        }
+        return edit;
+    }
+
+    // The video track of a non-fragmented file as its sample tables describe it: per sample
+    // (in decode order) the frame number from its slice payload, the composition offset, and
+    // the 1-based sync sample numbers.
+    struct VideoTrack
+    {
+        std::vector<int64_t> frames;
+        std::vector<int32_t> compositionOffsets;
+        std::vector<uint32_t> syncSamples;
+    };
+
+    bool ReadVideoTrack(const char* path, VideoTrack* track)
+    {
+        const std::vector<uint8_t> file = ReadWholeFile(path);
+        Box stbl;
+        if (!FindPath(file, { "moov", "trak", "mdia", "minf", "stbl" }, &stbl))
+        {
+            printf("%s: no video stbl\n", path);
+            return false;
+        }
+        Box stsz;
+        Box stsc;
+        Box chunks;
+        bool largeOffsets = false;
+        if (!FindBox(file, stbl.payload, stbl.end, "stsz", &stsz) || !FindBox(file, stbl.payload, stbl.end, "stsc", &stsc))
+        {
+            printf("%s: no stsz / stsc\n", path);
+            return false;
+        }
+        if (!FindBox(file, stbl.payload, stbl.end, "stco", &chunks))
+        {
+            largeOffsets = FindBox(file, stbl.payload, stbl.end, "co64", &chunks);
+            if (!largeOffsets)
+            {
+                printf("%s: no chunk offsets\n", path);
+                return false;
+            }
+        }
+
+        const uint32_t constantSize = ReadU32(&file[stsz.payload + 4]);
+        const uint32_t sampleCount = ReadU32(&file[stsz.payload + 8]);
+        const uint32_t chunkCount = ReadU32(&file[chunks.payload + 4]);
+        const uint32_t stscEntries = ReadU32(&file[stsc.payload + 4]);
+        std::vector<uint64_t> sampleOffsets;
+        std::vector<uint32_t> sampleSizes;
+        for (uint32_t entry = 0; entry < stscEntries; ++entry)
+        {
+            const uint8_t* e = &file[stsc.payload + 8 + entry * 12];
+            const uint32_t firstChunk = ReadU32(e);
+            const uint32_t lastChunk = entry + 1 < stscEntries ? ReadU32(e + 12) - 1 : chunkCount;
+            for (uint32_t chunk = firstChunk; chunk <= lastChunk; ++chunk)
+            {
+                const uint8_t* c = &file[chunks.payload + 8 + (chunk - 1) * (largeOffsets ? 8 : 4)];
+                uint64_t offset = largeOffsets ? ReadU64(c) : ReadU32(c);
+                for (uint32_t i = 0; i < ReadU32(e + 4) && sampleSizes.size() < sampleCount; ++i)
+                {
+                    const uint32_t size = constantSize ? constantSize : ReadU32(&file[stsz.payload + 12 + sampleSizes.size() * 4]);
+                    sampleOffsets.push_back(offset);
+                    sampleSizes.push_back(size);
+                    offset += size;
+                }
+            }
+        }
+        if (sampleSizes.size() != sampleCount)
+        {
+            printf("%s: stsc covers %zu of %u samples\n", path, sampleSizes.size(), sampleCount);
+            return false;
+        }
+
+        track->frames.clear();
+        for (uint32_t i = 0; i < sampleCount; ++i)
+        {
+            // Length-prefixed NALs; the frame number follows the two-byte slice header.
+            int64_t frame = -1;
+            uint64_t pos = sampleOffsets[i];
+            const uint64_t end = pos + sampleSizes[i];
+            while (frame < 0 && pos + 4 <= end && end <= file.size())
+            {
+                const uint32_t length = ReadU32(&file[pos]);
+                const uint8_t type = file[pos + 4] & 0x1F;
+                if ((type == 1 || type == 5) && length >= 6)
+                {
+                    frame = static_cast<int64_t>(ReadFrameNumber(&file[pos + 6]));
+                }
+                pos += 4 + static_cast<uint64_t>(length);
+            }
+            track->frames.push_back(frame);
+        }
+
+        track->compositionOffsets.assign(sampleCount, 0);
+        Box ctts;
+        if (FindBox(file, stbl.payload, stbl.end, "ctts", &ctts))
+        {
+            size_t sample = 0;
+            for (uint32_t entry = 0; entry < ReadU32(&file[ctts.payload + 4]); ++entry)
+            {
+                const uint8_t* e = &file[ctts.payload + 8 + entry * 8];
+                for (uint32_t i = 0; i < ReadU32(e) && sample < sampleCount; ++i)
+                {
+                    track->compositionOffsets[sample++] = static_cast<int32_t>(ReadU32(e + 4));
+                }
+            }
+        }
+        track->syncSamples.clear();
+        Box stss;
+        if (FindBox(file, stbl.payload, stbl.end, "stss", &stss))
+        {
+            for (uint32_t entry = 0; entry < ReadU32(&file[stss.payload + 4]); ++entry)
+            {
+                track->syncSamples.push_back(ReadU32(&file[stss.payload + 8 + entry * 4]));
+            }
+        }
+        return true;
+    }
+
+    // Stitches frames from sessions producers; concurrently with random pauses, or one session
+    // after the other starting with the last, so every segment but the final run is buffered.
+    // A non-zero budget is the queue budget, which the buffered segments must stay within.
+    bool StitchAndCheck(const char* path, uint64_t frames, uint32_t sessions, bool concurrent, uint64_t budget = 0)
+    {
+        MuxerState* state = CreateMuxer(path);
+        state->audioInitialized = false;
+        state->bFrames = 2;
+        state->queueBudget = budget;
+        bool ok = InitializeMp4Writer(state, false, {});
+        StartWriterThread(state);
+        BeginSegments(state, kGop);
+        SegmentStream stream;
+        stream.frames = frames;
+        stream.segmentFrames = kGop;
+        stream.bFrames = 2;
+        stream.idrBytes = 1000;
+        stream.frameBytes = 1000;
+        stream.jitterBytes = 3000;
+        stream.pauses = concurrent;
+        if (concurrent)
+        {
+            std::vector<std::thread> producers;
+            std::vector<char> produced(sessions, 0);
+            for (uint32_t i = 0; i < sessions; ++i)
+            {
+                producers.emplace_back([&, i]()
+                {
+                    produced[i] = ProduceSegments(state, stream, i, sessions, i + 1);
+                });
+            }
+            for (uint32_t i = 0; i < sessions; ++i)
+            {
+                producers[i].join();
+                ok = ok && produced[i] != 0;
+            }
+        }
+        for (uint32_t i = sessions; !concurrent && ok && i-- > 0;)
+        {
+            ok = ProduceSegments(state, stream, i, sessions, 0);
+        }
+        ok = ok && FinishSegments(state) && FinalizeMp4(state);
+        if (!ok)
+        {
+            printf("stitch_order: %s failed: %ls\n", path, state->lastError.c_str());
+        }
+        const uint64_t bufferedPeak = state->segmentBufferedPeak;
+        const uint64_t waits = state->segmentWaits;
+        DestroyMuxer(state);
+        if (ok && budget > 0)
+        {
+            printf("stitch_order: %s buffered peak %llu of budget %llu, %llu waits\n", path,
+                static_cast<unsigned long long>(bufferedPeak), static_cast<unsigned long long>(budget),
+                static_cast<unsigned long long>(waits));
+            if (bufferedPeak > budget || waits == 0)
+            {
+                return false;
+            }
+        }
+
+        VideoTrack track;
+        if (!ok || !ReadVideoTrack(path, &track))
+        {
+            return false;
+        }
+        if (track.frames.size() != frames)
+        {
+            printf("stitch_order: %s has %zu samples, expected %llu\n", path, track.frames.size(), static_cast<unsigned long long>(frames));
+            return false;
+        }
+        const int32_t frameDuration = 90000 / kFps;
+        std::vector<uint32_t> expectedSync;
+        for (uint64_t i = 0; i < frames; ++i)
+        {
+            const uint64_t start = i / kGop * kGop;
+            const uint64_t frame = start + PresentationFrame(i - start, std::min<uint64_t>(kGop, frames - start), 2);
+            const int32_t offset = static_cast<int32_t>((static_cast<int64_t>(frame) - static_cast<int64_t>(i)) * frameDuration);
+            if (track.frames[i] != static_cast<int64_t>(frame) || track.compositionOffsets[i] != offset)
+            {
+                printf("stitch_order: %s sample %llu holds frame %lld with ctts %d, expected frame %llu with %d\n", path,
+                    static_cast<unsigned long long>(i), static_cast<long long>(track.frames[i]), track.compositionOffsets[i],
+                    static_cast<unsigned long long>(frame), offset);
+                return false;
+            }
+            if (i == start)
+            {
+                expectedSync.push_back(static_cast<uint32_t>(i + 1));
+            }
+        }
+        if (track.syncSamples != expectedSync)
+        {
+            printf("stitch_order: %s has %zu sync samples, expected one per segment start (%zu)\n", path,
+                track.syncSamples.size(), expectedSync.size());
+            return false;
+        }
+        return true;
+    }
+
+    // Segments fed out of order by several sessions must come out as one stream: samples in
+    // decode order, a sync sample at each segment's IDR and the B-frame composition offsets.
+    // Under a queue budget the segments waiting for their turn stay within it.
+    bool TestStitchOrder()
+    {
+        const uint64_t frames = 10 * kGop + 17;
+        const bool ok = StitchAndCheck("core_stitch_reverse.mp4", frames, 3, false)
+            && StitchAndCheck("core_stitch_concurrent.mp4", frames, 4, true)
+            && StitchAndCheck("core_stitch_budget.mp4", frames, 3, true, 64 * 1024);
+        printf("stitch_order: %s\n", ok ? "ok" : "failed");
+        return ok;
+    }
+
+    // Muxes frames with two B-frames per reference, standard or fragmented, without audio.
+    bool MuxReordered(const char* path, bool fragmented, uint64_t frames)
+    {
+        MuxerState* state = CreateMuxer(path);
+        state->audioInitialized = false;
+        state->bFrames = 2;
+        state->fragmented = fragmented;
+        bool ok = InitializeMp4Writer(state, false, {});
+        std::vector<uint8_t> accessUnit;
+        for (uint64_t n = 0; ok && n < frames; ++n)
+        {
+            const uint64_t frame = PresentationFrame(n, frames, state->bFrames);
+            BuildAccessUnit(accessUnit, frame, frame % kGop == 0, false, 2000);
+            ok = ProcessEncodedBitstream(state, accessUnit.data(), accessUnit.size(), frame);
+        }
+        ok = ok && FinalizeMp4(state);
+        if (!ok)
+        {
+            printf("mux %s failed: %ls\n", path, state->lastError.c_str());
+        }
+        DestroyMuxer(state);
+        return ok;
+    }
+
+    // The fragmented init segment carries the same edit list as the standard moov, with the
+    // duration patched in once the last fragment is out.
+    bool TestFragmentEditList()
+    {
+        const uint64_t frames = 4 * kGop;
+        if (!MuxReordered("core_edit_standard.mp4", false, frames) || !MuxReordered("core_edit_fragmented.mp4", true, frames))
+        {
+            return false;
+        }
+        const EditList standard = ReadVideoEditList("core_edit_standard.mp4");
+        const EditList fragmented = ReadVideoEditList("core_edit_fragmented.mp4");
+        printf("fragment_edit_list: standard %d duration %u media time %u, fragmented %d duration %u media time %u\n",
+            standard.present ? 1 : 0, standard.duration, standard.mediaTime,
+            fragmented.present ? 1 : 0, fragmented.duration, fragmented.mediaTime);
+        const uint32_t duration = static_cast<uint32_t>(frames) * (90000 / kFps);
+        return standard.present && fragmented.present && standard.duration == duration
+            && fragmented.duration == standard.duration && fragmented.mediaTime == standard.mediaTime;
+    }
+
+    // Audio that first arrives after the fragmented init segment (written at the second IDR)
+    // has no trak to go into; the render must fail instead of finishing without the track.
+    bool TestFragmentLateAudio()
+    {
+        MuxerState* state = CreateMuxer("core_fragment_late_audio.mp4");
+        state->audioInitialized = false;
+        state->fragmented = true;
+        bool ok = InitializeMp4Writer(state, false, {});
+        std::vector<uint8_t> accessUnit;
+        for (uint64_t frame = 0; ok && frame < 2 * kGop + 1; ++frame)
+        {
+            BuildAccessUnit(accessUnit, frame, frame % kGop == 0, false, 2000);
+            ok = ProcessEncodedBitstream(state, accessUnit.data(), accessUnit.size(), frame);
+        }
+        if (!ok || !WaitForWriter(state) || !state->initSegmentWritten)
+        {
+            printf("fragment_late_audio: init segment not written: %ls\n", state->lastError.c_str());
+            DestroyMuxer(state);
+            return false;
+        }
+        state->audioInitialized = true;
+        std::vector<uint8_t> payload(300, 0x21);
+        QueueSample(state, MuxerState::EncodedSample{ std::move(payload), false, true, kAacFrameSamples });
+        const bool finished = FinalizeMp4(state);
+        printf("fragment_late_audio: finalize %s: %ls\n", finished ? "succeeded" : "failed", state->lastError.c_str());
+        DestroyMuxer(state);
+        return !finished;
+    }
+
+    // Segments of kGop frames through the stitcher, skipping frames [lost, lostEnd);
+    // FinishSegments must report the gap rather than join the segments around it.
+    bool FinishWithLostFrames(uint64_t frames, uint64_t lost, uint64_t lostEnd)
+    {
+        MuxerState* state = CreateMuxer("core_stitch_lost.mp4");
+        state->audioInitialized = false;
+        bool ok = InitializeMp4Writer(state, false, {});
+        StartWriterThread(state);
+        BeginSegments(state, kGop);
+        std::vector<uint8_t> accessUnit;
+        // Later segments first, so they are buffered while the earlier ones are incomplete.
+        for (uint64_t segment = frames / kGop; ok && segment-- > 0;)
+        {
+            for (uint64_t frame = segment * kGop; ok && frame < (segment + 1) * kGop; ++frame)
+            {
+                if (frame < lost || frame >= lostEnd)
+                {
+                    BuildAccessUnit(accessUnit, frame, frame % kGop == 0, false, 2000);
+                    ok = StitchSegmentBitstream(state, accessUnit.data(), accessUnit.size(), frame);
+                }
+            }
+        }
+        const bool finished = ok && FinishSegments(state);
+        const bool reported = ok && !finished && !state->lastError.empty() && state->segmentBufferedBytes == 0;
+        printf("stitch_lost_frames: frames %llu-%llu lost, finish %s: %ls\n", static_cast<unsigned long long>(lost),
+            static_cast<unsigned long long>(lostEnd - 1), finished ? "succeeded" : "failed", state->lastError.c_str());
+        DestroyMuxer(state);
+        return reported;
+    }
+
+    bool TestStitchLostFrames()
+    {
+        // A frame missing from the first and from a middle segment, and a whole segment that
+        // never arrived. (A short last segment is indistinguishable from a clean end.)
+        return FinishWithLostFrames(4 * kGop, 0, 1) && FinishWithLostFrames(4 * kGop, kGop + 5, kGop + 6)
+            && FinishWithLostFrames(4 * kGop, 2 * kGop, 3 * kGop);
+    }
+
+    // With every sample written before the next one is produced, the buffers the writer hands
+    // back cover what the producers ask for once each size class has been seen, so after the
+    // warm-up GOPs nothing is allocated and every Acquire is a reuse.
+    bool TestPoolSteadyState()
+    {
+        MuxerState* state = CreateMuxer("core_pool.mp4");
+        bool ok = InitializeMp4Writer(state, false, {});
+        std::vector<uint8_t> accessUnit;
+        uint64_t audioFrames = 0;
+        uint64_t acquires = 0;
+        uint64_t allocatedAfterWarmUp = 0;
+        uint64_t reusedAfterWarmUp = 0;
+        const uint64_t warmUpFrames = 2 * kGop;
+        const uint64_t frames = warmUpFrames + 6 * kGop;
+        for (uint64_t frame = 0; ok && frame < frames; ++frame)
+        {
+            if (frame == warmUpFrames)
+            {
+                allocatedAfterWarmUp = state->samplePool.allocated;
+                reusedAfterWarmUp = state->samplePool.reused;
+                acquires = 0;
+            }
+            const bool idr = frame % kGop == 0;
+            // IDR and P sizes vary but stay inside their size classes (256 KB and 64 KB).
+            BuildAccessUnit(accessUnit, frame, idr, false, (idr ? 150000 : 40000) + (frame * 977) % 8000);
+            ok = ProcessEncodedBitstream(state, accessUnit.data(), accessUnit.size(), frame);
+            ++acquires;
+            const uint64_t audioBefore = audioFrames;
+            ok = ok && QueueAudioUpTo(state, frame, kFps, &audioFrames);
+            acquires += audioFrames - audioBefore;
+            ok = ok && WaitForWriter(state);
+        }
+        const uint64_t allocated = state->samplePool.allocated - allocatedAfterWarmUp;
+        const uint64_t reused = state->samplePool.reused - reusedAfterWarmUp;
+        ok = ok && FinalizeMp4(state);
+        printf("pool: warm-up allocated %llu; steady state acquires %llu allocated %llu reused %llu\n",
+            static_cast<unsigned long long>(allocatedAfterWarmUp), static_cast<unsigned long long>(acquires),
+            static_cast<unsigned long long>(allocated), static_cast<unsigned long long>(reused));
+        if (!ok)
+        {
+            printf("pool: muxing failed: %ls\n", state->lastError.c_str());
+        }
+        DestroyMuxer(state);
+        return ok && allocated == 0 && reused == acquires;
+    }
+
+    struct Test
+    {
+        const char* name;
+        bool (*run)();
+    };
+
+    const Test kTests[] = {
+        { "scanner", TestScanner },
+        { "pool", TestPoolSteadyState },
+        { "fragment_edit_list", TestFragmentEditList },
+        { "fragment_late_audio", TestFragmentLateAudio },
+        { "stitch_lost_frames", TestStitchLostFrames },
+        { "stitch_order", TestStitchOrder },
+    };
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: nvenc_core_tests <test>\n");
+        for (const Test& test : kTests)
+        {
+            printf("  %s\n", test.name);
+        }
+        return 2;
+    }
+    for (const Test& test : kTests)
+    {
+        if (strcmp(argv[1], test.name) == 0)
+        {
+            return test.run() ? 0 : 1;
+        }
+    }
+    printf("unknown test %s\n", argv[1]);
+    return 2;
+}
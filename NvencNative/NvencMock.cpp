@@ -0,0 +1,931 @@
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include "NvencMock.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::mutex g_configMutex;
+    NvencMockConfig g_config;
+
+    struct MockBitstream
+    {
+        std::vector<uint8_t> data;
+        // End offset of each slice in data.
+        std::vector<uint32_t> sliceEnds;
+        uint64_t timeStamp = 0;
+        uint32_t frameIdx = 0;
+        NV_ENC_PIC_TYPE pictureType = NV_ENC_PIC_TYPE_UNKNOWN;
+        // Mapped input the frame was encoded from (none for the EOS buffer).
+        void* input = nullptr;
+        void* completionEvent = nullptr;
+        // The engine works on the frame from start to due; slices finish evenly in between.
+        Clock::time_point start{};
+        Clock::time_point due{};
+        bool filled = false;
+        bool complete = false;
+        uint32_t busyPolls = 0;
+    };
+
+    struct MockFrame
+    {
+        uint64_t timeStamp = 0;
+        uint32_t frameIdx = 0;
+        NV_ENC_PIC_TYPE type = NV_ENC_PIC_TYPE_P;
+        void* input = nullptr;
+        // A B-frame that precedes an open-GOP I-frame in display order but follows it in
+        // decode order (RASL in HEVC).
+        bool leading = false;
+    };
+
+    struct MockSession
+    {
+        NvencMockConfig config;
+        std::mt19937 random;
+        bool initialized = false;
+        bool hevc = false;
+        bool async = false;
+        uint32_t gopLength = 250;
+        uint32_t frameInterval = 1;
+        uint32_t idrPeriod = 250;
+        bool repeatParameterSets = false;
+        bool recoverySei = false;
+        uint32_t slices = 1;
+        uint32_t mbCount = 1;
+        // Frames submitted so far (display order).
+        uint64_t frameCount = 0;
+        // B-frames waiting for the next reference frame, in display order.
+        std::vector<MockFrame> held;
+        // Submitted output buffers not yet given a frame, in submission order.
+        std::deque<MockBitstream*> outputs;
+        std::set<MockBitstream*> buffers;
+        std::set<void*> events;
+        // Mapped inputs, and how many submitted frames each one holds until they complete: an
+        // input must not be submitted again or unmapped while the engine may still read it.
+        std::set<void*> mapped;
+        std::map<void*, uint32_t> inputsInFlight;
+        Clock::time_point engineFree{};
+        Clock::time_point lastDue{};
+        // Guards everything above; cv wakes the completion thread and blocking locks.
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::thread completion;
+        bool stop = false;
+    };
+
+    MockSession* ToSession(void* encoder)
+    {
+        return static_cast<MockSession*>(encoder);
+    }
+
+    struct BitWriter
+    {
+        std::vector<uint8_t> bytes;
+        uint32_t bitCount = 0;
+
+        void Bit(uint32_t bit)
+        {
+            if (bitCount % 8 == 0)
+            {
+                bytes.push_back(0);
+            }
+            if (bit)
+            {
+                bytes.back() |= static_cast<uint8_t>(0x80 >> (bitCount % 8));
+            }
+            ++bitCount;
+        }
+
+        void Bits(uint32_t value, uint32_t count)
+        {
+            while (count-- > 0)
+            {
+                Bit((value >> count) & 1);
+            }
+        }
+
+        void Ue(uint32_t value)
+        {
+            const uint64_t coded = static_cast<uint64_t>(value) + 1;
+            uint32_t length = 0;
+            while ((coded >> (length + 1)) != 0)
+            {
+                ++length;
+            }
+            Bits(0, length);
+            for (int i = static_cast<int>(length); i >= 0; --i)
+            {
+                Bit(static_cast<uint32_t>((coded >> i) & 1));
+            }
+        }
+
+        // rbsp_stop_one_bit plus alignment.
+        void Finish()
+        {
+            Bit(1);
+            while (bitCount % 8 != 0)
+            {
+                Bit(0);
+            }
+        }
+    };
+
+    // Appends a NAL unit with its start code, inserting emulation prevention bytes.
+    void AppendNal(std::vector<uint8_t>& out, const std::vector<uint8_t>& rbsp, bool longStartCode)
+    {
+        if (longStartCode)
+        {
+            out.push_back(0);
+        }
+        out.insert(out.end(), { 0, 0, 1 });
+        uint32_t zeros = 0;
+        for (uint8_t byte : rbsp)
+        {
+            if (zeros >= 2 && byte <= 3)
+            {
+                out.push_back(3);
+                zeros = 0;
+            }
+            out.push_back(byte);
+            zeros = byte == 0 ? zeros + 1 : 0;
+        }
+    }
+
+    std::vector<uint8_t> NalHeader(const MockSession* session, uint8_t type, uint8_t refIdc)
+    {
+        if (session->hevc)
+        {
+            return { static_cast<uint8_t>(type << 1), 0x01 };
+        }
+        return { static_cast<uint8_t>((refIdc << 5) | type) };
+    }
+
+    void AppendParameterSets(const MockSession* session, std::vector<uint8_t>& out)
+    {
+        // Main / High profile, level 4.0 headers with placeholder bodies.
+        if (session->hevc)
+        {
+            AppendNal(out, { 0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x78, 0x95, 0x98, 0x09 }, true);
+            AppendNal(out, { 0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90, 0x78, 0xa0, 0x03, 0xc0, 0x80, 0x10, 0xe5, 0x96, 0x66, 0x69, 0x24, 0xca, 0xe0, 0x10 }, true);
+            AppendNal(out, { 0x44, 0x01, 0xc1, 0x72, 0xb4, 0x62, 0x40 }, true);
+        }
+        else
+        {
+            AppendNal(out, { 0x67, 0x64, 0x00, 0x28, 0xac, 0x2c, 0xa4, 0x01, 0xe0, 0x08, 0x9f, 0x96, 0x01, 0x10 }, true);
+            AppendNal(out, { 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0 }, true);
+        }
+    }
+
+    // Recovery point SEI with a zero recovery count, as NVENC writes before open-GOP I-frames.
+    void AppendRecoveryPoint(const MockSession* session, std::vector<uint8_t>& out)
+    {
+        if (session->hevc)
+        {
+            // recovery_poc_cnt se(0), exact_match_flag 1, broken_link_flag 0, alignment.
+            AppendNal(out, { 0x4e, 0x01, 0x06, 0x01, 0xd0, 0x80 }, true);
+        }
+        else
+        {
+            // recovery_frame_cnt ue(0), exact_match_flag 1, broken_link_flag 0,
+            // changing_slice_group_idc 0, alignment.
+            AppendNal(out, { 0x06, 0x06, 0x01, 0xc4, 0x80 }, true);
+        }
+    }
+
+    void BuildAccessUnit(MockSession* session, const MockFrame& frame, MockBitstream* out)
+    {
+        const bool idr = frame.type == NV_ENC_PIC_TYPE_IDR;
+        const bool intra = idr || frame.type == NV_ENC_PIC_TYPE_I;
+        out->data.clear();
+        out->sliceEnds.clear();
+        if (idr || (intra && session->repeatParameterSets))
+        {
+            AppendParameterSets(session, out->data);
+        }
+        if (intra && !idr && session->recoverySei)
+        {
+            AppendRecoveryPoint(session, out->data);
+        }
+
+        uint64_t target = session->config.frameBytes;
+        if (intra)
+        {
+            target *= std::max<uint32_t>(session->config.intraScale, 1);
+        }
+        else if (frame.type == NV_ENC_PIC_TYPE_B)
+        {
+            target /= 2;
+        }
+        const uint32_t jitter = std::min<uint32_t>(session->config.sizeJitterPercent, 99);
+        if (jitter > 0)
+        {
+            const int32_t percent = static_cast<int32_t>(session->random() % (2 * jitter + 1)) - static_cast<int32_t>(jitter);
+            target = target * static_cast<uint64_t>(100 + percent) / 100;
+        }
+        const size_t sliceBytes = std::max<size_t>(static_cast<size_t>(target / session->slices), 16);
+
+        uint8_t type = 0;
+        uint8_t refIdc = 0;
+        if (session->hevc)
+        {
+            // IDR_W_RADL, CRA, TRAIL_R, RASL_N, TRAIL_N.
+            type = idr ? 19 : intra ? 21 : frame.type == NV_ENC_PIC_TYPE_P ? 1 : frame.leading ? 8 : 0;
+        }
+        else
+        {
+            type = idr ? 5 : 1;
+            refIdc = frame.type == NV_ENC_PIC_TYPE_B ? 0 : 3;
+        }
+        const uint32_t sliceType = intra ? 2 : frame.type == NV_ENC_PIC_TYPE_P ? 0 : 1;
+
+        std::vector<uint8_t> rbsp;
+        for (uint32_t slice = 0; slice < session->slices; ++slice)
+        {
+            BitWriter header;
+            const uint32_t firstMb = static_cast<uint32_t>(static_cast<uint64_t>(session->mbCount) * slice / session->slices);
+            if (session->hevc)
+            {
+                header.Bit(slice == 0);
+                if (type >= 16 && type <= 23)
+                {
+                    header.Bit(0); // no_output_of_prior_pics_flag
+                }
+                header.Ue(0); // slice_pic_parameter_set_id
+                if (slice > 0)
+                {
+                    header.Bits(firstMb & 0xffff, 16); // slice_segment_address
+                }
+                header.Ue(sliceType == 2 ? 2 : sliceType == 0 ? 1 : 0);
+            }
+            else
+            {
+                header.Ue(firstMb);
+                header.Ue(sliceType == 2 ? 7 : sliceType == 0 ? 5 : 6);
+                header.Ue(0); // pic_parameter_set_id
+                header.Bits(static_cast<uint32_t>(frame.frameIdx & 0xf), 4); // frame_num
+            }
+            header.Finish();
+
+            rbsp = NalHeader(session, type, refIdc);
+            rbsp.insert(rbsp.end(), header.bytes.begin(), header.bytes.end());
+            // Slice data stand-in: never zero, so it cannot form a start code.
+            const size_t payload = sliceBytes > rbsp.size() ? sliceBytes - rbsp.size() : 1;
+            for (size_t i = 0; i < payload; ++i)
+            {
+                rbsp.push_back(static_cast<uint8_t>(1 + session->random() % 255));
+            }
+            AppendNal(out->data, rbsp, slice == 0);
+            out->sliceEnds.push_back(static_cast<uint32_t>(out->data.size()));
+        }
+    }
+
+    // Gives the frame to the oldest output buffer still waiting for one and schedules it on
+    // the engine. Completion stays in decode order whatever the jitter.
+    void EmitFrame(MockSession* session, const MockFrame& frame)
+    {
+        if (session->outputs.empty())
+        {
+            return;
+        }
+        MockBitstream* out = session->outputs.front();
+        session->outputs.pop_front();
+        BuildAccessUnit(session, frame, out);
+        out->timeStamp = frame.timeStamp;
+        out->frameIdx = frame.frameIdx;
+        out->pictureType = frame.type;
+        out->input = frame.input;
+
+        const Clock::time_point now = Clock::now();
+        out->start = std::max(now, session->engineFree);
+        session->engineFree = out->start + std::chrono::microseconds(session->config.engineMicroseconds);
+        const uint32_t jitter = session->config.jitterMicroseconds > 0
+            ? static_cast<uint32_t>(session->random() % (session->config.jitterMicroseconds + 1))
+            : 0;
+        out->due = std::max(session->engineFree, now + std::chrono::microseconds(session->config.latencyMicroseconds))
+            + std::chrono::microseconds(jitter);
+        out->due = std::max(out->due, session->lastDue);
+        session->lastDue = out->due;
+        out->busyPolls = session->config.lockBusyPolls;
+        out->filled = true;
+        session->cv.notify_all();
+    }
+
+    // Encodes the held B-frames; the last one becomes a P-frame when nothing else will
+    // reference them (an IDR or the end of the stream follows).
+    void FlushHeld(MockSession* session, bool closeGop)
+    {
+        if (session->held.empty())
+        {
+            return;
+        }
+        if (closeGop)
+        {
+            MockFrame last = session->held.back();
+            session->held.pop_back();
+            last.type = NV_ENC_PIC_TYPE_P;
+            EmitFrame(session, last);
+        }
+        for (const MockFrame& frame : session->held)
+        {
+            EmitFrame(session, frame);
+        }
+        session->held.clear();
+    }
+
+    void SignalEvent(MockSession* session, void* event)
+    {
+        if (session->config.signalEvent)
+        {
+            session->config.signalEvent(event);
+            return;
+        }
+#ifdef _WIN32
+        SetEvent(static_cast<HANDLE>(event));
+#endif
+    }
+
+    // Stands in for the encoder engine: marks frames complete at their due time and signals
+    // their completion events.
+    void RunCompletion(MockSession* session)
+    {
+        std::unique_lock<std::mutex> lock(session->mutex);
+        while (!session->stop)
+        {
+            MockBitstream* next = nullptr;
+            for (MockBitstream* buffer : session->buffers)
+            {
+                if (buffer->filled && !buffer->complete && (!next || buffer->due < next->due))
+                {
+                    next = buffer;
+                }
+            }
+            if (!next)
+            {
+                session->cv.wait(lock);
+                continue;
+            }
+            if (Clock::now() < next->due)
+            {
+                session->cv.wait_until(lock, next->due);
+                continue;
+            }
+            next->complete = true;
+            auto inFlight = session->inputsInFlight.find(next->input);
+            if (inFlight != session->inputsInFlight.end() && --inFlight->second == 0)
+            {
+                session->inputsInFlight.erase(inFlight);
+            }
+            if (session->async && next->completionEvent)
+            {
+                SignalEvent(session, next->completionEvent);
+            }
+            session->cv.notify_all();
+        }
+    }
+
+    NVENCSTATUS NVENCAPI MockOpenEncodeSessionEx(NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS* params, void** encoder)
+    {
+        if (!params || !encoder)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        auto* session = new MockSession();
+        {
+            std::lock_guard<std::mutex> lock(g_configMutex);
+            session->config = g_config;
+        }
+        session->random.seed(session->config.seed);
+        session->completion = std::thread(RunCompletion, session);
+        *encoder = session;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockGetEncodePresetConfigEx(void* encoder, GUID, GUID, NV_ENC_TUNING_INFO, NV_ENC_PRESET_CONFIG* presetConfig)
+    {
+        if (!encoder || !presetConfig)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        NV_ENC_CONFIG& config = presetConfig->presetCfg;
+        config.gopLength = 250;
+        config.frameIntervalP = 1;
+        config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+        config.rcParams.averageBitRate = 5000000;
+        config.rcParams.maxBitRate = 0;
+        config.encodeCodecConfig.h264Config.idrPeriod = 250;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockGetEncodePresetConfig(void* encoder, GUID encodeGuid, GUID presetGuid, NV_ENC_PRESET_CONFIG* presetConfig)
+    {
+        return MockGetEncodePresetConfigEx(encoder, encodeGuid, presetGuid, NV_ENC_TUNING_INFO_UNDEFINED, presetConfig);
+    }
+
+    NVENCSTATUS NVENCAPI MockInitializeEncoder(void* encoder, NV_ENC_INITIALIZE_PARAMS* params)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session || !params)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->hevc = memcmp(&params->encodeGUID, &NV_ENC_CODEC_HEVC_GUID, sizeof(GUID)) == 0;
+        session->async = params->enableEncodeAsync != 0;
+        session->mbCount = std::max<uint32_t>(((params->encodeWidth + 15) / 16) * ((params->encodeHeight + 15) / 16), 1);
+        if (const NV_ENC_CONFIG* config = params->encodeConfig)
+        {
+            session->gopLength = config->gopLength == 0 ? 1 : config->gopLength;
+            session->frameInterval = static_cast<uint32_t>(std::max(config->frameIntervalP, 1));
+            uint32_t idrPeriod = 0;
+            uint32_t sliceMode = 0;
+            uint32_t sliceModeData = 0;
+            if (session->hevc)
+            {
+                const NV_ENC_CONFIG_HEVC& hevc = config->encodeCodecConfig.hevcConfig;
+                idrPeriod = hevc.idrPeriod;
+                session->repeatParameterSets = hevc.repeatSPSPPS != 0;
+                session->recoverySei = hevc.outputRecoveryPointSEI != 0;
+                sliceMode = hevc.sliceMode;
+                sliceModeData = hevc.sliceModeData;
+            }
+            else
+            {
+                const NV_ENC_CONFIG_H264& h264 = config->encodeCodecConfig.h264Config;
+                idrPeriod = h264.idrPeriod;
+                session->repeatParameterSets = h264.repeatSPSPPS != 0;
+                session->recoverySei = h264.outputRecoveryPointSEI != 0;
+                sliceMode = h264.sliceMode;
+                sliceModeData = h264.sliceModeData;
+            }
+            // IDRs only fall on GOP starts.
+            session->idrPeriod = idrPeriod == 0 || idrPeriod == NVENC_INFINITE_GOPLENGTH
+                ? session->gopLength
+                : std::max<uint32_t>(idrPeriod / session->gopLength, 1) * session->gopLength;
+            session->slices = sliceMode == 3 ? std::min<uint32_t>(std::max<uint32_t>(sliceModeData, 1), session->mbCount) : 1;
+        }
+        session->initialized = true;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockGetSequenceParams(void* encoder, NV_ENC_SEQUENCE_PARAM_PAYLOAD* payload)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session || !payload || !payload->spsppsBuffer || !payload->outSPSPPSPayloadSize)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        std::vector<uint8_t> sets;
+        AppendParameterSets(session, sets);
+        if (sets.size() > payload->inBufferSize)
+        {
+            return NV_ENC_ERR_NOT_ENOUGH_BUFFER;
+        }
+        std::memcpy(payload->spsppsBuffer, sets.data(), sets.size());
+        *payload->outSPSPPSPayloadSize = static_cast<uint32_t>(sets.size());
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockCreateBitstreamBuffer(void* encoder, NV_ENC_CREATE_BITSTREAM_BUFFER* params)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session || !params)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        auto* buffer = new MockBitstream();
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->buffers.insert(buffer);
+        params->bitstreamBuffer = buffer;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockDestroyBitstreamBuffer(void* encoder, NV_ENC_OUTPUT_PTR bitstream)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        auto* buffer = static_cast<MockBitstream*>(bitstream);
+        std::lock_guard<std::mutex> lock(session->mutex);
+        if (session->buffers.erase(buffer) == 0)
+        {
+            return NV_ENC_ERR_INVALID_PARAM;
+        }
+        session->outputs.erase(std::remove(session->outputs.begin(), session->outputs.end(), buffer), session->outputs.end());
+        delete buffer;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockRegisterAsyncEvent(void* encoder, NV_ENC_EVENT_PARAMS* params)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session || !params || !params->completionEvent)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+#ifndef _WIN32
+        if (!session->config.signalEvent)
+        {
+            return NV_ENC_ERR_UNSUPPORTED_PARAM;
+        }
+#endif
+        std::lock_guard<std::mutex> lock(session->mutex);
+        session->events.insert(params->completionEvent);
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockUnregisterAsyncEvent(void* encoder, NV_ENC_EVENT_PARAMS* params)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session || !params)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        std::lock_guard<std::mutex> lock(session->mutex);
+        return session->events.erase(params->completionEvent) > 0 ? NV_ENC_SUCCESS : NV_ENC_ERR_EVENT_NOT_REGISTERD;
+    }
+
+    // Input resources are opaque to the mock: registering and mapping hand back the pointer.
+    // Mappings are tracked, so reusing an input the engine may still read fails.
+    NVENCSTATUS NVENCAPI MockRegisterResource(void* encoder, NV_ENC_REGISTER_RESOURCE* params)
+    {
+        if (!encoder || !params)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        params->registeredResource = params->resourceToRegister ? params->resourceToRegister : encoder;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockUnregisterResource(void* encoder, NV_ENC_REGISTERED_PTR)
+    {
+        return encoder ? NV_ENC_SUCCESS : NV_ENC_ERR_INVALID_PTR;
+    }
+
+    NVENCSTATUS NVENCAPI MockMapInputResource(void* encoder, NV_ENC_MAP_INPUT_RESOURCE* params)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session || !params || !params->registeredResource)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        std::lock_guard<std::mutex> lock(session->mutex);
+        if (!session->mapped.insert(params->registeredResource).second)
+        {
+            return NV_ENC_ERR_INVALID_CALL;
+        }
+        params->mappedResource = params->registeredResource;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockUnmapInputResource(void* encoder, NV_ENC_INPUT_PTR input)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        std::lock_guard<std::mutex> lock(session->mutex);
+        if (session->mapped.count(input) == 0)
+        {
+            return NV_ENC_ERR_RESOURCE_NOT_MAPPED;
+        }
+        if (session->inputsInFlight.count(input) > 0)
+        {
+            return NV_ENC_ERR_INVALID_CALL;
+        }
+        session->mapped.erase(input);
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockEncodePicture(void* encoder, NV_ENC_PIC_PARAMS* pic)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session || !pic)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        std::lock_guard<std::mutex> lock(session->mutex);
+        if (!session->initialized)
+        {
+            return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+        }
+
+        auto* out = static_cast<MockBitstream*>(pic->outputBitstream);
+        if (out && session->buffers.count(out) == 0)
+        {
+            return NV_ENC_ERR_INVALID_PARAM;
+        }
+        if (pic->encodePicFlags & NV_ENC_PIC_FLAG_EOS)
+        {
+            FlushHeld(session, true);
+            if (out)
+            {
+                // Nothing left to encode: the EOS buffer completes empty after the rest.
+                out->data.clear();
+                out->sliceEnds.clear();
+                out->completionEvent = session->async ? pic->completionEvent : nullptr;
+                out->start = std::max(Clock::now(), session->lastDue);
+                out->due = out->start;
+                out->busyPolls = 0;
+                out->complete = false;
+                out->filled = true;
+                session->cv.notify_all();
+            }
+            return NV_ENC_SUCCESS;
+        }
+        if (!out || !pic->inputBuffer)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        if (session->async && session->events.count(pic->completionEvent) == 0)
+        {
+            return NV_ENC_ERR_EVENT_NOT_REGISTERD;
+        }
+        if (session->mapped.count(pic->inputBuffer) == 0)
+        {
+            return NV_ENC_ERR_RESOURCE_NOT_MAPPED;
+        }
+        if (session->inputsInFlight.count(pic->inputBuffer) > 0)
+        {
+            return NV_ENC_ERR_INVALID_CALL;
+        }
+        session->inputsInFlight[pic->inputBuffer]++;
+
+        out->filled = false;
+        out->complete = false;
+        out->completionEvent = session->async ? pic->completionEvent : nullptr;
+        session->outputs.push_back(out);
+
+        const uint64_t index = session->frameCount++;
+        MockFrame frame;
+        frame.timeStamp = pic->inputTimeStamp;
+        frame.input = pic->inputBuffer;
+        frame.frameIdx = static_cast<uint32_t>(index);
+        const uint64_t position = index % session->gopLength;
+        const bool forceIdr = (pic->encodePicFlags & NV_ENC_PIC_FLAG_FORCEIDR) != 0;
+        if (position == 0 || forceIdr)
+        {
+            // An IDR closes the GOP before it; the B-frames before an open-GOP I-frame follow it
+            // as leading pictures.
+            const bool idr = forceIdr || index % session->idrPeriod == 0;
+            frame.type = idr ? NV_ENC_PIC_TYPE_IDR : NV_ENC_PIC_TYPE_I;
+            if (idr)
+            {
+                FlushHeld(session, true);
+            }
+            EmitFrame(session, frame);
+            for (MockFrame& leading : session->held)
+            {
+                leading.leading = true;
+            }
+            FlushHeld(session, false);
+            return NV_ENC_SUCCESS;
+        }
+
+        const uint64_t next = index + 1;
+        const bool idrNext = next % session->gopLength == 0 && next % session->idrPeriod == 0;
+        if (position % session->frameInterval == 0 || idrNext)
+        {
+            frame.type = NV_ENC_PIC_TYPE_P;
+            EmitFrame(session, frame);
+            FlushHeld(session, false);
+            return NV_ENC_SUCCESS;
+        }
+
+        frame.type = NV_ENC_PIC_TYPE_B;
+        session->held.push_back(frame);
+        return NV_ENC_ERR_NEED_MORE_INPUT;
+    }
+
+    NVENCSTATUS NVENCAPI MockLockBitstream(void* encoder, NV_ENC_LOCK_BITSTREAM* params)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session || !params)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        std::unique_lock<std::mutex> lock(session->mutex);
+        auto* buffer = static_cast<MockBitstream*>(params->outputBitstream);
+        if (session->buffers.count(buffer) == 0)
+        {
+            return NV_ENC_ERR_INVALID_PARAM;
+        }
+
+        size_t slices = buffer->sliceEnds.size();
+        if (params->doNotWait)
+        {
+            if (buffer->busyPolls > 0)
+            {
+                buffer->busyPolls--;
+                return NV_ENC_ERR_LOCK_BUSY;
+            }
+            if (!buffer->filled)
+            {
+                return NV_ENC_ERR_LOCK_BUSY;
+            }
+            if (!buffer->complete)
+            {
+                // Slice readback: the slices finished so far are available.
+                const auto elapsed = Clock::now() - buffer->start;
+                const auto total = buffer->due - buffer->start;
+                slices = !params->sliceOffsets || total.count() <= 0 || elapsed.count() < 0
+                    ? 0
+                    : std::min<size_t>(static_cast<size_t>(buffer->sliceEnds.size() * elapsed.count() / total.count()), buffer->sliceEnds.size());
+                if (slices == 0)
+                {
+                    return NV_ENC_ERR_LOCK_BUSY;
+                }
+            }
+        }
+        else
+        {
+            session->cv.wait(lock, [session, buffer]()
+            {
+                return session->stop || session->buffers.count(buffer) == 0 || (buffer->filled && buffer->complete);
+            });
+            if (session->buffers.count(buffer) == 0 || !buffer->complete)
+            {
+                return NV_ENC_ERR_INVALID_CALL;
+            }
+        }
+
+        params->bitstreamBufferPtr = buffer->data.data();
+        params->bitstreamSizeInBytes = slices > 0 ? buffer->sliceEnds[slices - 1] : static_cast<uint32_t>(buffer->data.size());
+        params->hwEncodeStatus = buffer->complete ? 2 : 1;
+        params->numSlices = static_cast<uint32_t>(slices);
+        if (params->sliceOffsets)
+        {
+            for (size_t i = 0; i < slices; ++i)
+            {
+                params->sliceOffsets[i] = i == 0 ? 0 : buffer->sliceEnds[i - 1];
+            }
+        }
+        params->outputTimeStamp = buffer->timeStamp;
+        params->outputDuration = 1;
+        params->frameIdx = buffer->frameIdx;
+        params->pictureType = buffer->pictureType;
+        params->pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI MockUnlockBitstream(void* encoder, NV_ENC_OUTPUT_PTR bitstream)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        std::lock_guard<std::mutex> lock(session->mutex);
+        return session->buffers.count(static_cast<MockBitstream*>(bitstream)) > 0 ? NV_ENC_SUCCESS : NV_ENC_ERR_INVALID_PARAM;
+    }
+
+    NVENCSTATUS NVENCAPI MockDestroyEncoder(void* encoder)
+    {
+        MockSession* session = ToSession(encoder);
+        if (!session)
+        {
+            return NV_ENC_ERR_INVALID_PTR;
+        }
+        {
+            std::lock_guard<std::mutex> lock(session->mutex);
+            session->stop = true;
+        }
+        session->cv.notify_all();
+        session->completion.join();
+        for (MockBitstream* buffer : session->buffers)
+        {
+            delete buffer;
+        }
+        delete session;
+        return NV_ENC_SUCCESS;
+    }
+
+    bool ParseUnsigned(const std::string& text, uint32_t* value)
+    {
+        if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos)
+        {
+            return false;
+        }
+        const unsigned long long parsed = std::strtoull(text.c_str(), nullptr, 10);
+        if (parsed > UINT32_MAX)
+        {
+            return false;
+        }
+        *value = static_cast<uint32_t>(parsed);
+        return true;
+    }
+}
+
+void NvencMockConfigure(const NvencMockConfig& config)
+{
+    std::lock_guard<std::mutex> lock(g_configMutex);
+    g_config = config;
+}
+
+bool NvencMockParseConfig(const char* spec, NvencMockConfig* config)
+{
+    if (!spec || !config)
+    {
+        return false;
+    }
+    const struct
+    {
+        const char* name;
+        uint32_t NvencMockConfig::* field;
+    } fields[] = {
+        { "frameBytes", &NvencMockConfig::frameBytes },
+        { "intraScale", &NvencMockConfig::intraScale },
+        { "sizeJitterPercent", &NvencMockConfig::sizeJitterPercent },
+        { "latencyMicroseconds", &NvencMockConfig::latencyMicroseconds },
+        { "jitterMicroseconds", &NvencMockConfig::jitterMicroseconds },
+        { "engineMicroseconds", &NvencMockConfig::engineMicroseconds },
+        { "lockBusyPolls", &NvencMockConfig::lockBusyPolls },
+        { "seed", &NvencMockConfig::seed },
+    };
+
+    const std::string text(spec);
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        const size_t end = std::min(text.find_first_of(", ", pos), text.size());
+        const std::string item = text.substr(pos, end - pos);
+        pos = end + 1;
+        if (item.empty())
+        {
+            continue;
+        }
+        const size_t equals = item.find('=');
+        if (equals == std::string::npos)
+        {
+            return false;
+        }
+        const std::string key = item.substr(0, equals);
+        bool known = false;
+        for (const auto& field : fields)
+        {
+            if (key == field.name)
+            {
+                if (!ParseUnsigned(item.substr(equals + 1), &(config->*field.field)))
+                {
+                    return false;
+                }
+                known = true;
+                break;
+            }
+        }
+        if (!known)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+NVENCSTATUS NVENCAPI NvencMockCreateInstance(NV_ENCODE_API_FUNCTION_LIST* functionList)
+{
+    if (!functionList)
+    {
+        return NV_ENC_ERR_INVALID_PTR;
+    }
+    const uint32_t version = functionList->version;
+    std::memset(functionList, 0, sizeof(*functionList));
+    functionList->version = version;
+    functionList->nvEncOpenEncodeSessionEx = MockOpenEncodeSessionEx;
+    functionList->nvEncGetEncodePresetConfig = MockGetEncodePresetConfig;
+    functionList->nvEncGetEncodePresetConfigEx = MockGetEncodePresetConfigEx;
+    functionList->nvEncInitializeEncoder = MockInitializeEncoder;
+    functionList->nvEncGetSequenceParams = MockGetSequenceParams;
+    functionList->nvEncCreateBitstreamBuffer = MockCreateBitstreamBuffer;
+    functionList->nvEncDestroyBitstreamBuffer = MockDestroyBitstreamBuffer;
+    functionList->nvEncRegisterAsyncEvent = MockRegisterAsyncEvent;
+    functionList->nvEncUnregisterAsyncEvent = MockUnregisterAsyncEvent;
+    functionList->nvEncRegisterResource = MockRegisterResource;
+    functionList->nvEncUnregisterResource = MockUnregisterResource;
+    functionList->nvEncMapInputResource = MockMapInputResource;
+    functionList->nvEncUnmapInputResource = MockUnmapInputResource;
+    functionList->nvEncEncodePicture = MockEncodePicture;
+    functionList->nvEncLockBitstream = MockLockBitstream;
+    functionList->nvEncUnlockBitstream = MockUnlockBitstream;
+    functionList->nvEncDestroyEncoder = MockDestroyEncoder;
+    return NV_ENC_SUCCESS;
+}
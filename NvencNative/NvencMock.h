@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "nvEncodeAPI.h"
+
+// Stand-in for nvEncodeAPI64.dll: a function table that answers like an NVENC session but
+// emits synthetic Annex B access units, so the async slots, writer thread and muxer can be
+// driven without a GPU. The GOP follows the NV_ENC_CONFIG given to nvEncInitializeEncoder
+// (gopLength, frameIntervalP, idrPeriod, repeatSPSPPS, outputRecoveryPointSEI, sliceMode 3),
+// B-frames come back in decode order into the output buffers queued behind them, and
+// completion events are signalled from a thread standing in for the encoder engine.
+// Input mappings are checked: a frame's input must stay mapped, and must not be submitted
+// again, until the frame is complete (NV_ENC_ERR_INVALID_CALL otherwise).
+// Parameter sets and slice data are not decodable: only the NAL structure the muxer reads
+// (NAL types, first_mb_in_slice / slice_type, recovery point SEI) is real.
+struct NvencMockConfig
+{
+    // Average P-frame size in bytes; I-frames are intraScale times that, B-frames half.
+    uint32_t frameBytes = 40000;
+    uint32_t intraScale = 4;
+    // Each frame's size varies randomly by up to this percentage.
+    uint32_t sizeJitterPercent = 25;
+    // A frame completes latencyMicroseconds after the encoder gets it (a B-frame only once its
+    // reference frame is in), plus up to jitterMicroseconds. Frames complete in decode order.
+    uint32_t latencyMicroseconds = 2000;
+    uint32_t jitterMicroseconds = 500;
+    // Engine occupancy per frame: at most one frame completes every engineMicroseconds.
+    uint32_t engineMicroseconds = 1000;
+    // Non-blocking locks answer NV_ENC_ERR_LOCK_BUSY this many times per frame before they
+    // look at its progress; blocking locks are unaffected.
+    uint32_t lockBusyPolls = 0;
+    uint32_t seed = 1;
+    // Signals a registered completion event. Windows defaults to SetEvent; elsewhere the
+    // caller supplies it, since the handles are whatever its completion signals hand out.
+    void (*signalEvent)(void* completionEvent) = nullptr;
+};
+
+// Applies to sessions opened afterwards.
+void NvencMockConfigure(const NvencMockConfig& config);
+
+// Reads "key=value" pairs separated by commas or spaces into config, keys named like the
+// fields (frameBytes=60000,latencyMicroseconds=8000,...). Returns false on an unknown key or
+// a malformed value.
+bool NvencMockParseConfig(const char* spec, NvencMockConfig* config);
+
+// Same contract as NvEncodeAPICreateInstance.
+NVENCSTATUS NVENCAPI NvencMockCreateInstance(NV_ENCODE_API_FUNCTION_LIST* functionList);
@@ -0,0 +1,84 @@
+// Load test of the session code (NvencSession.cpp) against the mock NVENC table: frames go
+// through the input ring, the async slots and their harvest threads, the segment stitcher,
+// the writer thread and the muxer as in a render, only without the texture copy. Prints the
+// pipeline's depth, stalls and latency; the exit code is non-zero when the run fails or the
+// output is missing frames.
+//
+//   nvenc_mock_load [frames] [hevc 0|1] [B-frames] [open GOP 0|1] [sessions]
+//                   [layout 0 standard|1 fragmented|2 faststart] [output] [mock spec]
+//
+// The mock spec is NvencMockParseConfig's, e.g. latencyMicroseconds=8000,lockBusyPolls=2.
+
+#include "NvencSessionTestSupport.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace NvencCore;
+using namespace NvencTest;
+
+int main(int argc, char** argv)
+{
+    const uint64_t frames = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1800;
+    MockSessionOptions options;
+    options.codec = argc > 2 && atoi(argv[2]) != 0 ? 1 : 0;
+    options.bFrames = argc > 3 ? atoi(argv[3]) : 0;
+    options.openGop = argc > 4 ? atoi(argv[4]) : 0;
+    options.sessions = argc > 5 ? std::min(std::max(atoi(argv[5]), 1), kMaxSegmentSessions) : 1;
+    const int layout = argc > 6 ? atoi(argv[6]) : 0;
+    const char* output = argc > 7 ? argv[7] : "nvenc_mock_load.mp4";
+    NvencMockConfig config;
+    if (frames == 0 || (argc > 8 && !NvencMockParseConfig(argv[8], &config)))
+    {
+        printf("usage: nvenc_mock_load [frames] [hevc 0|1] [B-frames] [open GOP 0|1] [sessions] [layout] [output] [mock spec]\n");
+        return 2;
+    }
+    ConfigureMock(config);
+
+    auto* state = new SessionState();
+    state->outputPath = WidePath(output);
+    state->logEnabled = getenv("NVENC_BENCH_LOG") != nullptr;
+    state->fragmented = layout == 1;
+    state->faststart = layout == 2;
+    state->expectedFrameCount = frames;
+    state->interleaveWindow = 500 * 90;
+    state->queueBudget = 512ull << 20;
+    state->audioInitialized = true;
+    state->audioSampleRate = 48000;
+    state->audioChannels = 2;
+    state->audioSpecificConfig = BuildAacSpecificConfig(48000, 2);
+
+    const auto start = std::chrono::steady_clock::now();
+    bool ok = OpenMockSessions(state, options);
+    std::mt19937 random(1);
+    uint64_t audioFrames = 0;
+    for (uint64_t frame = 0; ok && frame < frames; ++frame)
+    {
+        ok = EncodeMockFrame(state) && QueueAudioUpTo(state, frame, options.fps, &audioFrames, nullptr, &random);
+    }
+    ok = ok && FlushSessions(state) && FinalizeMp4(state);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Every frame must have reached the file.
+    const uint64_t written = state->fragmented
+        ? state->fragmentVideoTime / std::max<uint32_t>(VideoFrameDuration(state), 1)
+        : state->sampleSizes.size();
+    if (ok && written != frames)
+    {
+        SetError(state, L"frames written: " + std::to_wstring(written));
+        ok = false;
+    }
+
+    std::string error(state->lastError.begin(), state->lastError.end());
+    printf("%s frames=%llu seconds=%.3f fps=%.0f async=%d depth=%u min=%u peak=%u resizes=%u stalls=%llu input waits=%llu latency us=%llu segments=%llu%s%s\n",
+        ok ? "ok" : "failed",
+        static_cast<unsigned long long>(frames), seconds, frames / seconds,
+        state->asyncEnabled ? 1 : 0, state->asyncDepth, state->asyncMinDepth, state->asyncPeakDepth, state->asyncResizes,
+        static_cast<unsigned long long>(state->asyncStalls), static_cast<unsigned long long>(state->inputWaits),
+        static_cast<unsigned long long>(state->asyncCompletions > 0 ? state->asyncLatencyUs / state->asyncCompletions : 0),
+        static_cast<unsigned long long>(state->segmentsStitched),
+        error.empty() ? "" : " error=", error.c_str());
+
+    DestroyMockSessions(state, false);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,129 @@
+// Drives the core without an encoder: synthetic Annex B access units and AAC-sized audio
+// payloads go through ProcessEncodedBitstream / QueueSample, the writer thread and
+// FinalizeMp4, so the muxer's hot paths can be run under perf or the sanitizers. With more
+// than one session, GOP-long segments are produced by that many threads at once and joined by
+// the segment stitcher; each slice payload starts with its frame number so the output order
+// can be checked.
+//
+//   nvenc_mux_bench [frames] [hevc 0|1] [layout 0 standard|1 fragmented|2 faststart]
+//                   [backend 0 standard|1 queued|2 mapped] [output] [sessions]
+
+#include "NvencTestSupport.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace NvencCore;
+using namespace NvencTest;
+
+namespace
+{
+    const int kFps = 30;
+    const int kGop = 60;
+
+    // Slice sizes of a 12 Mbps 1080p stream: IDRs four times the size of P frames.
+    const size_t kIdrBytes = 160000;
+    const size_t kFrameBytes = 40000;
+    const size_t kJitterBytes = 8000;
+}
+
+int main(int argc, char** argv)
+{
+    const uint64_t frames = argc > 1 ? strtoull(argv[1], nullptr, 10) : 3000;
+    const bool hevc = argc > 2 && atoi(argv[2]) != 0;
+    const int layout = argc > 3 ? atoi(argv[3]) : 0;
+    const int backend = argc > 4 ? atoi(argv[4]) : 0;
+    const char* output = argc > 5 ? argv[5] : "nvenc_mux_bench.mp4";
+    const uint32_t sessions = argc > 6 ? static_cast<uint32_t>(std::max(atoi(argv[6]), 1)) : 1;
+
+    auto* state = new MuxerState();
+    state->outputPath = WidePath(output);
+    state->logEnabled = getenv("NVENC_BENCH_LOG") != nullptr;
+    state->width = 1920;
+    state->height = 1080;
+    state->fps = kFps;
+    state->gopLength = kGop;
+    state->videoBitrate = 12000000;
+    state->fragmented = layout == 1;
+    state->faststart = layout == 2;
+    state->expectedFrameCount = frames;
+    state->interleaveWindow = 500 * 90;
+    state->fileBackend = backend >= 0 && backend <= 2 ? static_cast<FileBackendKind>(backend) : FileBackendKind::Standard;
+    state->queueBudget = 512ull << 20;
+    state->audioInitialized = true;
+    state->audioSampleRate = 48000;
+    state->audioChannels = 2;
+    state->audioSpecificConfig = BuildAacSpecificConfig(48000, 2);
+
+    const auto start = std::chrono::steady_clock::now();
+    bool ok = InitializeMp4Writer(state, hevc, {});
+    std::mt19937 random(1);
+    std::vector<uint8_t> accessUnit;
+    uint64_t audioFrames = 0;
+    uint64_t bytes = 0;
+    if (sessions > 1 && ok)
+    {
+        // The writer is started up front, as the harvest threads of a real run do.
+        StartWriterThread(state);
+        BeginSegments(state, kGop);
+        SegmentStream stream;
+        stream.frames = frames;
+        stream.segmentFrames = kGop;
+        stream.hevc = hevc;
+        stream.idrBytes = kIdrBytes;
+        stream.frameBytes = kFrameBytes;
+        stream.jitterBytes = kJitterBytes;
+        std::vector<std::thread> producers;
+        std::vector<char> produced(sessions, 0);
+        std::vector<uint64_t> producedBytes(sessions, 0);
+        for (uint32_t i = 0; i < sessions; ++i)
+        {
+            producers.emplace_back([&, i]()
+            {
+                produced[i] = ProduceSegments(state, stream, i, sessions, i + 1, &producedBytes[i]);
+            });
+        }
+        for (uint64_t frame = 0; ok && frame < frames; ++frame)
+        {
+            ok = QueueAudioUpTo(state, frame, kFps, &audioFrames, &bytes, &random);
+        }
+        for (std::thread& producer : producers)
+        {
+            producer.join();
+        }
+        for (uint32_t i = 0; i < sessions; ++i)
+        {
+            ok = ok && produced[i] != 0;
+            bytes += producedBytes[i];
+        }
+        ok = ok && FinishSegments(state);
+    }
+    for (uint64_t frame = 0; sessions == 1 && ok && frame < frames; ++frame)
+    {
+        const bool idr = frame % kGop == 0;
+        BuildAccessUnit(accessUnit, frame, idr, hevc, (idr ? kIdrBytes : kFrameBytes) + random() % kJitterBytes, &random);
+        bytes += accessUnit.size();
+        ok = ProcessEncodedBitstream(state, accessUnit.data(), accessUnit.size(), frame)
+            && QueueAudioUpTo(state, frame, kFps, &audioFrames, &bytes, &random);
+    }
+    ok = ok && FinalizeMp4(state);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::string error(state->lastError.begin(), state->lastError.end());
+    printf("%s frames=%llu audio=%llu bytes=%llu seconds=%.3f fps=%.0f MB/s=%.1f pool alloc=%llu reuse=%llu queue peak=%llu throttle us=%llu segment peak=%llu%s%s\n",
+        ok ? "ok" : "failed",
+        static_cast<unsigned long long>(frames), static_cast<unsigned long long>(audioFrames),
+        static_cast<unsigned long long>(bytes), seconds, frames / seconds, bytes / seconds / (1 << 20),
+        static_cast<unsigned long long>(state->samplePool.allocated), static_cast<unsigned long long>(state->samplePool.reused),
+        static_cast<unsigned long long>(state->queuePeakBytes.load()), static_cast<unsigned long long>(state->throttleMicroseconds.load()),
+        static_cast<unsigned long long>(state->segmentBufferedPeak),
+        error.empty() ? "" : " error=", error.c_str());
+
+    StopWriterThread(state);
+    state->file.Close();
+    CloseJournal(state, false);
+    CloseLog(state);
+    delete state;
+    return ok ? 0 : 1;
+}
@@ -6,6 +6,9 @@ struct ID3D11Device;
 struct ID3D11Texture2D;
 
 extern "C" {
+    // sessions > 1 splits the frame range into IDR-period segments dealt round-robin to that
+    // many NVENC sessions (async encode only, at most 3) and stitches their output into the
+    // one MP4. Falls back to fewer sessions when the driver refuses more.
     __declspec(dllexport) void* NvencCreate(
         ID3D11Device* device,
         int width,
@@ -20,8 +23,21 @@ extern "C" {
         int bufferFormat,
         int hevcAsync,
         int enableDebugLog,
+        int containerMode,
+        int expectedFrameCount,
+        int interleaveMs,
+        int fileBackend,
+        int resume,
+        int queueLimitMb,
+        int bFrames,
+        int openGop,
+        int sessions,
         const wchar_t* outputPath);
 
+    // With resume set, NvencCreate continues the interrupted render journaled beside
+    // outputPath. Returns the frame to restart encoding from (0 for a new file).
+    __declspec(dllexport) int NvencGetResumeFrame(void* handle);
+
     __declspec(dllexport) int NvencEncode(void* handle, ID3D11Texture2D* texture);
 
     __declspec(dllexport) int NvencWriteAudio(void* handle, const float* samples, int sampleCount, int sampleRate, int channels);
@@ -31,4 +47,9 @@ extern "C" {
     __declspec(dllexport) void NvencDestroy(void* handle);
 
     __declspec(dllexport) const wchar_t* NvencGetLastError(void* handle);
+
+    // Rebuilds moov for an output whose render never reached NvencFinalize, using the
+    // "<output>.nvjournal" sidecar. Returns the number of video frames recovered,
+    // 0 if the file was already complete, or -1 on failure.
+    __declspec(dllexport) int NvencRepair(const wchar_t* outputPath);
 }
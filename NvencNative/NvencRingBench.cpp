@@ -0,0 +1,184 @@
+// Writer queue contention: one video and one audio producer push samples to a single consumer,
+// once through MpscRing (the writer's queue) and once through the mutex + deque + condition
+// variable it replaced. Producers either push as fast as they can or are paced like an encode
+// (audio at 3/2 the video rate). The consumer checks that each producer's samples arrive
+// complete and in order; the exit code is non-zero when they don't.
+//
+//   nvenc_ring_bench [video samples] [video interval us, 0 = saturated]
+
+#include "NvencCore.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace NvencCore;
+
+namespace
+{
+    struct Item
+    {
+        bool audio = false;
+        uint64_t sequence = 0;
+        std::vector<uint8_t> data;
+    };
+
+    class LockedQueue
+    {
+    public:
+        void Push(Item& item)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(std::move(item));
+            cv.notify_one();
+        }
+
+        // Blocks until an item arrives; false once closed and empty.
+        bool Pop(Item& item)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return !items.empty() || closed; });
+            if (items.empty())
+            {
+                return false;
+            }
+            item = std::move(items.front());
+            items.pop_front();
+            return true;
+        }
+
+        void Close()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            cv.notify_one();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<Item> items;
+        bool closed = false;
+    };
+
+    class RingQueue
+    {
+    public:
+        void Push(Item& item)
+        {
+            for (uint32_t attempt = 0; !ring.TryPush(item); ++attempt)
+            {
+                if (attempt < 64)
+                {
+                    std::this_thread::yield();
+                }
+                else
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        }
+
+        bool Pop(Item& item)
+        {
+            while (!ring.TryPop(item))
+            {
+                if (closed.load() && ring.Idle())
+                {
+                    return false;
+                }
+                std::this_thread::yield();
+            }
+            return true;
+        }
+
+        void Close()
+        {
+            closed.store(true);
+        }
+
+    private:
+        MpscRing<Item> ring{ 1024 };
+        std::atomic<bool> closed{ false };
+    };
+
+    struct Result
+    {
+        double seconds = 0;
+        double pushNanoseconds = 0;
+        bool ordered = true;
+    };
+
+    template <typename Queue>
+    Result Run(uint64_t videoSamples, uint32_t intervalMicroseconds)
+    {
+        Queue queue;
+        const uint64_t audioSamples = videoSamples * 3 / 2;
+        std::atomic<uint64_t> pushNanoseconds{ 0 };
+        auto produce = [&](bool audio, uint64_t count, uint32_t interval)
+        {
+            std::vector<uint8_t> payload(audio ? 400 : 4000, 1);
+            uint64_t spent = 0;
+            for (uint64_t i = 0; i < count; ++i)
+            {
+                Item item{ audio, i, payload };
+                const auto start = std::chrono::steady_clock::now();
+                queue.Push(item);
+                spent += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+                if (interval > 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(interval));
+                }
+            }
+            pushNanoseconds.fetch_add(spent);
+        };
+
+        Result result;
+        const auto start = std::chrono::steady_clock::now();
+        std::thread consumer([&]()
+        {
+            uint64_t next[2] = {};
+            Item item;
+            while (queue.Pop(item))
+            {
+                uint64_t& expected = next[item.audio ? 1 : 0];
+                result.ordered = result.ordered && item.sequence == expected;
+                expected = item.sequence + 1;
+            }
+            result.ordered = result.ordered && next[0] == videoSamples && next[1] == audioSamples;
+        });
+        std::thread video(produce, false, videoSamples, intervalMicroseconds);
+        std::thread audio(produce, true, audioSamples, intervalMicroseconds * 2 / 3);
+        video.join();
+        audio.join();
+        queue.Close();
+        consumer.join();
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.pushNanoseconds = static_cast<double>(pushNanoseconds.load()) / static_cast<double>(videoSamples + audioSamples);
+        return result;
+    }
+
+    bool Report(const char* name, const Result& result, uint64_t samples)
+    {
+        printf("  %-14s %8.1f ns/push %10.0f samples/s%s\n", name, result.pushNanoseconds,
+            static_cast<double>(samples) / result.seconds, result.ordered ? "" : "  LOST OR REORDERED");
+        return result.ordered;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const uint64_t videoSamples = argc > 1 ? strtoull(argv[1], nullptr, 10) : 200000;
+    const uint32_t interval = argc > 2 ? static_cast<uint32_t>(atoi(argv[2])) : 0;
+    if (videoSamples == 0)
+    {
+        printf("usage: nvenc_ring_bench [video samples] [video interval us, 0 = saturated]\n");
+        return 2;
+    }
+    const uint64_t samples = videoSamples + videoSamples * 3 / 2;
+    printf("%llu video + %llu audio samples, %s, %u hardware threads\n",
+        static_cast<unsigned long long>(videoSamples), static_cast<unsigned long long>(samples - videoSamples),
+        interval > 0 ? "paced" : "saturated", std::thread::hardware_concurrency());
+    bool ok = Report("mpsc ring", Run<RingQueue>(videoSamples, interval), samples);
+    ok = Report("mutex + deque", Run<LockedQueue>(videoSamples, interval), samples) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+// Start-code search throughput: the byte loop ParseAnnexB used before the vector scanners,
+// the scalar, SSE2 and AVX2 scanners on their own, and ParseAnnexB as it dispatches, over
+// I-frame-sized and P-frame-sized synthetic payloads. Every variant must find the same NAL
+// units as the byte loop; the exit code is non-zero when one doesn't.
+//
+//   nvenc_scan_bench [iterations] [I-frame bytes] [P-frame bytes]
+
+#include "NvencCore.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+using namespace NvencCore;
+
+namespace
+{
+    // ParseAnnexB before the vector scanners, kept as the reference.
+    void ParseAnnexBByteLoop(const uint8_t* data, size_t size, bool hevc, std::vector<NalUnit>& units)
+    {
+        units.clear();
+        size_t i = 0;
+        auto findStart = [&](size_t from) -> size_t
+        {
+            for (size_t j = from; j + 3 < size; ++j)
+            {
+                if (data[j] == 0 && data[j + 1] == 0)
+                {
+                    if (data[j + 2] == 1)
+                    {
+                        return j;
+                    }
+                    if (j + 3 < size && data[j + 2] == 0 && data[j + 3] == 1)
+                    {
+                        return j;
+                    }
+                }
+            }
+            return size;
+        };
+        while (i < size)
+        {
+            size_t start = findStart(i);
+            if (start >= size)
+            {
+                break;
+            }
+            size_t scSize = (data[start + 2] == 1) ? 3 : 4;
+            size_t nalStart = start + scSize;
+            size_t next = findStart(nalStart);
+            size_t nalEnd = (next < size) ? next : size;
+            if (nalEnd > nalStart)
+            {
+                uint8_t type = hevc ? ((data[nalStart] >> 1) & 0x3F) : (data[nalStart] & 0x1F);
+                units.push_back({ data + nalStart, nalEnd - nalStart, type });
+            }
+            i = nalEnd;
+        }
+    }
+
+    // An access unit as NVENC emits it: AUD, SPS, PPS, then slices of random payload with
+    // emulation prevention applied, so 00 00 0x never occurs inside a NAL.
+    std::vector<uint8_t> BuildPayload(size_t bytes, int slices, std::mt19937& random)
+    {
+        std::vector<uint8_t> out;
+        out.reserve(bytes + bytes / 64);
+        auto appendNal = [&](std::initializer_list<uint8_t> header, size_t payload)
+        {
+            static const uint8_t kStartCode[] = { 0, 0, 0, 1 };
+            out.insert(out.end(), kStartCode, kStartCode + 4);
+            out.insert(out.end(), header);
+            int zeros = 0;
+            for (size_t i = 0; i < payload; ++i)
+            {
+                uint8_t byte = static_cast<uint8_t>(random());
+                if (zeros >= 2 && byte <= 3)
+                {
+                    out.push_back(3);
+                    zeros = 0;
+                }
+                out.push_back(byte);
+                zeros = byte == 0 ? zeros + 1 : 0;
+            }
+            out.push_back(0x80); // rbsp_stop_one_bit
+        };
+        appendNal({ 0x09 }, 1);
+        appendNal({ 0x67, 0x64, 0x00, 0x33 }, 12);
+        appendNal({ 0x68 }, 4);
+        for (int s = 0; s < slices; ++s)
+        {
+            appendNal({ 0x65, 0x88 }, bytes / static_cast<size_t>(slices));
+        }
+        return out;
+    }
+
+    double Seconds(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool SameUnits(const std::vector<NalUnit>& a, const std::vector<NalUnit>& b)
+    {
+        if (a.size() != b.size())
+        {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            if (a[i].data != b[i].data || a[i].size != b[i].size || a[i].type != b[i].type)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Splits the way ParseAnnexB does, but with the given scanner instead of the dispatched
+    // one, so each scanner can be timed and checked on its own.
+    template <size_t (*Scan)(const uint8_t*, size_t, size_t)>
+    void ParseWithScanner(const uint8_t* data, size_t size, bool hevc, std::vector<NalUnit>& units)
+    {
+        auto find = [&](size_t from) -> size_t
+        {
+            const size_t pos = Scan(data, size, from);
+            if (pos >= size)
+            {
+                return size;
+            }
+            if (pos > from && data[pos - 1] == 0)
+            {
+                return pos - 1;
+            }
+            return pos + 3 < size ? pos : size;
+        };
+        units.clear();
+        size_t start = find(0);
+        while (start < size)
+        {
+            const size_t nalStart = start + ((data[start + 2] == 1) ? 3 : 4);
+            const size_t next = find(nalStart);
+            if (next > nalStart)
+            {
+                const uint8_t type = hevc ? ((data[nalStart] >> 1) & 0x3F) : (data[nalStart] & 0x1F);
+                units.push_back({ data + nalStart, next - nalStart, type });
+            }
+            start = next;
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const int iterations = argc > 1 ? atoi(argv[1]) : 50;
+    const size_t iBytes = argc > 2 ? static_cast<size_t>(atoll(argv[2])) : 8u << 20;
+    const size_t pBytes = argc > 3 ? static_cast<size_t>(atoll(argv[3])) : 200u << 10;
+    if (iterations <= 0 || iBytes == 0 || pBytes == 0)
+    {
+        printf("usage: nvenc_scan_bench [iterations] [I-frame bytes] [P-frame bytes]\n");
+        return 2;
+    }
+
+    struct Variant
+    {
+        const char* name;
+        void (*parse)(const uint8_t*, size_t, bool, std::vector<NalUnit>&);
+    };
+    std::vector<Variant> variants = {
+        { "byte loop", ParseAnnexBByteLoop },
+        { "scalar", ParseWithScanner<ScanStartCodeScalar> },
+    };
+#if defined(_M_X64) || defined(__x86_64__)
+    variants.push_back({ "sse2", ParseWithScanner<ScanStartCodeSse2> });
+    if (CpuHasAvx2())
+    {
+        variants.push_back({ "avx2", ParseWithScanner<ScanStartCodeAvx2> });
+    }
+#endif
+    variants.push_back({ "ParseAnnexB", ParseAnnexB });
+
+    std::mt19937 random(7);
+    struct Frame
+    {
+        const char* name;
+        std::vector<uint8_t> payload;
+        int repeat;
+    };
+    // Both kinds get about the same number of bytes per run, so the timings compare directly.
+    const int pRepeat = static_cast<int>(std::max<size_t>(1, iBytes / pBytes));
+    Frame frames[] = {
+        { "I-frame", BuildPayload(iBytes, 4, random), 1 },
+        { "P-frame", BuildPayload(pBytes, 1, random), pRepeat },
+    };
+
+    bool ok = true;
+    std::vector<NalUnit> reference;
+    std::vector<NalUnit> units;
+    for (const Frame& frame : frames)
+    {
+        const uint8_t* data = frame.payload.data();
+        const size_t size = frame.payload.size();
+        ParseAnnexBByteLoop(data, size, false, reference);
+        printf("%s: %zu bytes, %zu NAL units\n", frame.name, size, reference.size());
+        for (const Variant& variant : variants)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i)
+            {
+                for (int r = 0; r < frame.repeat; ++r)
+                {
+                    variant.parse(data, size, false, units);
+                }
+            }
+            const double seconds = Seconds(start);
+            const double bytes = static_cast<double>(size) * frame.repeat * iterations;
+            const bool same = SameUnits(units, reference);
+            ok = ok && same;
+            printf("  %-12s %8.2f GB/s %9.1f us/frame%s\n", variant.name, bytes / seconds / 1e9,
+                seconds * 1e6 / (static_cast<double>(frame.repeat) * iterations), same ? "" : "  MISMATCH");
+        }
+    }
+    return ok ? 0 : 1;
+}
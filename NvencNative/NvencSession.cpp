@@ -0,0 +1,1176 @@
+#include "NvencSession.h"
+
+#include <cstring>
+
+namespace NvencCore
+{
+    bool ConsumeAsyncBitstream(SessionState* state, size_t index);
+    void ReleaseInputSurface(SessionState* state, uint64_t timeStamp);
+    bool DeliverBitstream(SessionState* state, const uint8_t* data, size_t size, uint64_t timeStamp,
+        bool firstPiece = true, bool lastPiece = true);
+
+    // GUID has no operator== outside Windows' headers.
+    bool SameGuid(const GUID& a, const GUID& b)
+    {
+        return memcmp(&a, &b, sizeof(GUID)) == 0;
+    }
+
+    bool CheckStatus(SessionState* state, NVENCSTATUS status, const wchar_t* message)
+    {
+        if (status == NV_ENC_SUCCESS)
+        {
+            return true;
+        }
+
+        std::wstring error = message;
+        error += L" (";
+        error += std::to_wstring(static_cast<int>(status));
+        error += L")";
+        SetError(state, error);
+        return false;
+    }
+
+    // Parameter sets the session will emit, packed like the in-band ones in
+    // ProcessEncodedBitstream. Empty when the driver doesn't report them.
+    std::vector<uint8_t> QuerySessionCodecPrivate(SessionState* state)
+    {
+        if (!state->session || !state->funcs.nvEncGetSequenceParams)
+        {
+            return {};
+        }
+        std::vector<uint8_t> payload(1024);
+        uint32_t payloadSize = 0;
+        NV_ENC_SEQUENCE_PARAM_PAYLOAD params = {};
+        params.version = NV_ENC_SEQUENCE_PARAM_PAYLOAD_VER;
+        params.inBufferSize = static_cast<uint32_t>(payload.size());
+        params.spsppsBuffer = payload.data();
+        params.outSPSPPSPayloadSize = &payloadSize;
+        if (state->funcs.nvEncGetSequenceParams(state->session, &params) != NV_ENC_SUCCESS || payloadSize == 0 || payloadSize > payload.size())
+        {
+            return {};
+        }
+
+        return CodecPrivateFromAnnexB(payload.data(), payloadSize, SameGuid(state->initParams.encodeGUID, NV_ENC_CODEC_HEVC_GUID));
+    }
+
+    // Hands an encoded frame (or piece of one) to the muxer, through the owner's stitcher when
+    // the frame range is split across sessions.
+    bool DeliverBitstream(SessionState* state, const uint8_t* data, size_t size, uint64_t timeStamp,
+        bool firstPiece, bool lastPiece)
+    {
+        SessionState* owner = state->segmentOwner ? state->segmentOwner : state;
+        if (owner->segmentFrames == 0)
+        {
+            return ProcessEncodedBitstream(state, data, size, timeStamp, firstPiece, lastPiece);
+        }
+        if (!StitchSegmentBitstream(owner, data, size, timeStamp, firstPiece, lastPiece))
+        {
+            if (state != owner)
+            {
+                SetError(state, owner->lastError);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // How long sub-frame readback polls without new slices before it waits for the rest of
+    // the frame in a blocking lock, so a slow frame doesn't keep the render thread spinning.
+    const auto kSlicePollWindow = std::chrono::milliseconds(1);
+
+    // Sub-frame readback: polls the frame's output buffer and hands on each run of slices the
+    // encoder has finished, so conversion and writing overlap the rest of the encode.
+    bool StreamEncodedSlices(SessionState* state)
+    {
+        size_t handedOn = 0;
+        auto lastProgress = std::chrono::steady_clock::now();
+        for (;;)
+        {
+            NV_ENC_LOCK_BITSTREAM lockBitstream{};
+            lockBitstream.version = NV_ENC_LOCK_BITSTREAM_VER;
+            lockBitstream.outputBitstream = state->bitstream;
+            lockBitstream.sliceOffsets = state->sliceOffsets.data();
+            lockBitstream.doNotWait = std::chrono::steady_clock::now() - lastProgress < kSlicePollWindow ? 1 : 0;
+            auto status = state->funcs.nvEncLockBitstream(state->session, &lockBitstream);
+            if (status == NV_ENC_ERR_LOCK_BUSY && lockBitstream.doNotWait)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            if (!CheckStatus(state, status, L"nvEncLockBitstream failed"))
+            {
+                return false;
+            }
+
+            // bitstreamSizeInBytes covers the slices finished so far; hwEncodeStatus 2 means
+            // the frame is complete, as it always is after a blocking lock.
+            const bool complete = !lockBitstream.doNotWait || lockBitstream.hwEncodeStatus == 2;
+            const size_t ready = lockBitstream.bitstreamSizeInBytes;
+            bool ok = true;
+            if (ready > handedOn || complete)
+            {
+                const uint8_t* bytes = static_cast<uint8_t*>(lockBitstream.bitstreamBufferPtr);
+                const size_t end = std::max(ready, handedOn);
+                ok = DeliverBitstream(state, bytes + handedOn, end - handedOn, lockBitstream.outputTimeStamp,
+                    handedOn == 0, complete);
+                handedOn = end;
+                lastProgress = std::chrono::steady_clock::now();
+                state->slicePieces++;
+                state->sliceBlockingLocks += lockBitstream.doNotWait ? 0 : 1;
+            }
+
+            status = state->funcs.nvEncUnlockBitstream(state->session, state->bitstream);
+            if (!CheckStatus(state, status, L"nvEncUnlockBitstream failed") || !ok || complete)
+            {
+                return ok && status == NV_ENC_SUCCESS;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // Harvest thread: waits for the slot's completion signal, then locks and converts its
+    // bitstream. Without a deadline the wait lasts as long as the slot is pending: a frame held
+    // for B-frame reordering completes only once the caller submits the next reference frame.
+    // While draining (after EOS) every slot must complete within 5 s.
+    bool ConsumeAsyncBitstream(SessionState* state, size_t index)
+    {
+        if (!state || !state->asyncEnabled || index >= state->asyncBitstreams.size())
+        {
+            return false;
+        }
+
+        const uint32_t pollMs = 100;
+        const uint32_t drainLimitMs = 5000;
+        uint32_t drainWaited = 0;
+        for (;;)
+        {
+            const SignalWait result = state->asyncSignals[index]->Wait(pollMs);
+            if (result == SignalWait::Signaled)
+            {
+                break;
+            }
+            if (result == SignalWait::Failed)
+            {
+                SetError(state, L"nvEnc async wait failed.");
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(state->harvestMutex);
+            if (state->harvestStop)
+            {
+                return false;
+            }
+            drainWaited = state->harvestDraining ? drainWaited + pollMs : 0;
+            if (drainWaited >= drainLimitMs)
+            {
+                LogLine(state, L"async wait timeout slot=" + std::to_wstring(index));
+                SetError(state, L"nvEnc async timeout.");
+                return false;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->harvestMutex);
+            const uint64_t latencyUs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - state->asyncSubmitTimes[index]).count());
+            state->asyncWindowLatencyUs += latencyUs;
+            state->asyncWindowCompletions++;
+            state->asyncLatencyUs += latencyUs;
+            state->asyncCompletions++;
+        }
+
+        NV_ENC_LOCK_BITSTREAM lockBitstream{};
+        lockBitstream.version = NV_ENC_LOCK_BITSTREAM_VER;
+        lockBitstream.outputBitstream = state->asyncBitstreams[index];
+        auto status = state->funcs.nvEncLockBitstream(state->session, &lockBitstream);
+        if (!CheckStatus(state, status, L"nvEncLockBitstream failed"))
+        {
+            return false;
+        }
+        ReleaseInputSurface(state, lockBitstream.outputTimeStamp);
+        bool ok = DeliverBitstream(state,
+            static_cast<uint8_t*>(lockBitstream.bitstreamBufferPtr),
+            lockBitstream.bitstreamSizeInBytes,
+            lockBitstream.outputTimeStamp);
+
+        auto unlockStatus = state->funcs.nvEncUnlockBitstream(state->session, state->asyncBitstreams[index]);
+        if (!CheckStatus(state, unlockStatus, L"nvEncUnlockBitstream failed"))
+        {
+            return false;
+        }
+        return ok;
+    }
+
+    void StartHarvestThread(SessionState* state)
+    {
+        // Samples now reach the writer from this thread while audio still arrives on the
+        // caller's, so the writer must not be started lazily by whichever gets there first.
+        // A segment session has no writer: its owner's harvest thread started that one.
+        if (!state->segmentOwner)
+        {
+            StartWriterThread(state);
+        }
+        state->harvestStop = false;
+        state->harvestDraining = false;
+        state->harvestError = false;
+        state->harvestQueue.clear();
+        state->harvestStarted = true;
+        state->harvestThread = std::thread([state]()
+        {
+            LogLine(state, L"harvest thread start");
+            for (;;)
+            {
+                size_t slot = 0;
+                {
+                    std::unique_lock<std::mutex> lock(state->harvestMutex);
+                    state->harvestCv.wait(lock, [state]()
+                    {
+                        return state->harvestStop || !state->harvestQueue.empty();
+                    });
+                    if (state->harvestStop)
+                    {
+                        break;
+                    }
+                    slot = state->harvestQueue.front();
+                }
+
+                const bool ok = ConsumeAsyncBitstream(state, slot);
+                {
+                    std::lock_guard<std::mutex> lock(state->harvestMutex);
+                    if (ok)
+                    {
+                        state->harvestQueue.pop_front();
+                        state->asyncPending[slot] = false;
+                    }
+                    else
+                    {
+                        state->harvestError = !state->harvestStop;
+                    }
+                }
+                state->slotFreeCv.notify_all();
+                if (!ok)
+                {
+                    break;
+                }
+            }
+            LogLine(state, L"harvest thread exit");
+        });
+    }
+
+    void StopHarvestThread(SessionState* state)
+    {
+        if (!state->harvestStarted)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->harvestMutex);
+            state->harvestStop = true;
+        }
+        state->harvestCv.notify_all();
+        if (state->harvestThread.joinable())
+        {
+            state->harvestThread.join();
+        }
+        state->harvestStarted = false;
+    }
+
+    // Submits between depth decisions.
+    const uint32_t kAsyncAdaptWindow = 32;
+
+    // Allocates the bitstream buffer and completion signal of one slot. On failure the slot
+    // may be half built; DestroyAsyncSlot cleans it up.
+    bool CreateAsyncSlot(SessionState* state, size_t slot, std::wstring* failure)
+    {
+        NV_ENC_CREATE_BITSTREAM_BUFFER createBitstream{};
+        createBitstream.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+        NVENCSTATUS status = state->funcs.nvEncCreateBitstreamBuffer(state->session, &createBitstream);
+        if (status != NV_ENC_SUCCESS)
+        {
+            *failure = L"nvEncCreateBitstreamBuffer failed (" + std::to_wstring(static_cast<int>(status)) + L")";
+            return false;
+        }
+        state->asyncBitstreams[slot] = createBitstream.bitstreamBuffer;
+
+        std::unique_ptr<CompletionSignal> signal = CreateCompletionSignal();
+        if (!signal)
+        {
+            *failure = L"Failed to create async event.";
+            return false;
+        }
+
+        NV_ENC_EVENT_PARAMS eventParams{};
+        eventParams.version = NV_ENC_EVENT_PARAMS_VER;
+        eventParams.completionEvent = signal->Handle();
+        status = state->funcs.nvEncRegisterAsyncEvent(state->session, &eventParams);
+        if (status != NV_ENC_SUCCESS)
+        {
+            *failure = L"nvEncRegisterAsyncEvent failed (" + std::to_wstring(static_cast<int>(status)) + L")";
+            return false;
+        }
+
+        state->asyncSignals[slot] = std::move(signal);
+        return true;
+    }
+
+    void DestroyAsyncSlot(SessionState* state, size_t slot)
+    {
+        if (state->asyncBitstreams[slot])
+        {
+            state->funcs.nvEncDestroyBitstreamBuffer(state->session, state->asyncBitstreams[slot]);
+            state->asyncBitstreams[slot] = nullptr;
+        }
+        if (state->asyncSignals[slot])
+        {
+            NV_ENC_EVENT_PARAMS eventParams{};
+            eventParams.version = NV_ENC_EVENT_PARAMS_VER;
+            eventParams.completionEvent = state->asyncSignals[slot]->Handle();
+            state->funcs.nvEncUnregisterAsyncEvent(state->session, &eventParams);
+            state->asyncSignals[slot].reset();
+        }
+    }
+
+    // Submit side. Growing allocates the new slots (a retired one is taken back as is);
+    // shrinking only stops handing out the top slots, see ReleaseRetiredAsyncSlots.
+    void ResizeAsyncSlots(SessionState* state, uint32_t depth)
+    {
+        uint32_t ready = std::min(depth, state->asyncDepth);
+        while (ready < depth)
+        {
+            if (!state->asyncBitstreams[ready])
+            {
+                std::wstring failure;
+                if (!CreateAsyncSlot(state, ready, &failure))
+                {
+                    DestroyAsyncSlot(state, ready);
+                    LogLine(state, L"async grow failed: " + failure);
+                    break;
+                }
+            }
+            ++ready;
+        }
+        if (ready == state->asyncDepth)
+        {
+            return;
+        }
+
+        state->asyncDepth = ready;
+        if (state->asyncIndex >= ready)
+        {
+            state->asyncIndex = 0;
+        }
+        state->asyncPeakDepth = std::max(state->asyncPeakDepth, ready);
+        state->asyncResizes++;
+    }
+
+    // Submit side: frees slots above the current depth once the harvester is done with them.
+    void ReleaseRetiredAsyncSlots(SessionState* state)
+    {
+        for (size_t slot = state->asyncDepth; slot < state->asyncBitstreams.size(); ++slot)
+        {
+            if (!state->asyncBitstreams[slot] && !state->asyncSignals[slot])
+            {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(state->harvestMutex);
+                if (state->asyncPending[slot])
+                {
+                    continue;
+                }
+            }
+            DestroyAsyncSlot(state, slot);
+        }
+    }
+
+    // Submit side, once per kAsyncAdaptWindow frames. By Little's law the pipeline holds
+    // latency / submit interval frames; one more slot lets the next submit find a free one.
+    // Waiting on busy slots grows the pipeline unless the previous step did not reduce the
+    // waits: then the encoder itself is the bottleneck and more slots would only cost memory.
+    // A window without waits that needs fewer slots gives one back.
+    void AdaptAsyncDepth(SessionState* state)
+    {
+        uint64_t latencyUs = 0;
+        uint32_t completions = 0;
+        {
+            std::lock_guard<std::mutex> lock(state->harvestMutex);
+            latencyUs = state->asyncWindowLatencyUs;
+            completions = state->asyncWindowCompletions;
+            state->asyncWindowLatencyUs = 0;
+            state->asyncWindowCompletions = 0;
+        }
+        const uint32_t stalls = state->asyncWindowStalls;
+        const uint64_t intervalUs = std::max<uint64_t>(state->asyncWindowIntervalUs / kAsyncAdaptWindow, 1);
+        state->asyncWindowStalls = 0;
+        state->asyncWindowIntervalUs = 0;
+        if (completions == 0)
+        {
+            return;
+        }
+
+        const uint64_t averageLatencyUs = latencyUs / completions;
+        const uint64_t inFlight = (averageLatencyUs + intervalUs - 1) / intervalUs;
+        const uint32_t needed = static_cast<uint32_t>(std::min<uint64_t>(inFlight + 1, kMaxAsyncDepth));
+        uint32_t depth = state->asyncDepth;
+        if (stalls > kAsyncAdaptWindow / 8)
+        {
+            if (stalls < state->asyncGrowStalls)
+            {
+                depth = std::min(std::max(depth + 1, needed), depth * 2);
+                state->asyncGrowStalls = stalls;
+            }
+        }
+        else
+        {
+            state->asyncGrowStalls = UINT32_MAX;
+            if (stalls == 0 && needed + 1 < depth)
+            {
+                depth--;
+            }
+        }
+        depth = std::clamp(depth, state->asyncMinDepth, kMaxAsyncDepth);
+        if (depth == state->asyncDepth)
+        {
+            return;
+        }
+
+        const uint32_t previous = state->asyncDepth;
+        ResizeAsyncSlots(state, depth);
+        LogLine(state, L"async depth " + std::to_wstring(previous) + L" -> " + std::to_wstring(state->asyncDepth)
+            + L" latency us=" + std::to_wstring(averageLatencyUs)
+            + L" interval us=" + std::to_wstring(intervalUs)
+            + L" stalls=" + std::to_wstring(stalls));
+    }
+
+    // Submit side: picks the next slot, adapting the depth every kAsyncAdaptWindow frames, and
+    // waits until the harvester has emptied it. Returns false if the harvester failed.
+    bool AcquireAsyncSlot(SessionState* state, size_t* slot)
+    {
+        if (state->asyncSubmits > 0 && state->asyncSubmits % kAsyncAdaptWindow == 0)
+        {
+            AdaptAsyncDepth(state);
+            ReleaseRetiredAsyncSlots(state);
+        }
+
+        const size_t index = state->asyncIndex;
+        *slot = index;
+        std::unique_lock<std::mutex> lock(state->harvestMutex);
+        if ((state->asyncPending[index] || state->inputWaited) && !state->harvestError)
+        {
+            state->asyncStalls++;
+            state->asyncWindowStalls++;
+        }
+        state->inputWaited = false;
+        state->slotFreeCv.wait(lock, [state, index]()
+        {
+            return !state->asyncPending[index] || state->harvestError;
+        });
+        return !state->harvestError;
+    }
+
+    // Submit side: the slot now holds a submitted frame (or one held for reordering).
+    void SubmitAsyncSlot(SessionState* state, size_t slot)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (state->asyncSubmits > 0)
+        {
+            state->asyncWindowIntervalUs += static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(now - state->asyncLastSubmit).count());
+        }
+        state->asyncLastSubmit = now;
+        state->asyncSubmits++;
+        {
+            std::lock_guard<std::mutex> lock(state->harvestMutex);
+            state->asyncSubmitTimes[slot] = now;
+            state->asyncPending[slot] = true;
+            state->harvestQueue.push_back(slot);
+        }
+        state->harvestCv.notify_one();
+        state->asyncIndex = (slot + 1) % state->asyncDepth;
+    }
+
+    // Starts with `depth` slots; AdaptAsyncDepth keeps the pipeline between minDepth and
+    // kMaxAsyncDepth.
+    bool InitializeAsyncResources(SessionState* state, uint32_t depth, uint32_t minDepth)
+    {
+        if (!state || !state->session || depth < 2 || depth > kMaxAsyncDepth)
+        {
+            return false;
+        }
+
+        state->asyncBitstreams.clear();
+        state->asyncSignals.clear();
+        state->asyncPending.clear();
+        state->asyncBitstreams.resize(kMaxAsyncDepth, nullptr);
+        state->asyncSignals.resize(kMaxAsyncDepth);
+        state->asyncPending.resize(kMaxAsyncDepth, false);
+        state->asyncSubmitTimes.assign(kMaxAsyncDepth, std::chrono::steady_clock::time_point{});
+
+        for (uint32_t i = 0; i < depth; ++i)
+        {
+            std::wstring failure;
+            if (!CreateAsyncSlot(state, i, &failure))
+            {
+                SetError(state, failure);
+                ReleaseAsyncResources(state);
+                return false;
+            }
+        }
+
+        state->asyncDepth = depth;
+        state->asyncMinDepth = std::clamp<uint32_t>(minDepth, 2, depth);
+        state->asyncPeakDepth = depth;
+        state->asyncResizes = 0;
+        state->asyncIndex = 0;
+        state->asyncSubmits = 0;
+        state->asyncStalls = 0;
+        state->asyncWindowIntervalUs = 0;
+        state->asyncWindowStalls = 0;
+        state->asyncGrowStalls = UINT32_MAX;
+        state->asyncWindowLatencyUs = 0;
+        state->asyncWindowCompletions = 0;
+        state->asyncLatencyUs = 0;
+        state->asyncCompletions = 0;
+        state->asyncEnabled = true;
+        StartHarvestThread(state);
+        LogLine(state, L"async initialized");
+        return true;
+    }
+
+    void ReleaseAsyncResources(SessionState* state)
+    {
+        if (!state)
+        {
+            return;
+        }
+
+        StopHarvestThread(state);
+        if (state->asyncEnabled)
+        {
+            LogLine(state, L"async stats depth=" + std::to_wstring(state->asyncDepth)
+                + L" min=" + std::to_wstring(state->asyncMinDepth)
+                + L" peak=" + std::to_wstring(state->asyncPeakDepth)
+                + L" resizes=" + std::to_wstring(state->asyncResizes)
+                + L" stalls=" + std::to_wstring(state->asyncStalls)
+                + L" input waits=" + std::to_wstring(state->inputWaits)
+                + L" latency avg us=" + std::to_wstring(state->asyncCompletions > 0 ? state->asyncLatencyUs / state->asyncCompletions : 0));
+        }
+        else if (state->sliceStreaming)
+        {
+            LogLine(state, L"slice readback pieces=" + std::to_wstring(state->slicePieces)
+                + L" blocking locks=" + std::to_wstring(state->sliceBlockingLocks));
+        }
+        for (size_t i = 0; i < state->asyncBitstreams.size(); ++i)
+        {
+            DestroyAsyncSlot(state, i);
+        }
+
+        state->asyncBitstreams.clear();
+        state->asyncSignals.clear();
+        state->asyncPending.clear();
+        state->asyncSubmitTimes.clear();
+        state->asyncDepth = 0;
+        state->asyncIndex = 0;
+        state->asyncEnabled = false;
+    }
+
+    // Waits for the harvester to finish every submitted slot (in submission order: with
+    // B-frames the slots hold consecutive decode-order frames).
+    bool DrainAsyncBitstreams(SessionState* state)
+    {
+        if (!state || !state->asyncEnabled)
+        {
+            return true;
+        }
+
+        LogLine(state, L"drain async bitstreams");
+        std::unique_lock<std::mutex> lock(state->harvestMutex);
+        state->harvestDraining = true;
+        state->slotFreeCv.wait(lock, [state]()
+        {
+            return state->harvestQueue.empty() || state->harvestError;
+        });
+        state->harvestDraining = false;
+        LogLine(state, L"drain async bitstreams done");
+        return !state->harvestError;
+    }
+
+    // Slices per picture with sub-frame readback: each one can be written while the encoder
+    // is still working on the next.
+    const uint32_t kStreamSlices = 4;
+
+    bool OpenEncoderSession(SessionState* state, void* device, int bitrateKbps, int codec, int quality, int rateControlMode, int maxBitrateKbps, int hevcAsync, int bFrames, int openGop)
+    {
+        const int width = state->width;
+        const int height = state->height;
+        const bool hevcAsyncOptIn = (codec == 1 && hevcAsync != 0);
+        if (!state->createInstance)
+        {
+            SetError(state, L"NvEncodeAPICreateInstance is not loaded.");
+            return false;
+        }
+
+        state->funcs.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+        auto status = state->createInstance(&state->funcs);
+        if (!CheckStatus(state, status, L"NvEncodeAPICreateInstance failed"))
+        {
+            return false;
+        }
+
+        NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS openParams{};
+        openParams.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
+        openParams.deviceType = NV_ENC_DEVICE_TYPE_DIRECTX;
+        openParams.device = device;
+        openParams.apiVersion = NVENCAPI_VERSION;
+
+        status = state->funcs.nvEncOpenEncodeSessionEx(&openParams, &state->session);
+        if (!CheckStatus(state, status, L"nvEncOpenEncodeSessionEx failed"))
+        {
+            return false;
+        }
+
+        state->initParams.version = NV_ENC_INITIALIZE_PARAMS_VER;
+        state->config.version = NV_ENC_CONFIG_VER;
+
+        const GUID encodeGuid = (codec == 1) ? NV_ENC_CODEC_HEVC_GUID : NV_ENC_CODEC_H264_GUID;
+        const GUID presetGuid = (state->fastPreset != 0)
+            ? NV_ENC_PRESET_P1_GUID
+            : (quality <= 0 ? NV_ENC_PRESET_P1_GUID : (quality == 2 ? NV_ENC_PRESET_P7_GUID : NV_ENC_PRESET_P3_GUID));
+        const NV_ENC_TUNING_INFO tuningInfo = (state->fastPreset != 0)
+            ? NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY
+            : NV_ENC_TUNING_INFO_HIGH_QUALITY;
+
+        NV_ENC_PRESET_CONFIG presetConfig{};
+        presetConfig.version = NV_ENC_PRESET_CONFIG_VER;
+        presetConfig.presetCfg.version = NV_ENC_CONFIG_VER;
+        status = state->funcs.nvEncGetEncodePresetConfigEx(state->session, encodeGuid, presetGuid, tuningInfo, &presetConfig);
+        if (!CheckStatus(state, status, L"nvEncGetEncodePresetConfigEx failed"))
+        {
+            return false;
+        }
+
+        state->config = presetConfig.presetCfg;
+
+        state->initParams.encodeGUID = encodeGuid;
+        state->initParams.presetGUID = presetGuid;
+        state->initParams.tuningInfo = tuningInfo;
+        state->initParams.encodeWidth = width;
+        state->initParams.encodeHeight = height;
+        state->initParams.maxEncodeWidth = width;
+        state->initParams.maxEncodeHeight = height;
+        state->initParams.darWidth = width;
+        state->initParams.darHeight = height;
+        state->initParams.frameRateNum = state->fps;
+        state->initParams.frameRateDen = 1;
+        state->initParams.enablePTD = 1;
+        state->initParams.reportSliceOffsets = 0;
+        state->initParams.enableSubFrameWrite = 0;
+        // Sub-frame readback (fast preset) reports slices as they finish, which the encoder only
+        // supports on synchronous sessions.
+        state->sliceStreaming = state->fastPreset != 0;
+        const bool allowAsync = !state->sliceStreaming && ((codec == 0) || (codec == 1 && hevcAsyncOptIn));
+        state->initParams.enableEncodeAsync = allowAsync ? 1 : 0;
+        state->initParams.encodeConfig = &state->config;
+
+        state->config.rcParams.rateControlMode = (rateControlMode == 1) ? NV_ENC_PARAMS_RC_VBR : NV_ENC_PARAMS_RC_CBR;
+        state->config.rcParams.averageBitRate = static_cast<uint32_t>(bitrateKbps) * 1000;
+        state->config.rcParams.maxBitRate = (rateControlMode == 1 && maxBitrateKbps > 0)
+            ? static_cast<uint32_t>(maxBitrateKbps) * 1000
+            : state->config.rcParams.averageBitRate;
+        state->config.gopLength = state->fps * 2;
+        // B-frames come back in decode order into the output buffers queued behind them, which
+        // only the async slots can hold; the sync path has a single output buffer.
+        state->bFrames = (allowAsync && state->fastPreset == 0) ? std::min(std::max(bFrames, 0), 4) : 0;
+        if (state->bFrames != bFrames && bFrames > 0)
+        {
+            LogLine(state, L"B-frames disabled (sync or low-latency mode)");
+        }
+        state->config.frameIntervalP = state->bFrames + 1;
+        if (state->sliceStreaming)
+        {
+            state->initParams.enableSubFrameWrite = 1;
+            state->initParams.reportSliceOffsets = 1;
+            // The driver fills one offset per slice; a slice is never smaller than a macroblock.
+            state->sliceOffsets.assign(static_cast<size_t>((width + 15) / 16) * ((height + 15) / 16), 0);
+        }
+        if (state->fastPreset != 0)
+        {
+            state->config.gopLength = state->fps * 4;
+            state->config.rcParams.enableAQ = 0;
+            state->config.rcParams.enableTemporalAQ = 0;
+            state->config.rcParams.enableLookahead = 0;
+            state->config.rcParams.lookaheadDepth = 0;
+        }
+
+        // Open GOP: the I-frames between IDRs let the B-frames before them in display order
+        // reference the previous GOP. They still start playback (stss / 'rap '), but resume
+        // only restarts at IDRs.
+        state->openGop = openGop != 0 && state->fastPreset == 0;
+        const uint32_t idrPeriod = state->openGop ? state->config.gopLength * 5 : state->config.gopLength;
+        if (codec == 1)
+        {
+            state->config.encodeCodecConfig.hevcConfig.repeatSPSPPS = 1;
+            state->config.encodeCodecConfig.hevcConfig.idrPeriod = idrPeriod;
+            state->config.encodeCodecConfig.hevcConfig.outputRecoveryPointSEI = state->openGop ? 1 : 0;
+        }
+        else
+        {
+            state->config.encodeCodecConfig.h264Config.repeatSPSPPS = 1;
+            state->config.encodeCodecConfig.h264Config.idrPeriod = idrPeriod;
+            state->config.encodeCodecConfig.h264Config.outputRecoveryPointSEI = state->openGop ? 1 : 0;
+        }
+        if (state->sliceStreaming)
+        {
+            // sliceMode 3: a fixed number of slices per picture, each read back once finished.
+            if (codec == 1)
+            {
+                state->config.encodeCodecConfig.hevcConfig.sliceMode = 3;
+                state->config.encodeCodecConfig.hevcConfig.sliceModeData = kStreamSlices;
+            }
+            else
+            {
+                state->config.encodeCodecConfig.h264Config.sliceMode = 3;
+                state->config.encodeCodecConfig.h264Config.sliceModeData = kStreamSlices;
+            }
+        }
+
+        status = state->funcs.nvEncInitializeEncoder(state->session, &state->initParams);
+        if (!CheckStatus(state, status, L"nvEncInitializeEncoder failed"))
+        {
+            return false;
+        }
+        state->videoBitrate = state->config.rcParams.averageBitRate;
+        state->gopLength = state->config.gopLength;
+
+        if (!allowAsync)
+        {
+            state->initParams.enableEncodeAsync = 0;
+            state->asyncEnabled = false;
+            if (codec == 1)
+            {
+                LogLine(state, L"HEVC async disabled (sync mode)");
+            }
+            NV_ENC_CREATE_BITSTREAM_BUFFER createBitstream{};
+            createBitstream.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+            status = state->funcs.nvEncCreateBitstreamBuffer(state->session, &createBitstream);
+            if (!CheckStatus(state, status, L"nvEncCreateBitstreamBuffer failed"))
+            {
+                return false;
+            }
+            state->bitstream = createBitstream.bitstreamBuffer;
+        }
+        else
+        {
+            // The depth adapts at runtime; these are the starting point and the floor.
+            uint32_t minDepth = 3;
+            if (state->config.rcParams.enableLookahead && state->config.rcParams.lookaheadDepth > 0)
+            {
+                minDepth = std::max<uint32_t>(minDepth, state->config.rcParams.lookaheadDepth + 2);
+            }
+            // A B-frame's slot completes only after the next reference frame is submitted.
+            minDepth = std::max<uint32_t>(minDepth, static_cast<uint32_t>(state->bFrames) + 3);
+            minDepth = std::min<uint32_t>(minDepth, kMaxAsyncDepth);
+            const uint32_t asyncDepth = std::max<uint32_t>(minDepth, 4);
+            LogLine(state, L"async depth=" + std::to_wstring(asyncDepth)
+                + L" min=" + std::to_wstring(minDepth)
+                + L" lookahead=" + std::to_wstring(state->config.rcParams.enableLookahead)
+                + L" depth=" + std::to_wstring(state->config.rcParams.lookaheadDepth));
+
+            if (!InitializeAsyncResources(state, asyncDepth, minDepth))
+            {
+                if (state->bFrames > 0)
+                {
+                    SetError(state, L"B-frames require async encode resources.");
+                    return false;
+                }
+                state->initParams.enableEncodeAsync = 0;
+                state->asyncEnabled = false;
+                if (codec == 1)
+                {
+                    LogLine(state, L"HEVC async failed, fallback to sync");
+                }
+                NV_ENC_CREATE_BITSTREAM_BUFFER createBitstream{};
+                createBitstream.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+                status = state->funcs.nvEncCreateBitstreamBuffer(state->session, &createBitstream);
+                if (!CheckStatus(state, status, L"nvEncCreateBitstreamBuffer failed"))
+                {
+                    return false;
+                }
+                state->bitstream = createBitstream.bitstreamBuffer;
+            }
+        }
+
+        // Registrations are made as the surfaces are first used.
+        state->inputSurfaces.clear();
+        state->inputSurfaces.resize(state->asyncEnabled ? kMaxAsyncDepth : 1);
+        state->inputWaits = 0;
+        return true;
+    }
+
+    void BeginSegmentSessions(SessionState* state)
+    {
+        if (state->segmentSessions.empty())
+        {
+            return;
+        }
+        const uint32_t idrPeriod = SameGuid(state->initParams.encodeGUID, NV_ENC_CODEC_HEVC_GUID)
+            ? state->config.encodeCodecConfig.hevcConfig.idrPeriod
+            : state->config.encodeCodecConfig.h264Config.idrPeriod;
+        BeginSegments(state, std::max<uint32_t>(idrPeriod, 1));
+        LogLine(state, L"segment encoding sessions=" + std::to_wstring(state->segmentSessions.size() + 1)
+            + L" segment frames=" + std::to_wstring(state->segmentFrames));
+    }
+
+    // Segment encoding: the session that takes the next frame, set to continue at the owner's
+    // frame index so timestamps stay global. Without extra sessions that is the state itself.
+    SessionState* NextSegmentSession(SessionState* state)
+    {
+        if (state->segmentSessions.empty())
+        {
+            return state;
+        }
+        const uint64_t segment = state->frameIndex / state->segmentFrames;
+        const size_t index = static_cast<size_t>(segment % (state->segmentSessions.size() + 1));
+        SessionState* session = index == 0 ? state : state->segmentSessions[index - 1];
+        session->frameIndex = state->frameIndex;
+        return session;
+    }
+
+    // Submit side: an input surface the encoder is done with. An idle one if there is any,
+    // else the one holding the oldest frame, once that frame's bitstream is harvested. It was
+    // submitted at least as many frames ago as there are surfaces, more than the encoder holds
+    // back for B-frames or lookahead (see minDepth), so the wait ends. The mapping from the
+    // surface's last frame is released here. Returns false if the harvester failed.
+    bool AcquireInputSurface(SessionState* state, size_t* surface)
+    {
+        if (state->inputSurfaces.empty())
+        {
+            SetError(state, L"Encoder input is not initialized.");
+            return false;
+        }
+        const size_t count = state->asyncEnabled ? std::min<size_t>(state->asyncDepth, state->inputSurfaces.size()) : 1;
+        size_t index = 0;
+        {
+            std::unique_lock<std::mutex> lock(state->harvestMutex);
+            for (size_t i = 0; i < count; ++i)
+            {
+                const SessionState::InputSurface& candidate = state->inputSurfaces[i];
+                if (!candidate.busy)
+                {
+                    index = i;
+                    break;
+                }
+                if (candidate.frame < state->inputSurfaces[index].frame)
+                {
+                    index = i;
+                }
+            }
+            if (state->inputSurfaces[index].busy && !state->harvestError)
+            {
+                state->inputWaits++;
+                state->inputWaited = true;
+            }
+            state->slotFreeCv.wait(lock, [state, index]()
+            {
+                return !state->inputSurfaces[index].busy || state->harvestError;
+            });
+            if (state->harvestError)
+            {
+                return false;
+            }
+        }
+
+        SessionState::InputSurface& input = state->inputSurfaces[index];
+        if (input.mapped)
+        {
+            auto status = state->funcs.nvEncUnmapInputResource(state->session, input.mapped);
+            input.mapped = nullptr;
+            if (!CheckStatus(state, status, L"nvEncUnmapInputResource failed"))
+            {
+                return false;
+            }
+        }
+        *surface = index;
+        return true;
+    }
+
+    // Registers the surface's resource with the session, once. The mock table takes any
+    // distinct pointers as resources.
+    bool RegisterInputSurface(SessionState* state, size_t surface, void* resource)
+    {
+        SessionState::InputSurface& input = state->inputSurfaces[surface];
+        if (input.registered)
+        {
+            return true;
+        }
+
+        NV_ENC_REGISTER_RESOURCE registerRes{};
+        registerRes.version = NV_ENC_REGISTER_RESOURCE_VER;
+        registerRes.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_DIRECTX;
+        registerRes.resourceToRegister = resource;
+        registerRes.width = state->width;
+        registerRes.height = state->height;
+        registerRes.bufferFormat = state->bufferFormat;
+        registerRes.bufferUsage = NV_ENC_INPUT_IMAGE;
+
+        auto status = state->funcs.nvEncRegisterResource(state->session, &registerRes);
+        if (!CheckStatus(state, status, L"nvEncRegisterResource failed"))
+        {
+            return false;
+        }
+        input.registered = registerRes.registeredResource;
+        return true;
+    }
+
+    // Harvest side: the frame with this timestamp is encoded, so its surface can take another.
+    // Matched by timestamp rather than slot: with B-frames the slots fill in decode order.
+    void ReleaseInputSurface(SessionState* state, uint64_t timeStamp)
+    {
+        std::lock_guard<std::mutex> lock(state->harvestMutex);
+        for (SessionState::InputSurface& input : state->inputSurfaces)
+        {
+            if (input.busy && input.frame == timeStamp)
+            {
+                input.busy = false;
+                break;
+            }
+        }
+    }
+
+    // Once the session has returned every frame (after EOS), or on teardown.
+    void UnmapInputSurfaces(SessionState* state)
+    {
+        for (SessionState::InputSurface& input : state->inputSurfaces)
+        {
+            if (input.mapped)
+            {
+                state->funcs.nvEncUnmapInputResource(state->session, input.mapped);
+                input.mapped = nullptr;
+            }
+        }
+        std::lock_guard<std::mutex> lock(state->harvestMutex);
+        for (SessionState::InputSurface& input : state->inputSurfaces)
+        {
+            input.busy = false;
+        }
+    }
+
+    // Maps an input surface and submits it. The surface stays mapped until
+    // AcquireInputSurface hands it out again.
+    bool EncodeRegisteredInput(SessionState* state, size_t surface)
+    {
+        SessionState::InputSurface& input = state->inputSurfaces[surface];
+        NV_ENC_MAP_INPUT_RESOURCE map{};
+        map.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
+        map.registeredResource = input.registered;
+        auto status = state->funcs.nvEncMapInputResource(state->session, &map);
+        if (!CheckStatus(state, status, L"nvEncMapInputResource failed"))
+        {
+            return false;
+        }
+        input.mapped = map.mappedResource;
+
+        NV_ENC_PIC_PARAMS pic{};
+        pic.version = NV_ENC_PIC_PARAMS_VER;
+        pic.inputBuffer = map.mappedResource;
+        pic.bufferFmt = state->bufferFormat;
+        pic.inputWidth = state->width;
+        pic.inputHeight = state->height;
+        size_t asyncSlot = 0;
+        if (state->asyncEnabled)
+        {
+            if (!AcquireAsyncSlot(state, &asyncSlot))
+            {
+                return false;
+            }
+            pic.outputBitstream = state->asyncBitstreams[asyncSlot];
+            pic.completionEvent = state->asyncSignals[asyncSlot]->Handle();
+        }
+        else
+        {
+            pic.outputBitstream = state->bitstream;
+        }
+        pic.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+        // Every segment opens with an IDR so it decodes on its own once stitched.
+        const SessionState* owner = state->segmentOwner ? state->segmentOwner : state;
+        if (owner->segmentFrames > 0 && state->frameIndex % owner->segmentFrames == 0)
+        {
+            pic.encodePicFlags |= NV_ENC_PIC_FLAG_FORCEIDR;
+        }
+        pic.inputTimeStamp = state->frameIndex++;
+        pic.inputDuration = 1;
+        if (state->asyncEnabled)
+        {
+            std::lock_guard<std::mutex> lock(state->harvestMutex);
+            input.frame = pic.inputTimeStamp;
+            input.busy = true;
+        }
+
+        status = state->funcs.nvEncEncodePicture(state->session, &pic);
+        const bool needMoreInput = status == NV_ENC_ERR_NEED_MORE_INPUT;
+        if (!needMoreInput && !CheckStatus(state, status, L"nvEncEncodePicture failed"))
+        {
+            // Nothing was submitted, so no harvest will free the surface.
+            std::lock_guard<std::mutex> lock(state->harvestMutex);
+            input.busy = false;
+            return false;
+        }
+
+        if (state->asyncEnabled)
+        {
+            // A frame held back as a B-frame still owns its slot: the encoder fills the slots in
+            // submission order once the next reference frame is in.
+            SubmitAsyncSlot(state, asyncSlot);
+            return true;
+        }
+        if (needMoreInput)
+        {
+            LogLine(state, L"encode needs more input");
+            return true;
+        }
+        if (state->sliceStreaming)
+        {
+            return StreamEncodedSlices(state);
+        }
+
+        NV_ENC_LOCK_BITSTREAM lockBitstream{};
+        lockBitstream.version = NV_ENC_LOCK_BITSTREAM_VER;
+        lockBitstream.outputBitstream = state->bitstream;
+        status = state->funcs.nvEncLockBitstream(state->session, &lockBitstream);
+        if (!CheckStatus(state, status, L"nvEncLockBitstream failed"))
+        {
+            return false;
+        }
+
+        bool ok = DeliverBitstream(state,
+            static_cast<uint8_t*>(lockBitstream.bitstreamBufferPtr),
+            lockBitstream.bitstreamSizeInBytes,
+            lockBitstream.outputTimeStamp);
+
+        status = state->funcs.nvEncUnlockBitstream(state->session, state->bitstream);
+        if (!CheckStatus(state, status, L"nvEncUnlockBitstream failed"))
+        {
+            return false;
+        }
+
+        return ok;
+    }
+
+    // Sends EOS and hands on everything the session still holds: the frames kept for B-frame
+    // reordering and whatever the EOS buffer returns.
+    bool FlushEncoder(SessionState* state)
+    {
+        NV_ENC_PIC_PARAMS pic{};
+        pic.version = NV_ENC_PIC_PARAMS_VER;
+        pic.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
+        if (state->asyncEnabled)
+        {
+            if (!state->bitstream)
+            {
+                NV_ENC_CREATE_BITSTREAM_BUFFER createBitstream{};
+                createBitstream.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+                auto status = state->funcs.nvEncCreateBitstreamBuffer(state->session, &createBitstream);
+                if (!CheckStatus(state, status, L"nvEncCreateBitstreamBuffer failed"))
+                {
+                    return false;
+                }
+                state->bitstream = createBitstream.bitstreamBuffer;
+            }
+            pic.outputBitstream = state->bitstream;
+            auto status = state->funcs.nvEncEncodePicture(state->session, &pic);
+            if (status != NV_ENC_SUCCESS)
+            {
+                SetError(state, L"nvEncEncodePicture (EOS) failed");
+                return false;
+            }
+            // Frames still held for B-frame reordering are flushed into their slots by the EOS,
+            // and precede anything in the EOS buffer in decode order.
+            if (!DrainAsyncBitstreams(state))
+            {
+                return false;
+            }
+
+            NV_ENC_LOCK_BITSTREAM lockBitstream{};
+            lockBitstream.version = NV_ENC_LOCK_BITSTREAM_VER;
+            lockBitstream.outputBitstream = state->bitstream;
+            status = state->funcs.nvEncLockBitstream(state->session, &lockBitstream);
+            if (!CheckStatus(state, status, L"nvEncLockBitstream failed"))
+            {
+                return false;
+            }
+
+            bool ok = DeliverBitstream(state,
+                static_cast<uint8_t*>(lockBitstream.bitstreamBufferPtr),
+                lockBitstream.bitstreamSizeInBytes,
+                lockBitstream.outputTimeStamp);
+
+            status = state->funcs.nvEncUnlockBitstream(state->session, state->bitstream);
+            if (!CheckStatus(state, status, L"nvEncUnlockBitstream failed"))
+            {
+                return false;
+            }
+            if (!ok)
+            {
+                return false;
+            }
+
+            LogLine(state, L"encode EOS submitted (sync)");
+        }
+        else
+        {
+            pic.outputBitstream = state->bitstream;
+            auto status = state->funcs.nvEncEncodePicture(state->session, &pic);
+            if (status != NV_ENC_SUCCESS)
+            {
+                SetError(state, L"nvEncEncodePicture (EOS) failed");
+                return false;
+            }
+            LogLine(state, L"encode EOS submitted");
+        }
+
+        UnmapInputSurfaces(state);
+        return true;
+    }
+
+    bool FlushSessions(SessionState* state)
+    {
+        if (!FlushEncoder(state))
+        {
+            return false;
+        }
+        for (SessionState* session : state->segmentSessions)
+        {
+            if (!FlushEncoder(session))
+            {
+                if (state->lastError.empty())
+                {
+                    SetError(state, session->lastError);
+                }
+                return false;
+            }
+        }
+        return FinishSegments(state);
+    }
+
+    void ReleaseEncoderSession(SessionState* state)
+    {
+        if (state->session)
+        {
+            ReleaseAsyncResources(state);
+            UnmapInputSurfaces(state);
+            for (SessionState::InputSurface& input : state->inputSurfaces)
+            {
+                if (input.registered)
+                {
+                    state->funcs.nvEncUnregisterResource(state->session, input.registered);
+                    input.registered = nullptr;
+                }
+            }
+            if (state->bitstream)
+            {
+                state->funcs.nvEncDestroyBitstreamBuffer(state->session, state->bitstream);
+                state->bitstream = nullptr;
+            }
+            state->funcs.nvEncDestroyEncoder(state->session);
+            state->session = nullptr;
+        }
+    }
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "NvencCore.h"
+
+#include "nvEncodeAPI.h"
+
+// NVENC session half of NvencNative: opening and configuring a session, the async output
+// slots and their harvest thread, the input surface ring, segment sessions and the EOS
+// flush. Everything here goes through the NV_ENCODE_API_FUNCTION_LIST only and never touches
+// D3D11 or Media Foundation, so on Linux it builds against nvEncodeAPI.h alone and runs
+// against the mock table (NvencMock.h, CMakeLists.txt). The encoder glue in NvencNative.cpp
+// derives its EncoderState from SessionState and supplies the D3D11 device and textures.
+namespace NvencCore
+{
+    // NVENC session on top of the muxer state.
+    struct SessionState : MuxerState
+    {
+        // NvEncodeAPICreateInstance, or the mock table standing in for the driver.
+        NVENCSTATUS(NVENCAPI* createInstance)(NV_ENCODE_API_FUNCTION_LIST*) = nullptr;
+        NV_ENCODE_API_FUNCTION_LIST funcs{};
+        void* session = nullptr;
+        NV_ENC_INITIALIZE_PARAMS initParams{};
+        NV_ENC_CONFIG config{};
+        NV_ENC_OUTPUT_PTR bitstream = nullptr;
+        std::vector<NV_ENC_OUTPUT_PTR> asyncBitstreams;
+        std::vector<std::unique_ptr<CompletionSignal>> asyncSignals;
+        std::vector<bool> asyncPending;
+        uint32_t asyncDepth = 0;
+        size_t asyncIndex = 0;
+        bool asyncEnabled = false;
+        // Adaptive depth: slots [0, asyncDepth) take new frames. The slot vectors are sized for
+        // kMaxAsyncDepth up front so they never move under the harvester; slots past asyncDepth
+        // are unallocated or retired ones released once the harvester is done with them.
+        uint32_t asyncMinDepth = 0;
+        uint32_t asyncPeakDepth = 0;
+        uint32_t asyncResizes = 0;
+        std::vector<std::chrono::steady_clock::time_point> asyncSubmitTimes;
+        std::chrono::steady_clock::time_point asyncLastSubmit{};
+        // Submit thread only: frames submitted, and the current adaptation window's submit
+        // intervals and waits for a pending slot.
+        uint64_t asyncSubmits = 0;
+        uint64_t asyncStalls = 0;
+        uint64_t asyncWindowIntervalUs = 0;
+        uint32_t asyncWindowStalls = 0;
+        // Stalls in the window that last grew the pipeline; growing again needs fewer.
+        uint32_t asyncGrowStalls = UINT32_MAX;
+        // Submit-to-completion latency, guarded by harvestMutex.
+        uint64_t asyncWindowLatencyUs = 0;
+        uint32_t asyncWindowCompletions = 0;
+        uint64_t asyncLatencyUs = 0;
+        uint64_t asyncCompletions = 0;
+        // Harvest thread: takes submitted slots oldest first, waits for their completion
+        // signal and locks and converts the bitstream, so the submitter only waits when every
+        // slot is still in flight. asyncPending and harvestQueue are guarded by harvestMutex;
+        // harvestCv wakes the harvester, slotFreeCv the submitter and drains.
+        std::thread harvestThread;
+        bool harvestStarted = false;
+        std::mutex harvestMutex;
+        std::condition_variable harvestCv;
+        std::condition_variable slotFreeCv;
+        std::deque<size_t> harvestQueue;
+        bool harvestStop = false;
+        bool harvestDraining = false;
+        bool harvestError = false;
+        NV_ENC_BUFFER_FORMAT bufferFormat = NV_ENC_BUFFER_FORMAT_ARGB;
+        NV_ENC_BUFFER_FORMAT originalBufferFormat = NV_ENC_BUFFER_FORMAT_ARGB;
+        int fastPreset = 0;
+        // Sub-frame readback (fast preset): slices are read back as the encoder finishes them.
+        // slicePieces counts the pieces handed on, sliceBlockingLocks the frames whose rest
+        // was waited for in a blocking lock once polling stopped making progress.
+        bool sliceStreaming = false;
+        std::vector<uint32_t> sliceOffsets;
+        uint64_t slicePieces = 0;
+        uint64_t sliceBlockingLocks = 0;
+        // Input ring: each frame is copied (or converted) into a surface of its own, registered
+        // once, so the copy of the next frame does not wait for the encoder to finish reading
+        // the last one. Async sessions use as many surfaces as slots (asyncDepth), sync ones a
+        // single surface; the vector is sized by OpenEncoderSession and never moves under the
+        // harvester. busy and frame are guarded by harvestMutex. The resources behind the
+        // surfaces (D3D11 textures) belong to the caller.
+        struct InputSurface
+        {
+            NV_ENC_REGISTERED_PTR registered = nullptr;
+            // Kept from submit until the surface is taken again: the encoder reads the input
+            // until the frame's output is complete.
+            NV_ENC_INPUT_PTR mapped = nullptr;
+            // inputTimeStamp of the frame last submitted from it; busy until that frame's
+            // bitstream has been harvested.
+            uint64_t frame = 0;
+            bool busy = false;
+        };
+        std::vector<InputSurface> inputSurfaces;
+        uint64_t inputWaits = 0;
+        // The frame being submitted waited for its surface. With as many surfaces as slots that
+        // is the pipeline's backpressure as well: AcquireAsyncSlot counts it as the frame's stall.
+        bool inputWaited = false;
+        // Segment encoding: extra sessions on the same device, each a state of its own whose
+        // output goes to segmentOwner's stitcher. Frames are dealt segmentFrames at a time,
+        // round-robin starting with the owner, so the engines encode different segments at once.
+        std::vector<SessionState*> segmentSessions;
+        SessionState* segmentOwner = nullptr;
+    };
+
+    // At most this many sessions encode segments side by side (GPUs have up to three engines).
+    const int kMaxSegmentSessions = 3;
+    // Upper bound for in-flight slots, and so for input surfaces.
+    const uint32_t kMaxAsyncDepth = 32;
+
+    bool CheckStatus(SessionState* state, NVENCSTATUS status, const wchar_t* message);
+    std::vector<uint8_t> QuerySessionCodecPrivate(SessionState* state);
+
+    // Opens a session on device through state->createInstance and configures it. The caller
+    // sets width, height, fps, fastPreset and the buffer formats first (the fast preset needs
+    // an NV12 input it can convert to). Starts the harvest thread on async sessions.
+    bool OpenEncoderSession(SessionState* state, void* device, int bitrateKbps, int codec, int quality, int rateControlMode, int maxBitrateKbps, int hevcAsync, int bFrames, int openGop);
+    bool InitializeAsyncResources(SessionState* state, uint32_t depth, uint32_t minDepth);
+    void ReleaseAsyncResources(SessionState* state);
+    bool DrainAsyncBitstreams(SessionState* state);
+
+    // Splits the frame range into IDR periods across state->segmentSessions, which the caller
+    // has opened with segmentOwner set to state.
+    void BeginSegmentSessions(SessionState* state);
+    SessionState* NextSegmentSession(SessionState* state);
+
+    // Per frame: AcquireInputSurface picks a surface the encoder is done with, the caller fills
+    // its resource, RegisterInputSurface registers it (once) and EncodeRegisteredInput maps and
+    // submits it.
+    bool AcquireInputSurface(SessionState* state, size_t* surface);
+    bool RegisterInputSurface(SessionState* state, size_t surface, void* resource);
+    bool EncodeRegisteredInput(SessionState* state, size_t surface);
+
+    bool FlushEncoder(SessionState* state);
+    // FlushEncoder on the state and each of its segment sessions, then the segments are
+    // checked and stitched back into order (FinishSegments).
+    bool FlushSessions(SessionState* state);
+    // Destroys the session with its slots and registrations; the surfaces' resources stay.
+    void ReleaseEncoderSession(SessionState* state);
+}
@@ -0,0 +1,91 @@
+#include "NvencSessionTestSupport.h"
+
+using namespace NvencCore;
+
+namespace NvencTest
+{
+    namespace
+    {
+        // Stand-ins for the D3D11 textures: the mock only needs distinct pointers to register.
+        uint8_t g_inputResources[kMaxAsyncDepth];
+
+        bool OpenMockSession(SessionState* session, const MockSessionOptions& options)
+        {
+            session->width = 1920;
+            session->height = 1080;
+            session->fps = options.fps;
+            session->fastPreset = options.fastPreset;
+            session->bufferFormat = options.fastPreset != 0 ? NV_ENC_BUFFER_FORMAT_NV12 : NV_ENC_BUFFER_FORMAT_ARGB;
+            session->createInstance = NvencMockCreateInstance;
+            return OpenEncoderSession(session, nullptr, 8000, options.codec, 1, 0, 0, options.hevcAsync, options.bFrames, options.openGop);
+        }
+    }
+
+    void ConfigureMock(NvencMockConfig config)
+    {
+#ifndef _WIN32
+        config.signalEvent = [](void* completionEvent) { static_cast<CompletionSignal*>(completionEvent)->Signal(); };
+#endif
+        NvencMockConfigure(config);
+    }
+
+    bool OpenMockSessions(SessionState* state, const MockSessionOptions& options)
+    {
+        bool ok = OpenMockSession(state, options) && InitializeMp4Writer(state, options.codec == 1, {});
+        for (int i = 1; ok && i < options.sessions; ++i)
+        {
+            auto* session = new SessionState();
+            session->segmentOwner = state;
+            state->segmentSessions.push_back(session);
+            ok = OpenMockSession(session, options) && session->asyncEnabled;
+            if (!ok)
+            {
+                SetError(state, L"segment session: " + session->lastError);
+            }
+        }
+        if (ok)
+        {
+            BeginSegmentSessions(state);
+        }
+        return ok;
+    }
+
+    bool EncodeMockFrame(SessionState* state, SessionState** session, size_t* surface)
+    {
+        SessionState* next = NextSegmentSession(state);
+        size_t index = 0;
+        const bool ok = AcquireInputSurface(next, &index)
+            && RegisterInputSurface(next, index, &g_inputResources[index])
+            && EncodeRegisteredInput(next, index);
+        state->frameIndex = next->frameIndex;
+        if (!ok && state->lastError.empty())
+        {
+            SetError(state, next->lastError);
+        }
+        if (session)
+        {
+            *session = next;
+        }
+        if (surface)
+        {
+            *surface = index;
+        }
+        return ok;
+    }
+
+    void DestroyMockSessions(SessionState* state, bool removeJournal)
+    {
+        for (SessionState* session : state->segmentSessions)
+        {
+            ReleaseEncoderSession(session);
+            delete session;
+        }
+        state->segmentSessions.clear();
+        ReleaseEncoderSession(state);
+        StopWriterThread(state);
+        state->file.Close();
+        CloseJournal(state, removeJournal);
+        CloseLog(state);
+        delete state;
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "NvencSession.h"
+#include "NvencMock.h"
+#include "NvencTestSupport.h"
+
+// Fixtures shared by the load test and the tests of the session code against the mock NVENC
+// table: opening the sessions the way NvencCreate does, one frame through the input ring,
+// and the teardown. There is no texture copy; the input surfaces are registered with stand-in
+// resources.
+namespace NvencTest
+{
+    // Applies config to sessions opened afterwards. Off Windows, the completion events the
+    // mock signals are the sessions' CompletionSignals.
+    void ConfigureMock(NvencMockConfig config);
+
+    struct MockSessionOptions
+    {
+        int fps = 30;
+        int codec = 0;
+        int hevcAsync = 1;
+        int bFrames = 0;
+        int openGop = 0;
+        // Fast preset: sync encode with sub-frame (slice) readback from an NV12 input.
+        int fastPreset = 0;
+        // More than one: segment sessions, which must come up async like NvencCreate's.
+        int sessions = 1;
+    };
+
+    // Opens state on the mock (1080p, CBR 8 Mbps, quality preset P3), starts its MP4 writer
+    // with the layout and audio the caller has set, then opens the segment sessions and splits
+    // the frame range across them. On failure the error is on state.
+    bool OpenMockSessions(NvencCore::SessionState* state, const MockSessionOptions& options);
+
+    // Encodes the next frame on the session whose turn it is; session and surface, when
+    // given, receive where it went. A session's error is copied to state.
+    bool EncodeMockFrame(NvencCore::SessionState* state, NvencCore::SessionState** session = nullptr, size_t* surface = nullptr);
+
+    // Releases the segment sessions first (their harvest threads still hand frames to the
+    // owner), then state's session, writer, file, journal and log, and deletes state.
+    void DestroyMockSessions(NvencCore::SessionState* state, bool removeJournal);
+}
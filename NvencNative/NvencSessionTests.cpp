@@ -0,0 +1,326 @@
+// Checks of the session code (NvencSession.cpp) against the mock NVENC table, which fails any
+// map, unmap or submit of an input the encoder is still reading (NV_ENC_ERR_INVALID_CALL), so
+// a run that completes never handed out a busy surface. Each test is selected by name and
+// returns non-zero on the first mismatch, printing what differed. CMakeLists.txt registers
+// one ctest test per name.
+//
+//   nvenc_session_tests input_ring|input_ring_sync|input_ring_bframes|segment_sessions|slice_readback
+
+#include "NvencSessionTestSupport.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <string>
+#include <utility>
+
+using namespace NvencCore;
+using namespace NvencTest;
+
+namespace
+{
+    // nvEncRegisterResource of the mock, wrapped to count registrations.
+    NVENCSTATUS(NVENCAPI* g_registerResource)(void*, NV_ENC_REGISTER_RESOURCE*) = nullptr;
+    uint32_t g_registrations = 0;
+
+    NVENCSTATUS NVENCAPI CountRegistration(void* encoder, NV_ENC_REGISTER_RESOURCE* params)
+    {
+        ++g_registrations;
+        return g_registerResource(encoder, params);
+    }
+
+    struct RunOptions
+    {
+        const char* output = nullptr;
+        uint64_t frames = 300;
+        MockSessionOptions session;
+        NvencMockConfig mock;
+    };
+
+    struct RunResult
+    {
+        bool ok = false;
+        uint64_t written = 0;
+        bool asyncEnabled = false;
+        uint32_t peakDepth = 0;
+        uint64_t inputWaits = 0;
+        uint64_t segmentsStitched = 0;
+        uint32_t segmentFrames = 0;
+        // Distinct (session, surface) pairs handed out by AcquireInputSurface.
+        size_t surfacesUsed = 0;
+        uint32_t registrations = 0;
+        uint64_t slicePieces = 0;
+        uint64_t sliceBlockingLocks = 0;
+    };
+
+    void CountRegistrations(SessionState* session)
+    {
+        g_registerResource = session->funcs.nvEncRegisterResource;
+        session->funcs.nvEncRegisterResource = CountRegistration;
+    }
+
+    // Encodes options.frames frames through the input ring into a standard MP4 and tears
+    // everything down again.
+    RunResult Run(const RunOptions& options)
+    {
+        ConfigureMock(options.mock);
+        g_registrations = 0;
+
+        auto* state = new SessionState();
+        state->outputPath = WidePath(options.output);
+        bool ok = OpenMockSessions(state, options.session);
+        if (ok)
+        {
+            CountRegistrations(state);
+            for (SessionState* session : state->segmentSessions)
+            {
+                CountRegistrations(session);
+            }
+        }
+
+        std::set<std::pair<SessionState*, size_t>> surfaces;
+        for (uint64_t frame = 0; ok && frame < options.frames; ++frame)
+        {
+            SessionState* session = nullptr;
+            size_t surface = 0;
+            ok = EncodeMockFrame(state, &session, &surface);
+            surfaces.insert({ session, surface });
+            if (!ok)
+            {
+                printf("  frame %llu: %s\n", static_cast<unsigned long long>(frame),
+                    std::string(state->lastError.begin(), state->lastError.end()).c_str());
+            }
+        }
+        ok = ok && FlushSessions(state) && FinalizeMp4(state);
+        if (!ok && !state->lastError.empty())
+        {
+            printf("  %s\n", std::string(state->lastError.begin(), state->lastError.end()).c_str());
+        }
+
+        RunResult result;
+        result.ok = ok;
+        result.written = state->sampleSizes.size();
+        result.asyncEnabled = state->asyncEnabled;
+        result.peakDepth = state->asyncPeakDepth;
+        result.inputWaits = state->inputWaits;
+        result.segmentsStitched = state->segmentsStitched;
+        result.segmentFrames = state->segmentFrames;
+        result.surfacesUsed = surfaces.size();
+        result.registrations = g_registrations;
+        result.slicePieces = state->slicePieces;
+        result.sliceBlockingLocks = state->sliceBlockingLocks;
+        for (SessionState* session : state->segmentSessions)
+        {
+            result.inputWaits += session->inputWaits;
+        }
+        DestroyMockSessions(state, true);
+        return result;
+    }
+
+    bool CheckWritten(const char* test, const RunOptions& options, const RunResult& result)
+    {
+        if (!result.ok || result.written != options.frames)
+        {
+            printf("%s: run %s, %llu of %llu frames written\n", test, result.ok ? "ok" : "failed",
+                static_cast<unsigned long long>(result.written), static_cast<unsigned long long>(options.frames));
+            return false;
+        }
+        // Each surface is registered once, however often it is reused.
+        if (result.registrations != result.surfacesUsed)
+        {
+            printf("%s: %u registrations for %zu surfaces\n", test, result.registrations, result.surfacesUsed);
+            return false;
+        }
+        return true;
+    }
+
+    bool TestInputRing()
+    {
+        // Submitting faster than the 4 ms the mock takes per frame fills every surface, so
+        // surfaces are reused as soon as their frame is harvested and no earlier.
+        RunOptions options;
+        options.output = "session_input_ring.mp4";
+        options.mock.latencyMicroseconds = 4000;
+        options.mock.jitterMicroseconds = 2000;
+        options.mock.engineMicroseconds = 500;
+        options.mock.lockBusyPolls = 1;
+        const RunResult result = Run(options);
+        if (!CheckWritten("input_ring", options, result))
+        {
+            return false;
+        }
+        if (!result.asyncEnabled || result.surfacesUsed < 2 || result.surfacesUsed > result.peakDepth)
+        {
+            printf("input_ring: async %d, %zu surfaces used, peak depth %u\n", result.asyncEnabled ? 1 : 0,
+                result.surfacesUsed, result.peakDepth);
+            return false;
+        }
+        printf("input_ring: ok, %zu surfaces, %llu input waits\n", result.surfacesUsed,
+            static_cast<unsigned long long>(result.inputWaits));
+        return true;
+    }
+
+    bool TestInputRingSync()
+    {
+        // Without async slots each frame is encoded before the next is copied: one surface.
+        RunOptions options;
+        options.output = "session_input_ring_sync.mp4";
+        options.frames = 120;
+        options.session.codec = 1;
+        options.session.hevcAsync = 0;
+        options.mock.latencyMicroseconds = 500;
+        options.mock.engineMicroseconds = 100;
+        const RunResult result = Run(options);
+        if (!CheckWritten("input_ring_sync", options, result))
+        {
+            return false;
+        }
+        if (result.asyncEnabled || result.surfacesUsed != 1)
+        {
+            printf("input_ring_sync: async %d, %zu surfaces used\n", result.asyncEnabled ? 1 : 0, result.surfacesUsed);
+            return false;
+        }
+        printf("input_ring_sync: ok\n");
+        return true;
+    }
+
+    bool TestInputRingBFrames()
+    {
+        // A B-frame's input is read until the reference frame after it is encoded, so its
+        // surface stays busy across later submits; the ring must neither hand it out early nor
+        // wait for it forever.
+        RunOptions options;
+        options.output = "session_input_ring_bframes.mp4";
+        options.session.codec = 1;
+        options.session.bFrames = 3;
+        options.mock.latencyMicroseconds = 3000;
+        options.mock.jitterMicroseconds = 1000;
+        options.mock.engineMicroseconds = 500;
+        const RunResult result = Run(options);
+        if (!CheckWritten("input_ring_bframes", options, result))
+        {
+            return false;
+        }
+        printf("input_ring_bframes: ok, %zu surfaces, %llu input waits\n", result.surfacesUsed,
+            static_cast<unsigned long long>(result.inputWaits));
+        return true;
+    }
+
+    bool TestSegmentSessions()
+    {
+        // Three sessions take IDR periods in turn, each with a ring of its own, and their
+        // segments are stitched back into one track.
+        RunOptions options;
+        options.output = "session_segments.mp4";
+        options.frames = 10 * 60 + 17;
+        options.session.sessions = 3;
+        options.mock.latencyMicroseconds = 3000;
+        options.mock.engineMicroseconds = 500;
+        const RunResult result = Run(options);
+        if (!CheckWritten("segment_sessions", options, result))
+        {
+            return false;
+        }
+        const uint64_t segments = result.segmentFrames > 0
+            ? (options.frames + result.segmentFrames - 1) / result.segmentFrames
+            : 0;
+        if (segments == 0 || result.segmentsStitched != segments)
+        {
+            printf("segment_sessions: %llu segments stitched, expected %llu\n",
+                static_cast<unsigned long long>(result.segmentsStitched), static_cast<unsigned long long>(segments));
+            return false;
+        }
+        printf("segment_sessions: ok, %llu segments\n", static_cast<unsigned long long>(segments));
+        return true;
+    }
+
+    std::vector<uint8_t> ReadWholeFile(const char* path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    bool TestSliceReadback()
+    {
+        // Fast preset reads each frame back in pieces as its slices finish. The same frames
+        // read back whole (every poll busy, so each frame ends in a blocking lock) must give a
+        // byte-identical file: the muxer joins the pieces into the samples it would have written.
+        RunOptions options;
+        options.output = "session_slices.mp4";
+        options.frames = 150;
+        options.session.fastPreset = 1;
+        options.mock.latencyMicroseconds = 2000;
+        options.mock.engineMicroseconds = 500;
+        options.mock.lockBusyPolls = 2;
+        const RunResult sliced = Run(options);
+        if (!CheckWritten("slice_readback", options, sliced))
+        {
+            return false;
+        }
+        RunOptions whole = options;
+        whole.output = "session_slices_whole.mp4";
+        whole.mock.lockBusyPolls = 1000000;
+        const RunResult blocking = Run(whole);
+        if (!CheckWritten("slice_readback", whole, blocking))
+        {
+            return false;
+        }
+        printf("slice_readback: %llu pieces (%llu blocking locks) for %llu frames, whole: %llu pieces (%llu blocking locks)\n",
+            static_cast<unsigned long long>(sliced.slicePieces), static_cast<unsigned long long>(sliced.sliceBlockingLocks),
+            static_cast<unsigned long long>(options.frames), static_cast<unsigned long long>(blocking.slicePieces),
+            static_cast<unsigned long long>(blocking.sliceBlockingLocks));
+        if (sliced.asyncEnabled || sliced.slicePieces <= options.frames
+            || blocking.slicePieces != options.frames || blocking.sliceBlockingLocks != options.frames)
+        {
+            printf("slice_readback: frames were not read back as expected\n");
+            return false;
+        }
+        const std::vector<uint8_t> slicedFile = ReadWholeFile(options.output);
+        const std::vector<uint8_t> wholeFile = ReadWholeFile(whole.output);
+        if (slicedFile.empty() || slicedFile != wholeFile)
+        {
+            printf("slice_readback: %zu bytes read back in pieces, %zu read back whole, files differ\n",
+                slicedFile.size(), wholeFile.size());
+            return false;
+        }
+        printf("slice_readback: ok, %zu bytes identical\n", slicedFile.size());
+        return true;
+    }
+
+    struct Test
+    {
+        const char* name;
+        bool (*run)();
+    };
+
+    const Test kTests[] = {
+        { "input_ring", TestInputRing },
+        { "input_ring_sync", TestInputRingSync },
+        { "input_ring_bframes", TestInputRingBFrames },
+        { "segment_sessions", TestSegmentSessions },
+        { "slice_readback", TestSliceReadback },
+    };
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: nvenc_session_tests <test>\n");
+        for (const Test& test : kTests)
+        {
+            printf("  %s\n", test.name);
+        }
+        return 2;
+    }
+    for (const Test& test : kTests)
+    {
+        if (strcmp(argv[1], test.name) == 0)
+        {
+            return test.run() ? 0 : 1;
+        }
+    }
+    printf("unknown test %s\n", argv[1]);
+    return 2;
+}
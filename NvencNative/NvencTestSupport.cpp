@@ -0,0 +1,128 @@
+#include "NvencTestSupport.h"
+
+#include <cstring>
+
+using namespace NvencCore;
+
+namespace NvencTest
+{
+    namespace
+    {
+        // NAL header bytes (and fixed leading payload), then payload pattern bytes.
+        void AppendNal(std::vector<uint8_t>& out, std::initializer_list<uint8_t> header, size_t payload)
+        {
+            static const uint8_t kStartCode[] = { 0, 0, 0, 1 };
+            out.insert(out.end(), kStartCode, kStartCode + 4);
+            out.insert(out.end(), header);
+            for (size_t i = 0; i < payload; ++i)
+            {
+                out.push_back(static_cast<uint8_t>(1 + i % 255));
+            }
+        }
+    }
+
+    std::wstring WidePath(const char* path)
+    {
+        return std::wstring(path, path + strlen(path));
+    }
+
+    void BuildAccessUnit(std::vector<uint8_t>& out, uint64_t frame, bool idr, bool hevc, size_t sliceBytes, std::mt19937* random)
+    {
+        out.clear();
+        if (hevc)
+        {
+            AppendNal(out, { 32 << 1, 1 }, 22);
+            AppendNal(out, { 33 << 1, 1 }, 40);
+            AppendNal(out, { 34 << 1, 1 }, 6);
+            AppendNal(out, { static_cast<uint8_t>((idr ? 19 : 1) << 1), 1, 0xAF }, 0);
+        }
+        else
+        {
+            AppendNal(out, { 0x67, 0x64, 0x00, 0x28, 0xAC, 0x2B, 0x40, 0x3C, 0x01, 0x13, 0xF2 }, 0);
+            AppendNal(out, { 0x68, 0xEE, 0x3C, 0xB0 }, 0);
+            AppendNal(out, { static_cast<uint8_t>(idr ? 0x65 : 0x41), static_cast<uint8_t>(idr ? 0x88 : 0x9A) }, 0);
+        }
+        const size_t payload = out.size();
+        for (size_t i = 0; i < sliceBytes; ++i)
+        {
+            out.push_back(static_cast<uint8_t>(1 + (random ? (*random)() : frame * 7 + i) % 255));
+        }
+        uint64_t rest = frame;
+        for (size_t i = std::min<size_t>(sliceBytes, 4); i-- > 0; rest /= 255)
+        {
+            out[payload + i] = static_cast<uint8_t>(1 + rest % 255);
+        }
+    }
+
+    uint64_t ReadFrameNumber(const uint8_t* payload)
+    {
+        uint64_t frame = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            frame = frame * 255 + (payload[i] - 1);
+        }
+        return frame;
+    }
+
+    uint64_t PresentationFrame(uint64_t n, uint64_t frames, int bFrames)
+    {
+        if (n == 0 || bFrames == 0)
+        {
+            return n;
+        }
+        const uint64_t group = static_cast<uint64_t>(bFrames) + 1;
+        const uint64_t groupStart = (n - 1) / group * group + 1;
+        const uint64_t reference = std::min(groupStart + group - 1, frames - 1);
+        return n == groupStart ? reference : n - 1;
+    }
+
+    bool ProduceSegments(MuxerState* state, const SegmentStream& stream, uint64_t first, uint64_t step, uint32_t seed, uint64_t* bytes)
+    {
+        std::mt19937 random(seed);
+        std::vector<uint8_t> accessUnit;
+        for (uint64_t segment = first; segment * stream.segmentFrames < stream.frames; segment += step)
+        {
+            const uint64_t start = segment * stream.segmentFrames;
+            const uint64_t length = std::min<uint64_t>(stream.segmentFrames, stream.frames - start);
+            for (uint64_t n = 0; n < length; ++n)
+            {
+                const uint64_t frame = start + PresentationFrame(n, length, stream.bFrames);
+                const size_t sliceBytes = (n == 0 ? stream.idrBytes : stream.frameBytes)
+                    + (stream.jitterBytes > 0 ? random() % stream.jitterBytes : 0);
+                BuildAccessUnit(accessUnit, frame, n == 0, stream.hevc, sliceBytes, &random);
+                if (bytes)
+                {
+                    *bytes += accessUnit.size();
+                }
+                if (!StitchSegmentBitstream(state, accessUnit.data(), accessUnit.size(), frame))
+                {
+                    return false;
+                }
+                if (stream.pauses && random() % 4 == 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(random() % 200));
+                }
+            }
+        }
+        return true;
+    }
+
+    bool QueueAudioUpTo(MuxerState* state, uint64_t frame, int fps, uint64_t* audioFrames, uint64_t* bytes, std::mt19937* random)
+    {
+        while (*audioFrames * kAacFrameSamples * static_cast<uint64_t>(fps) < (frame + 1) * 48000)
+        {
+            std::vector<uint8_t> payload = state->samplePool.Acquire(512);
+            payload.assign(300 + (random ? (*random)() : *audioFrames) % 200, 0x21);
+            if (bytes)
+            {
+                *bytes += payload.size();
+            }
+            if (!QueueSample(state, MuxerState::EncodedSample{ std::move(payload), false, true, kAacFrameSamples }))
+            {
+                return false;
+            }
+            ++*audioFrames;
+        }
+        return true;
+    }
+}
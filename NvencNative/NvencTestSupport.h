@@ -0,0 +1,53 @@
+#pragma once
+
+#include "NvencCore.h"
+
+#include <random>
+
+// Fixtures shared by the benches and tests of the core (CMakeLists.txt links them into each):
+// synthetic access units whose slice payload carries the frame number, GOP-long segments fed
+// to the stitcher the way a session's harvest thread feeds them, and AAC-sized audio paced to
+// the video.
+namespace NvencTest
+{
+    std::wstring WidePath(const char* path);
+
+    // Parameter sets on every access unit (repeatSPSPPS), then one IDR or P slice (H.264 P
+    // slices start with first_mb_in_slice 0, slice_type 5). The slice payload is sliceBytes
+    // non-zero bytes, so no start code or emulation prevention can occur in it, and starts with
+    // the frame number in base 255 (ReadFrameNumber). The rest is random, or a pattern of the
+    // frame number without random.
+    void BuildAccessUnit(std::vector<uint8_t>& out, uint64_t frame, bool idr, bool hevc, size_t sliceBytes,
+        std::mt19937* random = nullptr);
+    // The frame number at the start of a slice payload built by BuildAccessUnit.
+    uint64_t ReadFrameNumber(const uint8_t* payload);
+
+    // Frame n in decode order of frames frames with bFrames B-frames between references, as
+    // NVENC delivers them: each reference comes ahead of the B-frames displayed before it.
+    uint64_t PresentationFrame(uint64_t n, uint64_t frames, int bFrames);
+
+    // A segmented stream: segments of segmentFrames frames, each a closed GOP opening with an
+    // IDR. Slices are idrBytes or frameBytes plus up to jitterBytes.
+    struct SegmentStream
+    {
+        uint64_t frames = 0;
+        uint32_t segmentFrames = 30;
+        bool hevc = false;
+        int bFrames = 0;
+        size_t idrBytes = 2000;
+        size_t frameBytes = 2000;
+        size_t jitterBytes = 0;
+        // Short random pauses between frames, so concurrent producers interleave unevenly.
+        bool pauses = false;
+    };
+
+    // One encoder session of a segmented run: segments first, first + step, ... in decode
+    // order into StitchSegmentBitstream. bytes, when given, accumulates what was produced.
+    bool ProduceSegments(NvencCore::MuxerState* state, const SegmentStream& stream, uint64_t first, uint64_t step, uint32_t seed,
+        uint64_t* bytes = nullptr);
+
+    // Queues 48 kHz AAC frames (300 to 500 bytes, random or cycling without random) up to the
+    // end of video frame frame at fps.
+    bool QueueAudioUpTo(NvencCore::MuxerState* state, uint64_t frame, int fps, uint64_t* audioFrames, uint64_t* bytes = nullptr,
+        std::mt19937* random = nullptr);
+}